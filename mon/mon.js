@@ -63,6 +63,13 @@ const etcd_tree = {
             // client and osd
             tcp_header_buffer_size: 65536,
             use_sync_send_recv: false,
+            use_direct_recv: false,
+            tcp_zerocopy_threshold: 0,
+            use_multishot_recv: false,
+            multishot_recv_buffers: 16,
+            use_shm: false,
+            shm_ring_size: 1048576,
+            osd_peer_connections: 1, // min: 1, max: 64
             use_rdma: true,
             rdma_device: null, // for example, "rocep5s0f0"
             rdma_port_num: 1,
@@ -83,6 +90,7 @@ const etcd_tree = {
             osd_idle_timeout: 5, // seconds. min: 1
             osd_ping_timeout: 5, // seconds. min: 1
             up_wait_retry_interval: 500, // ms. min: 50
+            direct_ec_reads: false, // read data chunks of clean EC PGs directly from their OSDs
             // osd
             etcd_report_interval: 5, // seconds
             etcd_keepalive_interval: 10, // seconds, default is etcd_report_interval*2
@@ -92,12 +100,23 @@ const etcd_tree = {
             bind_port: 0,
             autosync_interval: 5,
             autosync_writes: 128,
-            client_queue_depth: 128, // unused
-            recovery_queue_depth: 4,
+            client_queue_depth: 128, // maximum client operations in flight per connection, 0 = unlimited
+            primary_queue_depth: 512, // maximum running client operations, excess ones are scheduled fairly, 0 = unlimited
+            recovery_queue_depth: 4, // total for degraded and misplaced objects, split dynamically if recovery_tune_interval > 0
+            recovery_tune_interval: 1, // seconds, 0 = use fixed recovery_queue_depth
+            recovery_tune_latency_us: 10000, // target client op latency during recovery
+            recovery_tune_queue_depth: 64, // target blockstore queue depth during recovery
+            recovery_max_mbs: 0, // soft recovery bandwidth limit, 0 = unlimited
             recovery_sync_batch: 16,
+            peering_list_limit: 262144, // max clean objects per OSD listing during peering, 0 = unlimited
+            peering_log_size: 1024, // recent changes remembered per PG to re-peer clean PGs without listing, 0 = disabled
+            peering_pg_limit: 16, // max PGs listing objects at the same time, 0 = unlimited
             readonly: false,
             no_recovery: false,
             no_rebalance: false,
+            detect_zero_writes: false, // skip or delete instead of writing all-zero data in replicated pools
+            balanced_reads: false, // read from the least loaded replica in clean replicated PGs
+            qos_burst_ms: 100, // allowed burst length above image and pool QoS limits
             print_stats_interval: 3,
             slow_log_interval: 10,
             // blockstore - fixed in superblock
@@ -146,6 +165,9 @@ const etcd_tree = {
                 failure_domain: 'host',
                 max_osd_combinations: 10000,
                 pg_stripe_size: 4194304,
+                // total I/O limits for all images of the pool on each primary OSD
+                qos_iops?: 0,
+                qos_mbs?: 0,
                 root_node?: 'rack1',
                 // restrict pool to OSDs having all of these tags
                 osd_tags?: 'nvme' | [ 'nvme', ... ],
@@ -177,6 +199,8 @@ const etcd_tree = {
                     parent_pool?: <pool_id>,
                     parent_id?: <inode_t>,
                     readonly?: boolean,
+                    qos_iops?: uint64_t, // per-image limits enforced by primary OSDs
+                    qos_mbs?: uint64_t,
                 }
             }
         }, */
@@ -214,8 +238,8 @@ const etcd_tree = {
         },
         inodestats: {
             /* <inode_t>: {
-                read: { count: uint64_t, usec: uint64_t, bytes: uint64_t },
-                write: { count: uint64_t, usec: uint64_t, bytes: uint64_t },
+                read: { count: uint64_t, usec: uint64_t, bytes: uint64_t, qos_usec: uint64_t },
+                write: { count: uint64_t, usec: uint64_t, bytes: uint64_t, qos_usec: uint64_t },
                 delete: { count: uint64_t, usec: uint64_t, bytes: uint64_t },
             }, */
         },
@@ -1382,9 +1406,9 @@ class Mon
         const inode_stats = {};
         const inode_stub = () => ({
             raw_used: 0n,
-            read: { count: 0n, usec: 0n, bytes: 0n },
-            write: { count: 0n, usec: 0n, bytes: 0n },
-            delete: { count: 0n, usec: 0n, bytes: 0n },
+            read: { count: 0n, usec: 0n, bytes: 0n, qos_usec: 0n },
+            write: { count: 0n, usec: 0n, bytes: 0n, qos_usec: 0n },
+            delete: { count: 0n, usec: 0n, bytes: 0n, qos_usec: 0n },
         });
         const seen_pools = {};
         for (const pool_id in this.state.config.pools)
@@ -1432,6 +1456,7 @@ class Mon
                         inode_stats[pool_id][inode_num][op].count += BigInt(ist[pool_id][inode_num][op].count||0);
                         inode_stats[pool_id][inode_num][op].usec += BigInt(ist[pool_id][inode_num][op].usec||0);
                         inode_stats[pool_id][inode_num][op].bytes += BigInt(ist[pool_id][inode_num][op].bytes||0);
+                        inode_stats[pool_id][inode_num][op].qos_usec += BigInt(ist[pool_id][inode_num][op].qos_usec||0);
                     }
                 }
             }
@@ -1453,6 +1478,7 @@ class Mon
                     op_st.bps = prev_st ? (op_st.bytes - prev_st.bytes) * 1000n / tm : 0;
                     op_st.iops = prev_st ? (op_st.count - prev_st.count) * 1000n / tm : 0;
                     op_st.lat = prev_st ? (op_st.usec - prev_st.usec) / ((op_st.count - prev_st.count) || 1n) : 0;
+                    op_st.qos_lat = prev_st ? (op_st.qos_usec - prev_st.qos_usec) / ((op_st.count - prev_st.count) || 1n) : 0;
                     if (op_st.bps > 0 || op_st.iops > 0 || op_st.lat > 0)
                         nonzero = true;
                 }
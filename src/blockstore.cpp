@@ -43,6 +43,11 @@ int blockstore_t::read_bitmap(object_id oid, uint64_t target_version, void *bitm
     return impl->read_bitmap(oid, target_version, bitmap, result_version);
 }
 
+bool blockstore_t::is_latest_stable(object_id oid, uint64_t version)
+{
+    return impl->is_latest_stable(oid, version);
+}
+
 std::map<uint64_t, uint64_t> & blockstore_t::get_inode_space_stats()
 {
     return impl->inode_space_stats;
@@ -73,6 +78,11 @@ uint64_t blockstore_t::get_journal_size()
     return impl->get_journal_size();
 }
 
+uint64_t blockstore_t::get_queue_depth()
+{
+    return impl->get_queue_depth();
+}
+
 uint32_t blockstore_t::get_bitmap_granularity()
 {
     return impl->get_bitmap_granularity();
@@ -40,10 +40,21 @@
 #define BS_OP_LIST 7
 #define BS_OP_ROLLBACK 8
 #define BS_OP_SYNC_STAB_ALL 9
-#define BS_OP_MAX 9
+#define BS_OP_DELETE_INODE 10
+#define BS_OP_MAX 10
 
 #define BS_OP_PRIVATE_DATA_SIZE 256
 
+// Operation priority classes. When the ring is short on free space, each class present
+// in the queue gets a share of it proportional to its weight, so background operations
+// can't starve client operations, but also can't be starved forever
+#define BS_PRIO_CLIENT 0
+#define BS_PRIO_RECOVERY 1
+#define BS_PRIO_REBALANCE 2
+#define BS_PRIO_BACKGROUND 3
+#define BS_PRIO_COUNT 4
+#define BS_PRIO_WEIGHTS { 16, 4, 2, 1 }
+
 /*
 
 Blockstore opcode documentation:
@@ -124,13 +135,40 @@ Input:
 - offset = PG number
 - oid.inode = min inode number or 0 to list all inodes
 - version = max inode number or 0 to list all inodes
+- list_cursor = object to continue listing from or 0 to list from the beginning
+- list_stable_limit = max clean object count or 0 to list all objects at once.
+  Dirty objects are only returned from the same interval as clean ones,
+  i.e. from (list_cursor .. last returned clean object), and at most
+  list_stable_limit objects are taken from dirty_db, so the interval may end earlier.
 
 Output:
 - retval = total obj_ver_id count
 - version = stable obj_ver_id count
+- list_cursor = cursor for the next call or 0 if all objects are listed
 - buf = obj_ver_id array allocated by the blockstore. Stable versions come first.
   You must free it yourself after usage with free().
   Output includes all objects for which (((inode + stripe / <PG alignment>) % <PG count>) == <PG number>).
+  Listing a single PG of a single pool is served from the per-PG clean_db shard. The first such listing
+  of a pool (or a listing with a different PG count) repartitions that pool's clean_db in one pass.
+
+## BS_OP_DELETE_INODE
+
+Delete a batch of objects of a single inode in a single PG. Deletions are written to the journal
+as compact JE_DELETE_BULK entries (one per journal block), fsynced and treated as immediately stable.
+
+Input:
+- oid.inode = inode number
+- oid.stripe = PG alignment
+- len = PG count
+- offset = PG number
+- list_cursor = object to continue deletion from or 0 to start from the beginning
+
+Output:
+- retval = number of deleted objects or negative error number (-EINVAL, or -EBUSY if some
+  objects of the inode have unsynced writes. Caller must sync them first)
+- list_cursor = cursor for the next call or 0 if all objects of the inode in this PG are deleted
+- buf = obj_ver_id array of deleted objects allocated by the blockstore.
+  You must free it yourself after usage with free().
 
 */
 
@@ -147,6 +185,11 @@ struct blockstore_op_t
     void *buf;
     void *bitmap;
     int retval;
+    // BS_OP_LIST and BS_OP_DELETE_INODE only: listing cursor and clean object limit
+    object_id list_cursor;
+    uint32_t list_stable_limit;
+    // priority class (BS_PRIO_*), BS_PRIO_CLIENT if zeroed
+    uint32_t priority;
 
     uint8_t private_data[BS_OP_PRIVATE_DATA_SIZE];
 };
@@ -181,8 +224,13 @@ public:
     void enqueue_op(blockstore_op_t *op);
 
     // Simplified synchronous operation: get object bitmap & current version
+    // Returns -ENOENT if the object doesn't exist or if <result_version> is a deletion
     int read_bitmap(object_id oid, uint64_t target_version, void *bitmap, uint64_t *result_version = NULL);
 
+    // Simplified synchronous operation: check if <version> is the last version of the object and it's stable,
+    // i.e. it can't be rolled back and there are no newer writes of the object, even in progress
+    bool is_latest_stable(object_id oid, uint64_t version);
+
     // Get per-inode space usage statistics
     std::map<uint64_t, uint64_t> & get_inode_space_stats();
 
@@ -196,5 +244,8 @@ public:
 
     uint64_t get_journal_size();
 
+    // Number of operations queued or in progress
+    uint64_t get_queue_depth();
+
     uint32_t get_bitmap_granularity();
 };
@@ -0,0 +1,254 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include "blockstore_impl.h"
+
+// Delete all objects of an inode in a PG, in batches:
+// 1) Select up to DELETE_INODE_MAX_SECTORS journal blocks worth of objects
+//    from the PG's clean_db shard and from dirty_db
+// 2) Write them as compact JE_DELETE_BULK entries (16 bytes per object instead
+//    of a 40 byte JE_DELETE) and sync the journal once for the whole batch
+// 3) Mark deletions as stable. The flusher then removes metadata entries just
+//    like it does for usual deletes
+//
+// Deletions are treated as immediately stable, just like in the immediate_commit mode,
+// so it's the caller's responsibility to only use it when all replicas are available.
+
+#define DELETE_INODE_MAX_SECTORS 4
+
+int blockstore_impl_t::dequeue_del_inode(blockstore_op_t *op)
+{
+    if (PRIV(op)->op_state)
+    {
+        return continue_del_inode(op);
+    }
+    uint64_t inode = op->oid.inode;
+    uint64_t pg_stripe_size = op->oid.stripe;
+    uint32_t pg_count = op->len;
+    uint32_t del_pg = op->offset;
+    if (!inode || !pg_count || pg_stripe_size < MIN_BLOCK_SIZE || del_pg >= pg_count)
+    {
+        op->retval = -EINVAL;
+        FINISH_OP(op);
+        return 2;
+    }
+    // Reshard the pool if it's the first PG operation or if PG count changed, like in process_list()
+    pool_id_t pool = INODE_POOL(inode);
+    auto sh_it = clean_db_settings.find(pool);
+    if (sh_it == clean_db_settings.end() ||
+        sh_it->second.pg_count != pg_count ||
+        sh_it->second.pg_stripe_size != pg_stripe_size)
+    {
+        reshard_clean_db(pool, pg_count, pg_stripe_size);
+    }
+    auto shard_it = clean_db_shards.find(((uint64_t)pool << (64-POOL_ID_BITS)) | (del_pg+1));
+    auto & clean_db = shard_it != clean_db_shards.end() ? shard_it->second : empty_clean_db;
+    int per_entry = (journal_block_size - sizeof(journal_entry_del_bulk)) / sizeof(journal_del_bulk_item);
+    int max_count = per_entry * (journal.sector_count-1 < DELETE_INODE_MAX_SECTORS
+        ? journal.sector_count-1 : DELETE_INODE_MAX_SECTORS);
+    object_id min_oid = { .inode = inode, .stripe = 0 };
+    object_id max_oid = { .inode = inode, .stripe = UINT64_MAX };
+    if (min_oid < op->list_cursor)
+    {
+        // Continue the previous batch
+        min_oid = op->list_cursor;
+    }
+    bool has_more = false;
+    // Select clean objects
+    std::vector<obj_ver_id> dels;
+    auto clean_it = clean_db.lower_bound(min_oid);
+    for (; clean_it != clean_db.end() && !(max_oid < clean_it->first); clean_it++)
+    {
+        if (dels.size() >= max_count)
+        {
+            // Take dirty entries only from the same interval as clean ones, like in process_list()
+            max_oid = dels[dels.size()-1].oid;
+            has_more = true;
+            break;
+        }
+        dels.push_back((obj_ver_id){
+            .oid = clean_it->first,
+            .version = clean_it->second.version+1,
+        });
+    }
+    int clean_count = dels.size();
+    // Apply dirty_db entries
+    auto dirty_it = dirty_db.lower_bound((obj_ver_id){
+        .oid = min_oid,
+        .version = 0,
+    });
+    while (dirty_it != dirty_db.end() && !(max_oid < dirty_it->first.oid))
+    {
+        object_id oid = dirty_it->first.oid;
+        if (((oid.stripe / pg_stripe_size) % pg_count) != del_pg) // like map_to_pg()
+        {
+            dirty_it++;
+            continue;
+        }
+        auto last_it = dirty_it;
+        for (; dirty_it != dirty_db.end() && dirty_it->first.oid == oid; dirty_it++)
+        {
+            if (IS_IN_FLIGHT(dirty_it->second.state))
+            {
+                // Object write is still in progress. Wait until the write request completes
+                PRIV(op)->wait_for = WAIT_IN_FLIGHT;
+                PRIV(op)->del_inode_wait = dirty_it->first;
+                return 0;
+            }
+            else if (!IS_SYNCED(dirty_it->second.state))
+            {
+                // Object not synced yet. Caller must sync it first
+                op->retval = -EBUSY;
+                FINISH_OP(op);
+                return 2;
+            }
+            last_it = dirty_it;
+        }
+        auto clean_pos = std::lower_bound(dels.begin(), dels.begin()+clean_count, (obj_ver_id){
+            .oid = oid,
+            .version = 0,
+        });
+        bool is_clean = clean_pos != dels.begin()+clean_count && clean_pos->oid == oid;
+        if (IS_DELETE(last_it->second.state))
+        {
+            // Already deleted
+            if (is_clean)
+                clean_pos->version = 0;
+        }
+        else if (is_clean)
+            clean_pos->version = last_it->first.version+1;
+        else
+        {
+            dels.push_back((obj_ver_id){
+                .oid = oid,
+                .version = last_it->first.version+1,
+            });
+        }
+    }
+    // Remove already deleted objects
+    int j = 0;
+    for (int i = 0; i < dels.size(); i++)
+    {
+        if (dels[i].version != 0)
+        {
+            dels[j++] = dels[i];
+        }
+    }
+    dels.resize(j);
+    if (dels.size() > clean_count)
+    {
+        std::sort(dels.begin(), dels.end());
+    }
+    if (dels.size() > max_count)
+    {
+        dels.resize(max_count);
+        max_oid = dels[max_count-1].oid;
+        has_more = true;
+    }
+    object_id next_cursor = { 0 };
+    if (has_more)
+    {
+        next_cursor = { .inode = max_oid.inode, .stripe = max_oid.stripe+1 };
+    }
+    if (!dels.size())
+    {
+        // Nothing to delete in this interval
+        op->list_cursor = next_cursor;
+        op->buf = NULL;
+        op->retval = 0;
+        FINISH_OP(op);
+        return 2;
+    }
+    // Check journal space
+    int entries = (dels.size()+per_entry-1) / per_entry;
+    int first_size = sizeof(journal_entry_del_bulk) +
+        (dels.size() < per_entry ? dels.size() : per_entry)*sizeof(journal_del_bulk_item);
+    blockstore_journal_check_t space_check(this);
+    if (!space_check.check_available(op, entries, first_size, 0))
+    {
+        return 0;
+    }
+    // There is sufficient space. Check SQEs
+    BS_SUBMIT_CHECK_SQES(space_check.sectors_to_write);
+#ifdef BLOCKSTORE_DEBUG
+    printf("Delete inode %lx PG %u/%u: %lu objects\n", inode, del_pg+1, pg_count, dels.size());
+#endif
+    // Prepare and submit journal entries, one per journal sector
+    for (int done = 0; done < dels.size(); )
+    {
+        int count = dels.size()-done < per_entry ? dels.size()-done : per_entry;
+        uint32_t size = sizeof(journal_entry_del_bulk) + count*sizeof(journal_del_bulk_item);
+        if (!journal.entry_fits(size) &&
+            journal.sector_info[journal.cur_sector].dirty)
+        {
+            prepare_journal_sector_write(journal.cur_sector, op);
+        }
+        journal_entry_del_bulk *je = (journal_entry_del_bulk*)
+            prefill_single_journal_entry(journal, JE_DELETE_BULK, size);
+        je->inode = inode;
+        uint64_t journal_sector = journal.sector_info[journal.cur_sector].offset;
+        for (int i = 0; i < count; i++, done++)
+        {
+            je->items[i] = (journal_del_bulk_item){
+                .stripe = dels[done].oid.stripe,
+                .version = dels[done].version,
+            };
+            dirty_db.emplace(dels[done], (dirty_entry){
+                .state = (BS_ST_DELETE | BS_ST_SUBMITTED),
+                .flags = 0,
+                .location = 0,
+                .offset = 0,
+                .len = 0,
+                .journal_sector = journal_sector,
+            });
+            journal.used_sectors[journal_sector]++;
+        }
+        je->crc32 = je_crc32((journal_entry*)je);
+        journal.crc32_last = je->crc32;
+    }
+    prepare_journal_sector_write(journal.cur_sector, op);
+    obj_ver_id *deleted = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * dels.size());
+    memcpy(deleted, dels.data(), sizeof(obj_ver_id) * dels.size());
+    op->buf = deleted;
+    op->list_cursor = next_cursor;
+    PRIV(op)->del_inode_count = dels.size();
+    PRIV(op)->op_state = 1;
+    return 1;
+}
+
+int blockstore_impl_t::continue_del_inode(blockstore_op_t *op)
+{
+    if (PRIV(op)->op_state == 2)
+        goto resume_2;
+    else if (PRIV(op)->op_state == 4)
+        goto resume_4;
+    else
+        return 1;
+resume_2:
+    if (!disable_journal_fsync)
+    {
+        BS_SUBMIT_GET_SQE(sqe, data);
+        my_uring_prep_fsync(sqe, journal.fd, IORING_FSYNC_DATASYNC);
+        data->iov = { 0 };
+        data->callback = [this, op](ring_data_t *data) { handle_write_event(data, op); };
+        PRIV(op)->min_flushed_journal_sector = PRIV(op)->max_flushed_journal_sector = 0;
+        PRIV(op)->pending_ops = 1;
+        PRIV(op)->op_state = 3;
+        return 1;
+    }
+resume_4:
+    // Mark deletions as synced and stable, acknowledge op completion
+    {
+        obj_ver_id *v = (obj_ver_id*)op->buf;
+        for (int i = 0; i < PRIV(op)->del_inode_count; i++, v++)
+        {
+            auto dirty_it = dirty_db.find(*v);
+            assert(dirty_it != dirty_db.end());
+            dirty_it->second.state = (BS_ST_DELETE | BS_ST_SYNCED);
+            mark_stable(*v);
+        }
+    }
+    op->retval = PRIV(op)->del_inode_count;
+    FINISH_OP(op);
+    return 2;
+}
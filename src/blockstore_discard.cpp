@@ -0,0 +1,252 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <sys/eventfd.h>
+#include <linux/falloc.h>
+#include "blockstore_impl.h"
+
+// Background discard of freed data blocks:
+// 1) Freed blocks are not returned to the allocator immediately. They are merged
+//    into adjacent ranges in discard_queue and stay "allocated" in data_alloc
+// 2) discard_loop() discards queued ranges, limited to discard_max_mbs. Block devices
+//    are discarded with BLKDISCARD because FALLOC_FL_PUNCH_HOLE on a block device means
+//    "write zeroes without fallback" and fails on many of them. BLKDISCARD is synchronous,
+//    so it's called from a separate thread to not stall the event loop. Files get holes
+//    punched in them through io_uring
+// 3) Blocks are only freed in data_alloc when their discard completes, so they
+//    can't be reused and overwritten while the discard is still in flight
+//
+// If the data device runs out of free space, blocks still waiting for discard
+// are released without discarding them.
+
+#define DISCARD_MAX_IN_FLIGHT 4
+
+void blockstore_impl_t::free_data_block(uint64_t block_num)
+{
+    if (!discard_freed_blocks)
+    {
+        data_alloc->set(block_num, false);
+        return;
+    }
+    auto next_it = discard_queue.lower_bound(block_num);
+    if (next_it != discard_queue.begin())
+    {
+        auto prev_it = std::prev(next_it);
+        if (prev_it->first + prev_it->second == block_num)
+        {
+            // Append to the previous range
+            prev_it->second++;
+            if (next_it != discard_queue.end() && next_it->first == block_num+1)
+            {
+                prev_it->second += next_it->second;
+                discard_queue.erase(next_it);
+            }
+            return;
+        }
+    }
+    if (next_it != discard_queue.end() && next_it->first == block_num+1)
+    {
+        // Prepend to the next range
+        uint64_t count = next_it->second+1;
+        discard_queue.erase(next_it);
+        discard_queue[block_num] = count;
+        return;
+    }
+    discard_queue[block_num] = 1;
+}
+
+void blockstore_impl_t::release_discard_queue()
+{
+    for (auto & dp: discard_queue)
+    {
+        for (uint64_t i = 0; i < dp.second; i++)
+        {
+            data_alloc->set(dp.first+i, false);
+        }
+    }
+    discard_queue.clear();
+}
+
+void blockstore_impl_t::discard_loop()
+{
+    if (!discard_queue.size() || discards_in_flight >= DISCARD_MAX_IN_FLIGHT || discard_timer_id >= 0)
+    {
+        return;
+    }
+    uint64_t max_bytes = UINT64_MAX;
+    if (discard_max_mbs > 0)
+    {
+        // Token bucket: the budget grows by discard_max_mbs per second up to one second worth
+        // of discards, but always allows to discard at least one block
+        uint64_t rate = discard_max_mbs*1024*1024;
+        uint64_t max_budget = rate > block_size ? rate : block_size;
+        timespec tv;
+        clock_gettime(CLOCK_MONOTONIC, &tv);
+        uint64_t now_us = tv.tv_sec*1000000 + tv.tv_nsec/1000;
+        if (!discard_budget_us || now_us - discard_budget_us >= 1000000)
+            discard_budget = max_budget;
+        else
+        {
+            discard_budget += (now_us - discard_budget_us) * rate / 1000000;
+            if (discard_budget > max_budget)
+                discard_budget = max_budget;
+        }
+        discard_budget_us = now_us;
+        if (discard_budget < block_size)
+        {
+            // Wait until the budget is enough for one block
+            discard_timer_id = tfd->set_timer_us((block_size - discard_budget) * 1000000 / rate + 1, false, [this](int timer_id)
+            {
+                discard_timer_id = -1;
+                ringloop->wakeup();
+            });
+            return;
+        }
+        max_bytes = discard_budget;
+    }
+    if (data_is_blockdev && !discard_thread && !start_discard_thread())
+    {
+        printf("Warning: failed to start the discard thread: %s (code %d), disabling discard\n", strerror(errno), errno);
+        discard_freed_blocks = false;
+        release_discard_queue();
+        return;
+    }
+    bool submitted = false;
+    while (discard_queue.size() > 0 && discards_in_flight < DISCARD_MAX_IN_FLIGHT && max_bytes >= block_size)
+    {
+        io_uring_sqe *sqe = NULL;
+        if (!data_is_blockdev && !(sqe = get_sqe()))
+        {
+            break;
+        }
+        auto dp = discard_queue.begin();
+        uint64_t start = dp->first, count = dp->second;
+        if ((count << block_order) > max_bytes)
+        {
+            count = max_bytes >> block_order;
+            discard_queue[start+count] = dp->second-count;
+        }
+        discard_queue.erase(dp);
+        max_bytes -= count << block_order;
+        if (discard_max_mbs > 0)
+        {
+            discard_budget -= count << block_order;
+        }
+        discards_in_flight++;
+        if (data_is_blockdev)
+        {
+            std::unique_lock<std::mutex> lock(discard_mutex);
+            discard_submitted.push_back((blockstore_discard_t){ .start = start, .count = count });
+            submitted = true;
+            continue;
+        }
+        ring_data_t *data = ((ring_data_t*)sqe->user_data);
+        data->iov = { 0 };
+        data->callback = [this, start, count](ring_data_t *data) { handle_discard_event(data->res, start, count); };
+        my_uring_prep_fallocate(
+            sqe, data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+            data_offset + (start << block_order), count << block_order
+        );
+    }
+    if (submitted)
+    {
+        discard_cond.notify_one();
+    }
+}
+
+bool blockstore_impl_t::start_discard_thread()
+{
+    discard_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (discard_eventfd < 0)
+    {
+        return false;
+    }
+    tfd->set_fd_handler(discard_eventfd, false, [this](int fd, int events)
+    {
+        handle_discard_completions();
+    });
+    discard_thread_stop = false;
+    discard_thread = new std::thread(&blockstore_impl_t::discard_thread_loop, this);
+    return true;
+}
+
+void blockstore_impl_t::stop_discard_thread()
+{
+    if (!discard_thread)
+    {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(discard_mutex);
+        discard_thread_stop = true;
+    }
+    discard_cond.notify_one();
+    discard_thread->join();
+    delete discard_thread;
+    discard_thread = NULL;
+    tfd->set_fd_handler(discard_eventfd, false, NULL);
+    close(discard_eventfd);
+    discard_eventfd = -1;
+}
+
+// Runs in the discard thread. Only touches discard_submitted/discard_completed
+// under discard_mutex and fields that don't change after initialisation
+void blockstore_impl_t::discard_thread_loop()
+{
+    std::unique_lock<std::mutex> lock(discard_mutex);
+    while (true)
+    {
+        while (!discard_thread_stop && !discard_submitted.size())
+        {
+            discard_cond.wait(lock);
+        }
+        if (discard_thread_stop)
+        {
+            break;
+        }
+        blockstore_discard_t d = discard_submitted.front();
+        discard_submitted.erase(discard_submitted.begin());
+        lock.unlock();
+        uint64_t range[2] = { data_offset + (d.start << block_order), d.count << block_order };
+        d.res = ioctl(data_fd, BLKDISCARD, &range) < 0 ? -errno : 0;
+        lock.lock();
+        discard_completed.push_back(d);
+        uint64_t one = 1;
+        write(discard_eventfd, &one, sizeof(one));
+    }
+}
+
+void blockstore_impl_t::handle_discard_completions()
+{
+    uint64_t n;
+    read(discard_eventfd, &n, sizeof(n));
+    std::vector<blockstore_discard_t> completed;
+    {
+        std::unique_lock<std::mutex> lock(discard_mutex);
+        completed.swap(discard_completed);
+    }
+    for (auto & d: completed)
+    {
+        handle_discard_event(d.res, d.start, d.count);
+    }
+}
+
+void blockstore_impl_t::handle_discard_event(int res, uint64_t start, uint64_t count)
+{
+    live = true;
+    discards_in_flight--;
+    if (res != 0)
+    {
+        printf(
+            "Warning: failed to discard %lu bytes at offset %lu on the data device: %s (code %d), disabling discard\n",
+            count << block_order, data_offset + (start << block_order), strerror(-res), res
+        );
+        discard_freed_blocks = false;
+        release_discard_queue();
+    }
+    for (uint64_t i = 0; i < count; i++)
+    {
+        data_alloc->set(start+i, false);
+    }
+    ringloop->wakeup();
+}
@@ -415,8 +415,11 @@ stop_flusher:
         flusher->active_flushers++;
 resume_1:
         // Find it in clean_db
-        clean_it = bs->clean_db.find(cur.oid);
-        old_clean_loc = (clean_it != bs->clean_db.end() ? clean_it->second.location : UINT64_MAX);
+        {
+            auto & clean_db = bs->find_clean_db_shard(cur.oid);
+            clean_it = clean_db.find(cur.oid);
+            old_clean_loc = (clean_it != clean_db.end() ? clean_it->second.location : UINT64_MAX);
+        }
         // Scan dirty versions of the object
         if (!scan_dirty(1))
         {
@@ -868,23 +871,24 @@ void journal_flusher_co::update_clean_db()
             cur.oid.inode, cur.oid.stripe, cur.version,
             clean_loc >> bs->block_order);
 #endif
-        bs->data_alloc->set(old_clean_loc >> bs->block_order, false);
+        bs->free_data_block(old_clean_loc >> bs->block_order);
     }
+    auto & clean_db = bs->clean_db_shard(cur.oid);
     if (has_delete)
     {
-        auto clean_it = bs->clean_db.find(cur.oid);
-        bs->clean_db.erase(clean_it);
+        auto clean_it = clean_db.find(cur.oid);
+        clean_db.erase(clean_it);
 #ifdef BLOCKSTORE_DEBUG
         printf("Free block %lu from %lx:%lx v%lu (delete)\n",
             clean_loc >> bs->block_order,
             cur.oid.inode, cur.oid.stripe, cur.version);
 #endif
-        bs->data_alloc->set(clean_loc >> bs->block_order, false);
+        bs->free_data_block(clean_loc >> bs->block_order);
         clean_loc = UINT64_MAX;
     }
     else
     {
-        bs->clean_db[cur.oid] = {
+        clean_db[cur.oid] = {
             .version = cur.version,
             .location = clean_loc,
         };
@@ -2,6 +2,7 @@
 // License: VNPL-1.1 (see README.md for details)
 
 #include "blockstore_impl.h"
+#include "radix_sort.h"
 
 blockstore_impl_t::blockstore_impl_t(blockstore_config_t & config, ring_loop_t *ringloop, timerfd_manager_t *tfd)
 {
@@ -37,6 +38,9 @@ blockstore_impl_t::blockstore_impl_t(blockstore_config_t & config, ring_loop_t *
 
 blockstore_impl_t::~blockstore_impl_t()
 {
+    stop_discard_thread();
+    if (discard_timer_id >= 0)
+        tfd->clear_timer(discard_timer_id);
     delete data_alloc;
     delete flusher;
     free(zero_object);
@@ -119,10 +123,32 @@ void blockstore_impl_t::loop()
         // has_writes == 1 - some writes in progress
         // has_writes == 2 - tried to submit some writes, but failed
         int has_writes = 0, op_idx = 0, new_idx = 0;
+        // Split free ring space between priority classes present in the queue
+        const int prio_weights[BS_PRIO_COUNT] = BS_PRIO_WEIGHTS;
+        int prio_budget[BS_PRIO_COUNT];
+        int prio_weight_sum = 0, prio_present = 0;
+        for (int i = 0; i < BS_PRIO_COUNT; i++)
+        {
+            if (submit_queue_prio[i] > 0)
+            {
+                prio_weight_sum += prio_weights[i];
+                prio_present++;
+            }
+        }
+        for (int i = 0; i < BS_PRIO_COUNT; i++)
+        {
+            prio_budget[i] = prio_present <= 1 ? INT32_MAX : ringloop->space_left() * prio_weights[i] / prio_weight_sum;
+            if (prio_budget[i] < 1)
+                prio_budget[i] = 1;
+        }
+        if (prio_skipped_writes.size() > 0)
+            prio_skipped_writes.clear();
         for (; op_idx < submit_queue.size(); op_idx++, new_idx++)
         {
             auto op = submit_queue[op_idx];
             submit_queue[new_idx] = op;
+            // The operation may be already freed when dequeue_*() returns 2
+            const int prio = op->priority;
             // FIXME: This needs some simplification
             // Writes should not block reads if the ring is not full and reads don't depend on them
             // In all other cases we should stop submission
@@ -135,13 +161,33 @@ void blockstore_impl_t::loop()
                 }
                 else if (PRIV(op)->wait_for)
                 {
-                    if (op->opcode == BS_OP_WRITE || op->opcode == BS_OP_WRITE_STABLE || op->opcode == BS_OP_DELETE)
+                    if (op->opcode == BS_OP_WRITE || op->opcode == BS_OP_WRITE_STABLE || op->opcode == BS_OP_DELETE ||
+                        op->opcode == BS_OP_DELETE_INODE)
                     {
                         has_writes = 2;
                     }
                     continue;
                 }
             }
+            if (prio_budget[prio] <= 0 || prio_skipped_writes.size() > 0 && is_prio_skipped(op))
+            {
+                // Priority class used up its share of the ring. Keep the order of modifications
+                // of the same object and don't let SYNCs and inode deletions overtake skipped writes
+                if (op->opcode == BS_OP_DELETE_INODE)
+                {
+                    // Objects deleted by it are unknown, so treat it like a write that can't be submitted
+                    has_writes = 2;
+                }
+                else
+                {
+                    prio_skip_op(op);
+                }
+                continue;
+            }
+            if (prio_skipped_writes.size() > 0 && (op->opcode == BS_OP_SYNC || op->opcode == BS_OP_DELETE_INODE))
+            {
+                continue;
+            }
             unsigned ring_space = ringloop->space_left();
             unsigned prev_sqe_pos = ringloop->save();
             // 0 = can't submit
@@ -197,6 +243,16 @@ void blockstore_impl_t::loop()
             {
                 wr_st = dequeue_rollback(op);
             }
+            else if (op->opcode == BS_OP_DELETE_INODE)
+            {
+                if (has_writes == 2)
+                {
+                    // Some writes already could not be submitted
+                    continue;
+                }
+                wr_st = dequeue_del_inode(op);
+                has_writes = wr_st > 0 ? 1 : 2;
+            }
             else if (op->opcode == BS_OP_LIST)
             {
                 // LIST doesn't need to be blocked by previous modifications
@@ -205,6 +261,7 @@ void blockstore_impl_t::loop()
             }
             if (wr_st == 2)
             {
+                submit_queue_prio[prio]--;
                 new_idx--;
             }
             if (wr_st == 0)
@@ -217,6 +274,7 @@ void blockstore_impl_t::loop()
                     break;
                 }
             }
+            prio_budget[prio] -= ring_space - ringloop->space_left();
         }
         if (op_idx != new_idx)
         {
@@ -229,6 +287,7 @@ void blockstore_impl_t::loop()
         if (!readonly)
         {
             flusher->loop();
+            discard_loop();
         }
         int ret = ringloop->submit();
         if (ret < 0)
@@ -254,7 +313,7 @@ bool blockstore_impl_t::is_safe_to_stop()
 {
     // It's safe to stop blockstore when there are no in-flight operations,
     // no in-progress syncs and flusher isn't doing anything
-    if (submit_queue.size() > 0 || !readonly && flusher->is_active())
+    if (submit_queue.size() > 0 || !readonly && (flusher->is_active() || discards_in_flight > 0))
     {
         return false;
     }
@@ -265,6 +324,7 @@ bool blockstore_impl_t::is_safe_to_stop()
             // We should sync the blockstore before unmounting
             blockstore_op_t *op = new blockstore_op_t;
             op->opcode = BS_OP_SYNC;
+            op->priority = BS_PRIO_CLIENT;
             op->buf = NULL;
             op->callback = [](blockstore_op_t *op)
             {
@@ -321,10 +381,23 @@ void blockstore_impl_t::check_wait(blockstore_op_t *op)
     }
     else if (PRIV(op)->wait_for == WAIT_FREE)
     {
-        if (!data_alloc->get_free_count() && flusher->is_active())
+        if (!data_alloc->get_free_count() && (flusher->is_active() || discards_in_flight > 0))
         {
 #ifdef BLOCKSTORE_DEBUG
             printf("Still waiting for free space on the data device\n");
+#endif
+            return;
+        }
+        PRIV(op)->wait_for = 0;
+    }
+    else if (PRIV(op)->wait_for == WAIT_IN_FLIGHT)
+    {
+        auto dirty_it = dirty_db.find(PRIV(op)->del_inode_wait);
+        if (dirty_it != dirty_db.end() && IS_IN_FLIGHT(dirty_it->second.state))
+        {
+#ifdef BLOCKSTORE_DEBUG
+            printf("Still waiting for the write of %lx:%lx v%lu\n", PRIV(op)->del_inode_wait.oid.inode,
+                PRIV(op)->del_inode_wait.oid.stripe, PRIV(op)->del_inode_wait.version);
 #endif
             return;
         }
@@ -336,6 +409,44 @@ void blockstore_impl_t::check_wait(blockstore_op_t *op)
     }
 }
 
+// Check if the operation modifies an object with modifications skipped in the current submission pass
+bool blockstore_impl_t::is_prio_skipped(blockstore_op_t *op)
+{
+    if (op->opcode == BS_OP_WRITE || op->opcode == BS_OP_WRITE_STABLE || op->opcode == BS_OP_DELETE)
+    {
+        return prio_skipped_writes.find(op->oid) != prio_skipped_writes.end();
+    }
+    else if (op->opcode == BS_OP_STABLE || op->opcode == BS_OP_ROLLBACK)
+    {
+        obj_ver_id *v = (obj_ver_id*)op->buf;
+        for (int i = 0; i < op->len; i++)
+        {
+            if (prio_skipped_writes.find(v[i].oid) != prio_skipped_writes.end())
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Remember objects modified by a skipped operation so later modifications don't overtake it
+void blockstore_impl_t::prio_skip_op(blockstore_op_t *op)
+{
+    if (op->opcode == BS_OP_WRITE || op->opcode == BS_OP_WRITE_STABLE || op->opcode == BS_OP_DELETE)
+    {
+        prio_skipped_writes.insert(op->oid);
+    }
+    else if (op->opcode == BS_OP_STABLE || op->opcode == BS_OP_ROLLBACK)
+    {
+        obj_ver_id *v = (obj_ver_id*)op->buf;
+        for (int i = 0; i < op->len; i++)
+        {
+            prio_skipped_writes.insert(v[i].oid);
+        }
+    }
+}
+
 void blockstore_impl_t::enqueue_op(blockstore_op_t *op)
 {
     if (op->opcode < BS_OP_MIN || op->opcode > BS_OP_MAX ||
@@ -399,10 +510,69 @@ void blockstore_impl_t::enqueue_op(blockstore_op_t *op)
     PRIV(op)->wait_for = 0;
     PRIV(op)->op_state = 0;
     PRIV(op)->pending_ops = 0;
+    if (op->priority >= BS_PRIO_COUNT)
+    {
+        op->priority = BS_PRIO_BACKGROUND;
+    }
+    submit_queue_prio[op->priority]++;
     submit_queue.push_back(op);
     ringloop->wakeup();
 }
 
+pool_pg_id_t blockstore_impl_t::clean_db_shard_id(object_id oid)
+{
+    uint64_t pg_num = 0;
+    uint64_t pool_id = INODE_POOL(oid.inode);
+    auto sh_it = clean_db_settings.find(pool_id);
+    if (sh_it != clean_db_settings.end())
+    {
+        // like map_to_pg()
+        pg_num = (oid.stripe / sh_it->second.pg_stripe_size) % sh_it->second.pg_count + 1;
+    }
+    return (pool_id << (64-POOL_ID_BITS)) | pg_num;
+}
+
+// Shard to add the object to, created if it doesn't exist
+blockstore_clean_db_t& blockstore_impl_t::clean_db_shard(object_id oid)
+{
+    return clean_db_shards[clean_db_shard_id(oid)];
+}
+
+// Shard to look the object up in, lookups don't create empty shards
+const blockstore_clean_db_t& blockstore_impl_t::find_clean_db_shard(object_id oid)
+{
+    auto sh_it = clean_db_shards.find(clean_db_shard_id(oid));
+    return sh_it != clean_db_shards.end() ? sh_it->second : empty_clean_db;
+}
+
+void blockstore_impl_t::reshard_clean_db(pool_id_t pool, uint32_t pg_count, uint64_t pg_stripe_size)
+{
+    uint64_t pool_id = (uint64_t)pool;
+    std::map<pool_pg_id_t, blockstore_clean_db_t> new_shards;
+    auto sh_it = clean_db_shards.lower_bound((pool_id << (64-POOL_ID_BITS)));
+    while (sh_it != clean_db_shards.end() &&
+        (sh_it->first >> (64-POOL_ID_BITS)) == pool_id)
+    {
+        for (auto & pair: sh_it->second)
+        {
+            // like map_to_pg()
+            uint64_t pg_num = (pair.first.stripe / pg_stripe_size) % pg_count + 1;
+            uint64_t shard_id = (pool_id << (64-POOL_ID_BITS)) | pg_num;
+            new_shards[shard_id][pair.first] = pair.second;
+        }
+        clean_db_shards.erase(sh_it++);
+    }
+    for (auto sh_it = new_shards.begin(); sh_it != new_shards.end(); sh_it++)
+    {
+        auto & to = clean_db_shards[sh_it->first];
+        to.swap(sh_it->second);
+    }
+    clean_db_settings[pool] = (pool_shard_settings_t){
+        .pg_count = pg_count,
+        .pg_stripe_size = pg_stripe_size,
+    };
+}
+
 static bool replace_stable(object_id oid, uint64_t version, int search_start, int search_end, obj_ver_id* list)
 {
     while (search_start < search_end)
@@ -432,6 +602,20 @@ void blockstore_impl_t::process_list(blockstore_op_t *op)
     uint64_t pg_stripe_size = op->oid.stripe;
     uint64_t min_inode = op->oid.inode;
     uint64_t max_inode = op->version;
+    uint32_t stable_limit = op->list_stable_limit;
+    // Listed object range
+    object_id min_oid = { 0 }, max_oid = { .inode = UINT64_MAX, .stripe = UINT64_MAX };
+    if ((min_inode != 0 || max_inode != 0) && min_inode <= max_inode)
+    {
+        min_oid = { .inode = min_inode, .stripe = 0 };
+        max_oid = { .inode = max_inode, .stripe = UINT64_MAX };
+    }
+    if (min_oid < op->list_cursor)
+    {
+        // Continue the previous listing
+        min_oid = op->list_cursor;
+    }
+    op->list_cursor = { 0 };
     // Check PG
     if (pg_count != 0 && (pg_stripe_size < MIN_BLOCK_SIZE || list_pg >= pg_count))
     {
@@ -439,8 +623,51 @@ void blockstore_impl_t::process_list(blockstore_op_t *op)
         FINISH_OP(op);
         return;
     }
-    // Copy clean_db entries (sorted)
-    int stable_count = 0, stable_alloc = clean_db.size() / (pg_count ? pg_count : 1);
+    // Select clean_db shards to list
+    auto shard_it = clean_db_shards.begin(), shard_end = clean_db_shards.end();
+    if ((min_inode != 0 || max_inode != 0) && min_inode <= max_inode)
+    {
+        pool_id_t min_pool = INODE_POOL(min_inode), max_pool = INODE_POOL(max_inode);
+        if (min_pool == max_pool && pg_count != 0)
+        {
+            // Listing of a single PG: reshard the pool if it's the first listing or if PG count changed
+            auto sh_it = clean_db_settings.find(min_pool);
+            if (sh_it == clean_db_settings.end() ||
+                sh_it->second.pg_count != pg_count ||
+                sh_it->second.pg_stripe_size != pg_stripe_size)
+            {
+                reshard_clean_db(min_pool, pg_count, pg_stripe_size);
+            }
+            shard_it = clean_db_shards.lower_bound(((uint64_t)min_pool << (64-POOL_ID_BITS)) | (list_pg+1));
+            shard_end = shard_it;
+            if (shard_end != clean_db_shards.end() &&
+                shard_end->first == (((uint64_t)min_pool << (64-POOL_ID_BITS)) | (list_pg+1)))
+            {
+                shard_end++;
+            }
+        }
+        else
+        {
+            shard_it = clean_db_shards.lower_bound((uint64_t)min_pool << (64-POOL_ID_BITS));
+            shard_end = clean_db_shards.upper_bound(((uint64_t)max_pool << (64-POOL_ID_BITS)) |
+                ((1ul << (64-POOL_ID_BITS)) - 1));
+        }
+    }
+    // Copy clean_db entries
+    int stable_count = 0, stable_alloc = 0, shard_count = 0;
+    for (auto it = shard_it; it != shard_end; it++)
+    {
+        stable_alloc += it->second.size();
+        shard_count++;
+    }
+    if (shard_count != 1 && pg_count != 0)
+    {
+        stable_alloc /= pg_count;
+    }
+    if (stable_limit && stable_alloc > stable_limit)
+    {
+        stable_alloc = stable_limit;
+    }
     obj_ver_id *stable = (obj_ver_id*)malloc(sizeof(obj_ver_id) * stable_alloc);
     if (!stable)
     {
@@ -448,23 +675,73 @@ void blockstore_impl_t::process_list(blockstore_op_t *op)
         FINISH_OP(op);
         return;
     }
+    if (stable_limit && shard_count > 1)
     {
-        auto clean_it = clean_db.begin(), clean_end = clean_db.end();
-        if ((min_inode != 0 || max_inode != 0) && min_inode <= max_inode)
+        // Entries from different shards are interleaved, so merge them in the object order
+        // to stop after <stable_limit> clean objects without collecting all of them
+        typedef std::pair<blockstore_clean_db_t::const_iterator, blockstore_clean_db_t::const_iterator> shard_range_t;
+        auto range_cmp = [](const shard_range_t & a, const shard_range_t & b) { return b.first->first < a.first->first; };
+        std::vector<shard_range_t> ranges;
+        for (; shard_it != shard_end; shard_it++)
         {
-            clean_it = clean_db.lower_bound({
-                .inode = min_inode,
-                .stripe = 0,
-            });
-            clean_end = clean_db.upper_bound({
-                .inode = max_inode,
-                .stripe = UINT64_MAX,
-            });
+            auto clean_it = shard_it->second.lower_bound(min_oid);
+            if (clean_it != shard_it->second.end())
+                ranges.push_back({ clean_it, shard_it->second.end() });
         }
-        for (; clean_it != clean_end; clean_it++)
+        std::make_heap(ranges.begin(), ranges.end(), range_cmp);
+        while (ranges.size() && !(max_oid < ranges[0].first->first))
+        {
+            std::pop_heap(ranges.begin(), ranges.end(), range_cmp);
+            auto & range = ranges.back();
+            if (!pg_count || ((range.first->first.stripe / pg_stripe_size) % pg_count) == list_pg) // like map_to_pg()
+            {
+                if (stable_count >= stable_limit)
+                {
+                    max_oid = stable[stable_count-1].oid;
+                    op->list_cursor = { .inode = max_oid.inode, .stripe = max_oid.stripe+1 };
+                    break;
+                }
+                if (stable_count >= stable_alloc)
+                {
+                    stable_alloc += 32768;
+                    if (stable_alloc > stable_limit)
+                        stable_alloc = stable_limit;
+                    stable = (obj_ver_id*)realloc(stable, sizeof(obj_ver_id) * stable_alloc);
+                    if (!stable)
+                    {
+                        op->retval = -ENOMEM;
+                        FINISH_OP(op);
+                        return;
+                    }
+                }
+                stable[stable_count++] = {
+                    .oid = range.first->first,
+                    .version = range.first->second.version,
+                };
+            }
+            range.first++;
+            if (range.first == range.second)
+                ranges.pop_back();
+            else
+                std::push_heap(ranges.begin(), ranges.end(), range_cmp);
+        }
+        shard_it = shard_end;
+    }
+    for (; shard_it != shard_end; shard_it++)
+    {
+        auto & clean_db = shard_it->second;
+        auto clean_it = clean_db.lower_bound(min_oid);
+        for (; clean_it != clean_db.end() && !(max_oid < clean_it->first); clean_it++)
         {
             if (!pg_count || ((clean_it->first.stripe / pg_stripe_size) % pg_count) == list_pg) // like map_to_pg()
             {
+                if (stable_limit && shard_count == 1 && stable_count >= stable_limit)
+                {
+                    // Stop the listing after <stable_limit> clean objects
+                    max_oid = stable[stable_count-1].oid;
+                    op->list_cursor = { .inode = max_oid.inode, .stripe = max_oid.stripe+1 };
+                    break;
+                }
                 if (stable_count >= stable_alloc)
                 {
                     stable_alloc += 32768;
@@ -483,33 +760,41 @@ void blockstore_impl_t::process_list(blockstore_op_t *op)
             }
         }
     }
+    if (shard_count > 1 && !stable_limit)
+    {
+        // Entries from different shards are interleaved, sort them for replace_stable()
+        radix_sort(stable, stable_count);
+    }
     int clean_stable_count = stable_count;
     // Copy dirty_db entries (sorted, too)
     int unstable_count = 0, unstable_alloc = 0;
     obj_ver_id *unstable = NULL;
     {
-        auto dirty_it = dirty_db.begin(), dirty_end = dirty_db.end();
-        if ((min_inode != 0 || max_inode != 0) && min_inode <= max_inode)
-        {
-            dirty_it = dirty_db.lower_bound({
-                .oid = {
-                    .inode = min_inode,
-                    .stripe = 0,
-                },
-                .version = 0,
-            });
-            dirty_end = dirty_db.upper_bound({
-                .oid = {
-                    .inode = max_inode,
-                    .stripe = UINT64_MAX,
-                },
-                .version = UINT64_MAX,
-            });
-        }
-        for (; dirty_it != dirty_end; dirty_it++)
+        // Only return dirty entries from the same interval as clean ones
+        auto dirty_it = dirty_db.lower_bound({
+            .oid = min_oid,
+            .version = 0,
+        });
+        object_id last_dirty_oid = { 0 };
+        for (; dirty_it != dirty_db.end() && !(max_oid < dirty_it->first.oid); dirty_it++)
         {
             if (!pg_count || ((dirty_it->first.oid.stripe / pg_stripe_size) % pg_count) == list_pg) // like map_to_pg()
             {
+                if (stable_limit && dirty_it->first.oid != last_dirty_oid &&
+                    (stable_count-clean_stable_count) + unstable_count >= stable_limit)
+                {
+                    // Also stop after <stable_limit> objects from dirty_db and drop clean objects after them
+                    max_oid = last_dirty_oid;
+                    op->list_cursor = { .inode = max_oid.inode, .stripe = max_oid.stripe+1 };
+                    int clean_end = clean_stable_count;
+                    while (clean_end > 0 && max_oid < stable[clean_end-1].oid)
+                        clean_end--;
+                    memmove(stable+clean_end, stable+clean_stable_count, sizeof(obj_ver_id) * (stable_count-clean_stable_count));
+                    stable_count -= clean_stable_count-clean_end;
+                    clean_stable_count = clean_end;
+                    break;
+                }
+                last_dirty_oid = dirty_it->first.oid;
                 if (IS_DELETE(dirty_it->second.state))
                 {
                     // Deletions are always stable, so try to zero out two possible entries
@@ -16,12 +16,18 @@
 #include <vector>
 #include <list>
 #include <deque>
+#include <unordered_set>
+#include <algorithm>
 #include <new>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "cpp-btree/btree_map.h"
 
 #include "malloc_or_die.h"
 #include "allocator.h"
+#include "osd_id.h"
 
 //#define BLOCKSTORE_DEBUG
 
@@ -157,6 +163,8 @@ struct __attribute__((__packed__)) dirty_entry
 #define WAIT_JOURNAL_BUFFER 4
 // Suspend operation until there is some free space on the data device
 #define WAIT_FREE 5
+// Suspend operation until the in-flight write of <del_inode_wait> object version completes
+#define WAIT_IN_FLIGHT 6
 
 struct fulfill_read_t
 {
@@ -189,6 +197,10 @@ struct blockstore_op_private_t
     // Sync
     std::vector<obj_ver_id> sync_big_writes, sync_small_writes;
     int sync_small_checked, sync_big_checked;
+
+    // Delete inode
+    int del_inode_count;
+    obj_ver_id del_inode_wait;
 };
 
 // https://github.com/algorithm-ninja/cpp-btree
@@ -197,6 +209,22 @@ struct blockstore_op_private_t
 typedef btree::btree_map<object_id, clean_entry> blockstore_clean_db_t;
 typedef std::map<obj_ver_id, dirty_entry> blockstore_dirty_db_t;
 
+// clean_db is split into shards by (pool, PG) so that listing one PG doesn't scan all objects
+// Shard ID is (pool_id << (64-POOL_ID_BITS)) | pg_num, pg_num = 0 is used for unsharded pools
+typedef uint64_t pool_pg_id_t;
+
+struct pool_shard_settings_t
+{
+    uint32_t pg_count;
+    uint64_t pg_stripe_size;
+};
+
+struct blockstore_discard_t
+{
+    uint64_t start, count;
+    int res;
+};
+
 #include "blockstore_init.h"
 
 #include "blockstore_flush.h"
@@ -238,14 +266,26 @@ class blockstore_impl_t
     int throttle_target_parallelism = 1;
     // Minimum difference in microseconds between target and real execution times to throttle the response
     int throttle_threshold_us = 50;
+    // Discard (punch holes in) freed data blocks in background, useful for SSDs
+    bool discard_freed_blocks = false;
+    // Maximum discard rate in MB/s, 0 means unlimited
+    uint64_t discard_max_mbs = 100;
     /******* END OF OPTIONS *******/
 
     struct ring_consumer_t ring_consumer;
 
-    blockstore_clean_db_t clean_db;
+    // PG sharding parameters are only known after the first listing of the pool
+    std::map<pool_id_t, pool_shard_settings_t> clean_db_settings;
+    std::map<pool_pg_id_t, blockstore_clean_db_t> clean_db_shards;
+    // Returned by find_clean_db_shard() for objects whose shard doesn't exist yet
+    const blockstore_clean_db_t empty_clean_db;
     uint8_t *clean_bitmap = NULL;
     blockstore_dirty_db_t dirty_db;
     std::vector<blockstore_op_t*> submit_queue;
+    // number of queued operations of each priority class
+    int submit_queue_prio[BS_PRIO_COUNT] = {};
+    // objects with modifications (writes, deletes, stabilize, rollback) skipped in the current submission pass because of priority
+    std::unordered_set<object_id> prio_skipped_writes;
     std::vector<obj_ver_id> unsynced_big_writes, unsynced_small_writes;
     int unsynced_big_write_count = 0;
     allocator *data_alloc = NULL;
@@ -267,6 +307,23 @@ class blockstore_impl_t
     journal_flusher_t *flusher;
     int write_iodepth = 0;
 
+    // Freed data blocks waiting for discard (start => count). They are still marked
+    // as allocated in data_alloc and are only freed when the discard completes
+    std::map<uint64_t, uint64_t> discard_queue;
+    int discards_in_flight = 0;
+    // Discard rate limit budget in bytes and the time when it was last updated
+    uint64_t discard_budget = 0, discard_budget_us = 0;
+    bool data_is_blockdev = false;
+    int discard_timer_id = -1;
+    // BLKDISCARD is a synchronous ioctl, so block devices are discarded in a separate
+    // thread which reports completions through discard_eventfd
+    std::thread *discard_thread = NULL;
+    std::mutex discard_mutex;
+    std::condition_variable discard_cond;
+    std::vector<blockstore_discard_t> discard_submitted, discard_completed;
+    bool discard_thread_stop = false;
+    int discard_eventfd = -1;
+
     bool live = false, queue_stall = false;
     ring_loop_t *ringloop;
     timerfd_manager_t *tfd;
@@ -302,6 +359,8 @@ class blockstore_impl_t
     blockstore_init_journal* journal_init_reader;
 
     void check_wait(blockstore_op_t *op);
+    bool is_prio_skipped(blockstore_op_t *op);
+    void prio_skip_op(blockstore_op_t *op);
 
     // Read
     int dequeue_read(blockstore_op_t *read_op);
@@ -336,8 +395,26 @@ class blockstore_impl_t
     void mark_rolled_back(const obj_ver_id & ov);
     void erase_dirty(blockstore_dirty_db_t::iterator dirty_start, blockstore_dirty_db_t::iterator dirty_end, uint64_t clean_loc);
 
+    // Discard
+    void free_data_block(uint64_t block_num);
+    void release_discard_queue();
+    void discard_loop();
+    void handle_discard_event(int res, uint64_t start, uint64_t count);
+    bool start_discard_thread();
+    void stop_discard_thread();
+    void discard_thread_loop();
+    void handle_discard_completions();
+
+    // Delete inode
+    int dequeue_del_inode(blockstore_op_t *op);
+    int continue_del_inode(blockstore_op_t *op);
+
     // List
     void process_list(blockstore_op_t *op);
+    pool_pg_id_t clean_db_shard_id(object_id oid);
+    blockstore_clean_db_t& clean_db_shard(object_id oid);
+    const blockstore_clean_db_t& find_clean_db_shard(object_id oid);
+    void reshard_clean_db(pool_id_t pool, uint32_t pg_count, uint64_t pg_stripe_size);
 
 public:
 
@@ -365,6 +442,9 @@ public:
     // Simplified synchronous operation: get object bitmap & current version
     int read_bitmap(object_id oid, uint64_t target_version, void *bitmap, uint64_t *result_version = NULL);
 
+    // Simplified synchronous operation: check if <version> is the last version of the object and it's stable
+    bool is_latest_stable(object_id oid, uint64_t version);
+
     // Unstable writes are added here (map of object_id -> version)
     std::unordered_map<object_id, uint64_t> unstable_writes;
 
@@ -379,4 +459,5 @@ public:
     inline uint64_t get_free_block_count() { return data_alloc->get_free_count(); }
     inline uint32_t get_bitmap_granularity() { return disk_alignment; }
     inline uint64_t get_journal_size() { return journal.len; }
+    inline uint64_t get_queue_depth() { return submit_queue.size(); }
 };
@@ -222,10 +222,11 @@ void blockstore_init_meta::handle_entries(void* entries, unsigned count, int blo
         }
         if (entry->oid.inode > 0)
         {
-            auto clean_it = bs->clean_db.find(entry->oid);
-            if (clean_it == bs->clean_db.end() || clean_it->second.version < entry->version)
+            auto & clean_db = bs->clean_db_shard(entry->oid);
+            auto clean_it = clean_db.find(entry->oid);
+            if (clean_it == clean_db.end() || clean_it->second.version < entry->version)
             {
-                if (clean_it != bs->clean_db.end())
+                if (clean_it != clean_db.end())
                 {
                     // free the previous block
 #ifdef BLOCKSTORE_DEBUG
@@ -245,7 +246,7 @@ void blockstore_init_meta::handle_entries(void* entries, unsigned count, int blo
                 printf("Allocate block (clean entry) %lu: %lx:%lx v%lu\n", done_cnt+i, entry->oid.inode, entry->oid.stripe, entry->version);
 #endif
                 bs->data_alloc->set(done_cnt+i, true);
-                bs->clean_db[entry->oid] = (struct clean_entry){
+                clean_db[entry->oid] = (struct clean_entry){
                     .version = entry->version,
                     .location = (done_cnt+i) << block_order,
                 };
@@ -656,8 +657,9 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
                     init_write_sector = proc_pos;
                     return 0;
                 }
-                auto clean_it = bs->clean_db.find(je->small_write.oid);
-                if (clean_it == bs->clean_db.end() ||
+                auto & clean_db = bs->find_clean_db_shard(je->small_write.oid);
+                auto clean_it = clean_db.find(je->small_write.oid);
+                if (clean_it == clean_db.end() ||
                     clean_it->second.version < je->small_write.version)
                 {
                     obj_ver_id ov = {
@@ -735,8 +737,9 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
                         erase_dirty_object(dirty_it);
                     }
                 }
-                auto clean_it = bs->clean_db.find(je->big_write.oid);
-                if (clean_it == bs->clean_db.end() ||
+                auto & clean_db = bs->find_clean_db_shard(je->big_write.oid);
+                auto clean_it = clean_db.find(je->big_write.oid);
+                if (clean_it == clean_db.end() ||
                     clean_it->second.version < je->big_write.version)
                 {
                     // oid, version, block
@@ -831,46 +834,27 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
 #ifdef BLOCKSTORE_DEBUG
                 printf("je_delete oid=%lx:%lx ver=%lu\n", je->del.oid.inode, je->del.oid.stripe, je->del.version);
 #endif
-                bool dirty_exists = false;
-                auto dirty_it = bs->dirty_db.upper_bound((obj_ver_id){
+                replay_delete((obj_ver_id){
                     .oid = je->del.oid,
-                    .version = UINT64_MAX,
-                });
-                if (dirty_it != bs->dirty_db.begin())
-                {
-                    dirty_it--;
-                    dirty_exists = dirty_it->first.oid == je->del.oid;
-                }
-                auto clean_it = bs->clean_db.find(je->del.oid);
-                bool clean_exists = (clean_it != bs->clean_db.end() &&
-                    clean_it->second.version < je->del.version);
-                if (!clean_exists && dirty_exists)
-                {
-                    // Clean entry doesn't exist. This means that the delete is already flushed.
-                    // So we must not flush this object anymore.
-                    erase_dirty_object(dirty_it);
-                }
-                else if (clean_exists || dirty_exists)
+                    .version = je->del.version,
+                }, proc_pos);
+            }
+            else if (je->type == JE_DELETE_BULK)
+            {
+                int count = (je->size - sizeof(journal_entry_del_bulk)) / sizeof(journal_del_bulk_item);
+#ifdef BLOCKSTORE_DEBUG
+                printf("je_delete_bulk inode=%lx count=%d\n", je->del_bulk.inode, count);
+#endif
+                for (int i = 0; i < count; i++)
                 {
-                    // oid, version
-                    obj_ver_id ov = {
-                        .oid = je->del.oid,
-                        .version = je->del.version,
-                    };
-                    bs->dirty_db.emplace(ov, (dirty_entry){
-                        .state = (BS_ST_DELETE | BS_ST_SYNCED),
-                        .flags = 0,
-                        .location = 0,
-                        .offset = 0,
-                        .len = 0,
-                        .journal_sector = proc_pos,
-                    });
-                    bs->journal.used_sectors[proc_pos]++;
-                    // Deletions are treated as immediately stable, because
-                    // "2-phase commit" (write->stabilize) isn't sufficient for them anyway
-                    bs->mark_stable(ov, true);
+                    replay_delete((obj_ver_id){
+                        .oid = {
+                            .inode = je->del_bulk.inode,
+                            .stripe = je->del_bulk.items[i].stripe,
+                        },
+                        .version = je->del_bulk.items[i].version,
+                    }, proc_pos);
                 }
-                // Ignore delete if neither preceding dirty entries nor the clean one are present
             }
             started = true;
             pos += je->size;
@@ -882,6 +866,46 @@ int blockstore_init_journal::handle_journal_part(void *buf, uint64_t done_pos, u
     return 1;
 }
 
+void blockstore_init_journal::replay_delete(obj_ver_id ov, uint64_t proc_pos)
+{
+    bool dirty_exists = false;
+    auto dirty_it = bs->dirty_db.upper_bound((obj_ver_id){
+        .oid = ov.oid,
+        .version = UINT64_MAX,
+    });
+    if (dirty_it != bs->dirty_db.begin())
+    {
+        dirty_it--;
+        dirty_exists = dirty_it->first.oid == ov.oid;
+    }
+    auto & clean_db = bs->find_clean_db_shard(ov.oid);
+    auto clean_it = clean_db.find(ov.oid);
+    bool clean_exists = (clean_it != clean_db.end() &&
+        clean_it->second.version < ov.version);
+    if (!clean_exists && dirty_exists)
+    {
+        // Clean entry doesn't exist. This means that the delete is already flushed.
+        // So we must not flush this object anymore.
+        erase_dirty_object(dirty_it);
+    }
+    else if (clean_exists || dirty_exists)
+    {
+        bs->dirty_db.emplace(ov, (dirty_entry){
+            .state = (BS_ST_DELETE | BS_ST_SYNCED),
+            .flags = 0,
+            .location = 0,
+            .offset = 0,
+            .len = 0,
+            .journal_sector = proc_pos,
+        });
+        bs->journal.used_sectors[proc_pos]++;
+        // Deletions are treated as immediately stable, because
+        // "2-phase commit" (write->stabilize) isn't sufficient for them anyway
+        bs->mark_stable(ov, true);
+    }
+    // Ignore delete if neither preceding dirty entries nor the clean one are present
+}
+
 void blockstore_init_journal::erase_dirty_object(blockstore_dirty_db_t::iterator dirty_it)
 {
     auto oid = dirty_it->first.oid;
@@ -901,8 +925,9 @@ void blockstore_init_journal::erase_dirty_object(blockstore_dirty_db_t::iterator
             break;
         }
     }
-    auto clean_it = bs->clean_db.find(oid);
-    uint64_t clean_loc = clean_it != bs->clean_db.end()
+    auto & clean_db = bs->find_clean_db_shard(oid);
+    auto clean_it = clean_db.find(oid);
+    uint64_t clean_loc = clean_it != clean_db.end()
         ? clean_it->second.location : UINT64_MAX;
     if (exists && clean_loc == UINT64_MAX)
     {
@@ -28,7 +28,8 @@
 #define JE_ROLLBACK    0x06
 #define JE_SMALL_WRITE_INSTANT 0x07
 #define JE_BIG_WRITE_INSTANT   0x08
-#define JE_MAX         0x08
+#define JE_DELETE_BULK 0x09
+#define JE_MAX         0x09
 
 // crc32c comes first to ease calculation and is equal to crc32()
 struct __attribute__((__packed__)) journal_entry_start
@@ -113,6 +114,25 @@ struct __attribute__((__packed__)) journal_entry_del
     uint64_t version;
 };
 
+struct __attribute__((__packed__)) journal_del_bulk_item
+{
+    uint64_t stripe;
+    uint64_t version;
+};
+
+struct __attribute__((__packed__)) journal_entry_del_bulk
+{
+    uint32_t crc32;
+    uint16_t magic;
+    uint16_t type;
+    uint32_t size;
+    uint32_t crc32_prev;
+    uint64_t inode;
+    // del_bulk entries are followed by (size-sizeof(journal_entry_del_bulk))/sizeof(journal_del_bulk_item)
+    // deleted objects of <inode>, each of them is a separate JE_DELETE in fact
+    journal_del_bulk_item items[];
+};
+
 struct __attribute__((__packed__)) journal_entry
 {
     union
@@ -131,6 +151,7 @@ struct __attribute__((__packed__)) journal_entry
         journal_entry_stable stable;
         journal_entry_rollback rollback;
         journal_entry_del del;
+        journal_entry_del_bulk del_bulk;
     };
 };
 
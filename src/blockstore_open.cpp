@@ -84,6 +84,11 @@ void blockstore_impl_t::parse_config(blockstore_config_t & config)
     throttle_target_mbs = strtoull(config["throttle_target_mbs"].c_str(), NULL, 10);
     throttle_target_parallelism = strtoull(config["throttle_target_parallelism"].c_str(), NULL, 10);
     throttle_threshold_us = strtoull(config["throttle_threshold_us"].c_str(), NULL, 10);
+    discard_freed_blocks = config["discard_freed_blocks"] == "true" || config["discard_freed_blocks"] == "1" || config["discard_freed_blocks"] == "yes";
+    if (config.find("discard_max_mbs") != config.end())
+    {
+        discard_max_mbs = strtoull(config["discard_max_mbs"].c_str(), NULL, 10);
+    }
     // Validate
     if (!block_size)
     {
@@ -337,6 +342,8 @@ void blockstore_impl_t::open_data()
         throw std::runtime_error("Failed to open data device");
     }
     check_size(data_fd, &data_size, &data_device_sect, "data device");
+    struct stat st;
+    data_is_blockdev = fstat(data_fd, &st) == 0 && S_ISBLK(st.st_mode);
     if (disk_alignment % data_device_sect)
     {
         throw std::runtime_error(
@@ -111,6 +111,7 @@ uint8_t* blockstore_impl_t::get_clean_entry_bitmap(uint64_t block_loc, int offse
 
 int blockstore_impl_t::dequeue_read(blockstore_op_t *read_op)
 {
+    auto & clean_db = find_clean_db_shard(read_op->oid);
     auto clean_it = clean_db.find(read_op->oid);
     auto dirty_it = dirty_db.upper_bound((obj_ver_id){
         .oid = read_op->oid,
@@ -290,13 +291,14 @@ int blockstore_impl_t::read_bitmap(object_id oid, uint64_t target_version, void
                     void *bmp_ptr = (clean_entry_bitmap_size > sizeof(void*) ? dirty_it->second.bitmap : &dirty_it->second.bitmap);
                     memcpy(bitmap, bmp_ptr, clean_entry_bitmap_size);
                 }
-                return 0;
+                return IS_DELETE(dirty_it->second.state) ? -ENOENT : 0;
             }
             if (dirty_it == dirty_db.begin())
                 break;
             dirty_it--;
         }
     }
+    auto & clean_db = find_clean_db_shard(oid);
     auto clean_it = clean_db.find(oid);
     if (clean_it != clean_db.end())
     {
@@ -315,3 +317,22 @@ int blockstore_impl_t::read_bitmap(object_id oid, uint64_t target_version, void
         memset(bitmap, 0, clean_entry_bitmap_size);
     return -ENOENT;
 }
+
+bool blockstore_impl_t::is_latest_stable(object_id oid, uint64_t version)
+{
+    auto dirty_it = dirty_db.upper_bound((obj_ver_id){
+        .oid = oid,
+        .version = UINT64_MAX,
+    });
+    if (dirty_it != dirty_db.begin())
+    {
+        dirty_it--;
+        if (dirty_it->first.oid == oid)
+        {
+            return dirty_it->first.version == version && IS_STABLE(dirty_it->second.state);
+        }
+    }
+    auto & clean_db = find_clean_db_shard(oid);
+    auto clean_it = clean_db.find(oid);
+    return (clean_it != clean_db.end() ? clean_it->second.version : 0) == version;
+}
@@ -220,7 +220,7 @@ void blockstore_impl_t::erase_dirty(blockstore_dirty_db_t::iterator dirty_start,
             printf("Free block %lu from %lx:%lx v%lu\n", dirty_it->second.location >> block_order,
                 dirty_it->first.oid.inode, dirty_it->first.oid.stripe, dirty_it->first.version);
 #endif
-            data_alloc->set(dirty_it->second.location >> block_order, false);
+            free_data_block(dirty_it->second.location >> block_order);
         }
         int used = --journal.used_sectors[dirty_it->second.journal_sector];
 #ifdef BLOCKSTORE_DEBUG
@@ -41,6 +41,7 @@ bool blockstore_impl_t::enqueue_write(blockstore_op_t *op)
     }
     if (!found)
     {
+        auto & clean_db = find_clean_db_shard(op->oid);
         auto clean_it = clean_db.find(op->oid);
         if (clean_it != clean_db.end())
         {
@@ -102,6 +103,7 @@ bool blockstore_impl_t::enqueue_write(blockstore_op_t *op)
         // Issue an additional sync so that the previous big write can reach the journal
         blockstore_op_t *sync_op = new blockstore_op_t;
         sync_op->opcode = BS_OP_SYNC;
+        sync_op->priority = op->priority;
         sync_op->callback = [](blockstore_op_t *sync_op)
         {
             delete sync_op;
@@ -256,10 +258,16 @@ int blockstore_impl_t::dequeue_write(blockstore_op_t *op)
         }
         // Big (redirect) write
         uint64_t loc = data_alloc->find_free();
+        if (loc == UINT64_MAX && discard_queue.size() > 0)
+        {
+            // out of space - reuse blocks still waiting for discard
+            release_discard_queue();
+            loc = data_alloc->find_free();
+        }
         if (loc == UINT64_MAX)
         {
             // no space
-            if (flusher->is_active())
+            if (flusher->is_active() || discards_in_flight > 0)
             {
                 // hope that some space will be available after flush
                 PRIV(op)->wait_for = WAIT_FREE;
@@ -391,6 +391,7 @@ struct snap_merger_t
         op->inode = target;
         op->offset = rwo->offset;
         op->len = target_block_size;
+        op->flags = use_cas ? OSD_OP_NEED_VERSION : 0;
         op->iov.push_back(rwo->buf, target_block_size);
         op->callback = [this, rwo](cluster_op_t *op)
         {
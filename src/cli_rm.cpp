@@ -8,6 +8,9 @@
 #define RM_REMOVING 2
 #define RM_END 3
 
+#define RM_BULK_SENT 1
+#define RM_BULK_DONE 2
+
 struct rm_pg_t
 {
     pg_num_t pg_num;
@@ -16,6 +19,7 @@ struct rm_pg_t
     std::set<object_id>::iterator obj_pos;
     uint64_t obj_count = 0, obj_done = 0;
     int state = 0;
+    int bulk_state = 0;
     int in_flight = 0;
 };
 
@@ -90,6 +94,15 @@ struct rm_inode_t
             parent->cli->msgr.connect_peer(cur_list->rm_osd_num, parent->cli->st_cli.peer_states[cur_list->rm_osd_num]);
             return;
         }
+        if (cur_list->bulk_state == 0)
+        {
+            // Try to delete all objects of the inode in this PG with a single request first
+            send_bulk_delete(cur_list);
+        }
+        if (cur_list->bulk_state == RM_BULK_SENT)
+        {
+            return;
+        }
         while (cur_list->in_flight < parent->iodepth && cur_list->obj_pos != cur_list->objects.end())
         {
             if (cur_list->obj_pos->stripe >= min_offset)
@@ -130,6 +143,59 @@ struct rm_inode_t
         }
     }
 
+    void send_bulk_delete(rm_pg_t *cur_list)
+    {
+        if (cur_list->obj_pos == cur_list->objects.end())
+        {
+            cur_list->bulk_state = RM_BULK_DONE;
+            return;
+        }
+        osd_op_t *op = new osd_op_t();
+        op->op_type = OSD_OP_OUT;
+        op->peer_fd = parent->cli->msgr.osd_peer_fds[cur_list->rm_osd_num];
+        op->req = (osd_any_op_t){
+            .del_inode = {
+                .header = {
+                    .magic = SECONDARY_OSD_OP_MAGIC,
+                    .id = parent->cli->next_op_id(),
+                    .opcode = OSD_OP_DELETE_INODE,
+                },
+                .inode = inode,
+                .min_offset = min_offset,
+                .pg_num = cur_list->pg_num,
+            },
+        };
+        op->callback = [this, cur_list](osd_op_t *op)
+        {
+            cur_list->in_flight--;
+            cur_list->bulk_state = RM_BULK_DONE;
+            if (op->reply.hdr.retval == 0)
+            {
+                // All objects are deleted
+                for (; cur_list->obj_pos != cur_list->objects.end(); cur_list->obj_pos++)
+                {
+                    if (cur_list->obj_pos->stripe >= min_offset)
+                    {
+                        cur_list->obj_done++;
+                        total_done++;
+                    }
+                }
+            }
+            else if (op->reply.hdr.retval != -EBUSY && op->reply.hdr.retval != -EINVAL)
+            {
+                // -EBUSY means that the PG isn't clean and -EINVAL means that the OSD
+                // doesn't support bulk deletes. Silently fall back to deleting objects one by one
+                fprintf(stderr, "Failed to remove objects of inode %lx from PG %u (OSD %lu) in bulk (retval=%ld), deleting them one by one\n",
+                    inode, cur_list->pg_num, cur_list->rm_osd_num, op->reply.hdr.retval);
+            }
+            delete op;
+            continue_delete();
+        };
+        cur_list->in_flight++;
+        cur_list->bulk_state = RM_BULK_SENT;
+        parent->cli->msgr.outbox_push(op);
+    }
+
     void continue_delete()
     {
         if (parent->list_first && !lists_done)
@@ -3,6 +3,7 @@
 
 #include <stdexcept>
 #include <assert.h>
+#include "pg_states.h"
 #include "cluster_client.h"
 
 #define SCRAP_BUFFER_SIZE 4*1024*1024
@@ -315,6 +316,7 @@ void cluster_client_t::on_load_config_hook(json11::Json::object & config)
     {
         client_max_dirty_ops = DEFAULT_CLIENT_MAX_DIRTY_OPS;
     }
+    direct_ec_reads = config["direct_ec_reads"].bool_value() || config["direct_ec_reads"].uint64_value() != 0;
     up_wait_retry_interval = config["up_wait_retry_interval"].uint64_value();
     if (!up_wait_retry_interval)
     {
@@ -667,6 +669,11 @@ resume_2:
         {
             if (!try_send(op, i))
             {
+                if (op->needs_reslice)
+                {
+                    // Direct reads are not possible anymore
+                    goto resume_2;
+                }
                 // We'll need to retry again
                 op->up_wait = true;
                 if (!retry_timeout_id)
@@ -802,7 +809,10 @@ void cluster_client_t::slice_rw(cluster_op_t *op)
     uint64_t first_stripe = (op->offset / pg_block_size) * pg_block_size;
     uint64_t last_stripe = op->len > 0 ? ((op->offset + op->len - 1) / pg_block_size) * pg_block_size : first_stripe;
     op->retval = 0;
-    op->parts.resize((last_stripe - first_stripe) / pg_block_size + 1);
+    // Direct EC reads split stripes into data chunks, so reserve space for the maximum number of parts
+    bool direct = direct_ec_reads && pool_cfg.scheme != POOL_SCHEME_REPLICATED && op->opcode == OSD_OP_READ &&
+        op->cur_inode == op->inode && !(op->flags & OSD_OP_NEED_VERSION) && !op->no_direct;
+    op->parts.resize(((last_stripe - first_stripe) / pg_block_size + 1) * (direct ? pg_data_size : 1));
     if (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP)
     {
         // Allocate memory for the bitmap
@@ -830,6 +840,27 @@ void cluster_client_t::slice_rw(cluster_op_t *op)
         uint64_t begin = (op->offset < stripe ? stripe : op->offset);
         uint64_t end = (op->offset + op->len) > (stripe + pg_block_size)
             ? (stripe + pg_block_size) : (op->offset + op->len);
+        if (direct && can_read_direct(pool_cfg, pg_num))
+        {
+            // Read each data chunk from its own OSD
+            for (uint64_t chunk_begin = begin; chunk_begin < end; )
+            {
+                uint64_t chunk_end = (chunk_begin / bs_block_size + 1) * bs_block_size;
+                chunk_end = chunk_end > end ? end : chunk_end;
+                op->parts[i].iov.reset();
+                add_iov(chunk_end-chunk_begin, false, op, iov_idx, iov_pos, op->parts[i].iov, NULL, 0);
+                op->parts[i].parent = op;
+                op->parts[i].offset = chunk_begin;
+                op->parts[i].len = (uint32_t)(chunk_end - chunk_begin);
+                op->parts[i].pg_num = pg_num;
+                op->parts[i].osd_num = 0;
+                op->parts[i].role = (chunk_begin - stripe) / bs_block_size;
+                op->parts[i].flags = 0;
+                chunk_begin = chunk_end;
+                i++;
+            }
+            continue;
+        }
         op->parts[i].iov.reset();
         if (op->cur_inode != op->inode)
         {
@@ -879,9 +910,31 @@ void cluster_client_t::slice_rw(cluster_op_t *op)
         op->parts[i].len = op->opcode == OSD_OP_READ_BITMAP || op->opcode == OSD_OP_DELETE ? 0 : (uint32_t)(end - begin);
         op->parts[i].pg_num = pg_num;
         op->parts[i].osd_num = 0;
+        op->parts[i].role = -1;
         op->parts[i].flags = 0;
         i++;
     }
+    op->parts.resize(i);
+}
+
+// Direct reads are only safe when the PG is active and clean, so that every data chunk
+// is up-to-date on the OSD reported in its current set. Degraded, misplaced or otherwise
+// unclean PGs are read through the primary which knows object states and versions
+bool cluster_client_t::can_read_direct(pool_config_t & pool_cfg, pg_num_t pg_num)
+{
+    auto pg_it = pool_cfg.pg_config.find(pg_num);
+    if (pg_it == pool_cfg.pg_config.end() || pg_it->second.pause ||
+        pg_it->second.cur_state != PG_ACTIVE || pg_it->second.cur_set.size() != pool_cfg.pg_size)
+    {
+        return false;
+    }
+    for (int role = 0; role < pool_cfg.pg_size-pool_cfg.parity_chunks; role++)
+    {
+        osd_num_t role_osd = pg_it->second.cur_set[role];
+        if (!role_osd || role_osd == UINT64_MAX)
+            return false;
+    }
+    return true;
 }
 
 bool cluster_client_t::affects_osd(uint64_t inode, uint64_t offset, uint64_t len, osd_num_t osd)
@@ -906,6 +959,10 @@ bool cluster_client_t::affects_osd(uint64_t inode, uint64_t offset, uint64_t len
 bool cluster_client_t::try_send(cluster_op_t *op, int i)
 {
     auto part = &op->parts[i];
+    if (part->role >= 0)
+    {
+        return try_send_direct(op, i);
+    }
     auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(op->cur_inode));
     auto pg_it = pool_cfg.pg_config.find(part->pg_num);
     if (pg_it != pool_cfg.pg_config.end() &&
@@ -916,6 +973,18 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
         if (peer_it != msgr.osd_peer_fds.end())
         {
             int peer_fd = peer_it->second;
+            if (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP)
+            {
+                // Reads may use any connection to the OSD. Writes and deletes always use the main
+                // one because the OSD remembers PGs dirtied by them per connection until SYNC
+                uint64_t pg_block_size = bs_block_size * (
+                    pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks
+                );
+                peer_fd = msgr.select_peer_fd(primary_osd, (object_id){
+                    .inode = op->cur_inode,
+                    .stripe = part->offset - part->offset % pg_block_size,
+                });
+            }
             part->osd_num = primary_osd;
             part->flags |= PART_SENT;
             op->inflight_count++;
@@ -963,6 +1032,68 @@ bool cluster_client_t::try_send(cluster_op_t *op, int i)
     return false;
 }
 
+bool cluster_client_t::try_send_direct(cluster_op_t *op, int i)
+{
+    auto part = &op->parts[i];
+    auto & pool_cfg = st_cli.pool_config.at(INODE_POOL(op->cur_inode));
+    if (!can_read_direct(pool_cfg, part->pg_num))
+    {
+        // PG is not clean anymore, read it through the primary
+        op->no_direct = true;
+        op->needs_reslice = true;
+        return false;
+    }
+    uint64_t pg_block_size = bs_block_size * (pool_cfg.pg_size-pool_cfg.parity_chunks);
+    auto & pg_cfg = pool_cfg.pg_config.at(part->pg_num);
+    osd_num_t role_osd = pg_cfg.cur_set[part->role];
+    auto peer_it = msgr.osd_peer_fds.find(role_osd);
+    if (peer_it == msgr.osd_peer_fds.end())
+    {
+        if (msgr.wanted_peers.find(role_osd) == msgr.wanted_peers.end())
+        {
+            msgr.connect_peer(role_osd, st_cli.peer_states[role_osd]);
+        }
+        return false;
+    }
+    part->osd_num = role_osd;
+    part->flags |= PART_SENT;
+    op->inflight_count++;
+    object_id oid = {
+        .inode = op->cur_inode,
+        .stripe = (part->offset / pg_block_size) * pg_block_size | part->role,
+    };
+    part->op = (osd_op_t){
+        .op_type = OSD_OP_OUT,
+        .peer_fd = msgr.select_peer_fd(role_osd, oid),
+        .req = { .sec_rw = {
+            .header = {
+                .magic = SECONDARY_OSD_OP_MAGIC,
+                .id = op_id++,
+                .opcode = OSD_OP_SEC_READ,
+            },
+            .oid = oid,
+            // Latest version, like in reads through the primary
+            .version = UINT64_MAX,
+            .offset = (uint32_t)(part->offset % bs_block_size),
+            .len = part->len,
+            .attr_len = 0,
+            .priority = OSD_OP_PRIO_CLIENT,
+            // The OSD refuses the read if it sees another PG state, i.e. if our view is stale
+            .pg_primary = pg_cfg.cur_primary,
+            .pg_state_revision = pg_cfg.state_revision,
+        } },
+        .bitmap = (uint8_t*)op->part_bitmaps + bs_bitmap_size*(pool_cfg.pg_size-pool_cfg.parity_chunks)*i,
+        .bitmap_len = bs_bitmap_size,
+        .callback = [this, part](osd_op_t *op_part)
+        {
+            handle_op_part(part);
+        },
+    };
+    part->op.iov = part->iov;
+    msgr.outbox_push(&part->op);
+    return true;
+}
+
 int cluster_client_t::continue_sync(cluster_op_t *op)
 {
     if (op->state == 1)
@@ -1001,6 +1132,7 @@ int cluster_client_t::continue_sync(cluster_op_t *op)
             op->parts[i] = {
                 .parent = op,
                 .osd_num = sync_osd,
+                .role = -1,
                 .flags = 0,
             };
             send_sync(op, &op->parts[i]);
@@ -1089,8 +1221,23 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
 {
     cluster_op_t *op = part->parent;
     op->inflight_count--;
-    int expected = part->op.req.hdr.opcode == OSD_OP_SYNC ? 0 : part->op.req.rw.len;
-    if (part->op.reply.hdr.retval != expected)
+    int expected = part->op.req.hdr.opcode == OSD_OP_SYNC ? 0 : (part->role >= 0 ? part->op.req.sec_rw.len : part->op.req.rw.len);
+    if (part->role >= 0 && (part->op.reply.hdr.retval != expected || is_torn_direct_read(op, part)))
+    {
+        // Direct read failed, was refused because of a PG state change or a write in progress,
+        // or raced with a write completed between chunk reads. Retry it through the primary
+        if (log_level > 0)
+        {
+            fprintf(
+                stderr, "Direct read from OSD %lu failed: retval=%ld (expected %d), version=%lu, retrying through the primary\n",
+                part->osd_num, part->op.reply.hdr.retval, expected, part->op.reply.sec_rw.version
+            );
+        }
+        op->no_direct = true;
+        op->needs_reslice = true;
+        part->flags |= PART_ERROR;
+    }
+    else if (part->op.reply.hdr.retval != expected)
     {
         // Operation failed, retry
         if (part->op.reply.hdr.retval == -EPIPE)
@@ -1124,13 +1271,15 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
     else
     {
         // OK
-        dirty_osds.insert(part->osd_num);
+        if (part->role < 0)
+            dirty_osds.insert(part->osd_num);
         part->flags |= PART_DONE;
         op->done_count++;
         if (op->opcode == OSD_OP_READ || op->opcode == OSD_OP_READ_BITMAP)
         {
             copy_part_bitmap(op, part);
-            op->version = op->parts.size() == 1 ? part->op.reply.rw.version : 0;
+            // Chunk versions are not object versions, so direct reads don't return them
+            op->version = op->parts.size() == 1 && part->role < 0 ? part->op.reply.rw.version : 0;
         }
     }
     if (op->inflight_count == 0)
@@ -1142,6 +1291,24 @@ void cluster_client_t::handle_op_part(cluster_op_part_t *part)
     }
 }
 
+// All chunks of an EC object are written with the same version, so chunks of one stripe
+// with different versions mean that a write has completed between their direct reads
+bool cluster_client_t::is_torn_direct_read(cluster_op_t *op, cluster_op_part_t *part)
+{
+    object_id oid = part->op.req.sec_rw.oid;
+    for (auto & other: op->parts)
+    {
+        if (&other != part && other.role >= 0 && (other.flags & PART_DONE) &&
+            other.op.req.sec_rw.oid.inode == oid.inode &&
+            (other.op.req.sec_rw.oid.stripe & ~STRIPE_MASK) == (oid.stripe & ~STRIPE_MASK) &&
+            other.op.reply.sec_rw.version != part->op.reply.sec_rw.version)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 void cluster_client_t::copy_part_bitmap(cluster_op_t *op, cluster_op_part_t *part)
 {
     // Copy (OR) bitmap
@@ -1149,9 +1316,10 @@ void cluster_client_t::copy_part_bitmap(cluster_op_t *op, cluster_op_part_t *par
     uint32_t pg_block_size = bs_block_size * (
         pool_cfg.scheme == POOL_SCHEME_REPLICATED ? 1 : pool_cfg.pg_size-pool_cfg.parity_chunks
     );
-    uint32_t object_offset = (part->op.req.rw.offset - op->offset) / bs_bitmap_granularity;
-    uint32_t part_offset = (part->op.req.rw.offset % pg_block_size) / bs_bitmap_granularity;
-    uint32_t part_len = (op->opcode == OSD_OP_READ_BITMAP ? pg_block_size : part->op.req.rw.len) / bs_bitmap_granularity;
+    uint32_t object_offset = (part->offset - op->offset) / bs_bitmap_granularity;
+    // Direct EC reads return the bitmap of a single data chunk
+    uint32_t part_offset = (part->offset % (part->role >= 0 ? bs_block_size : pg_block_size)) / bs_bitmap_granularity;
+    uint32_t part_len = (op->opcode == OSD_OP_READ_BITMAP ? pg_block_size : part->len) / bs_bitmap_granularity;
     if (!(object_offset & 0x7) && !(part_offset & 0x7) && (part_len >= 8))
     {
         // Copy bytes
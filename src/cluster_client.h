@@ -15,6 +15,8 @@
 #define OSD_OP_READ_BITMAP OSD_OP_SEC_READ_BMP
 
 #define OSD_OP_IGNORE_READONLY 0x08
+// the caller needs the object version returned by reads, which rules out direct EC reads
+#define OSD_OP_NEED_VERSION 0x10
 
 struct cluster_op_t;
 
@@ -25,6 +27,8 @@ struct cluster_op_part_t
     uint32_t len;
     pg_num_t pg_num;
     osd_num_t osd_num;
+    // data chunk number for direct EC reads, -1 if the part is sent to the primary OSD
+    int role;
     osd_op_buf_list_t iov;
     unsigned flags;
     osd_op_t op;
@@ -39,7 +43,7 @@ struct cluster_op_t
     // for reads and writes within a single object (stripe),
     // reads can return current version and writes can use "CAS" semantics
     uint64_t version = 0;
-    // now only OSD_OP_IGNORE_READONLY is supported
+    // now only OSD_OP_IGNORE_READONLY and OSD_OP_NEED_VERSION are supported
     uint64_t flags = 0;
     int retval;
     osd_op_buf_list_t iov;
@@ -53,6 +57,7 @@ protected:
     void *buf = NULL;
     cluster_op_t *orig_op = NULL;
     bool needs_reslice = false;
+    bool no_direct = false;
     bool up_wait = false;
     int inflight_count = 0, done_count = 0;
     std::vector<cluster_op_part_t> parts;
@@ -89,6 +94,8 @@ class cluster_client_t
     uint64_t client_max_dirty_ops = 0;
     int log_level;
     int up_wait_retry_interval = 500; // ms
+    // read data chunks of clean EC PGs directly from their OSDs, bypassing the primary
+    bool direct_ec_reads = false;
 
     int retry_timeout_id = 0;
     uint64_t op_id = 1;
@@ -137,7 +144,10 @@ protected:
     void on_change_osd_state_hook(uint64_t peer_osd);
     int continue_rw(cluster_op_t *op);
     void slice_rw(cluster_op_t *op);
+    bool can_read_direct(pool_config_t & pool_cfg, pg_num_t pg_num);
     bool try_send(cluster_op_t *op, int i);
+    bool try_send_direct(cluster_op_t *op, int i);
+    bool is_torn_direct_read(cluster_op_t *op, cluster_op_part_t *part);
     int continue_sync(cluster_op_t *op);
     void send_sync(cluster_op_t *op, cluster_op_part_t *part);
     void handle_op_part(cluster_op_part_t *part);
@@ -213,6 +213,15 @@ int journal_dump_t::dump_block(void *buf)
         {
             printf("je_delete oid=%lx:%lx ver=%lu\n", je->del.oid.inode, je->del.oid.stripe, je->del.version);
         }
+        else if (je->type == JE_DELETE_BULK)
+        {
+            int count = (je->size - sizeof(journal_entry_del_bulk)) / sizeof(journal_del_bulk_item);
+            printf("je_delete_bulk inode=%lx count=%d\n", je->del_bulk.inode, count);
+            for (int i = 0; i < count; i++)
+            {
+                printf("  oid=%lx:%lx ver=%lu\n", je->del_bulk.inode, je->del_bulk.items[i].stripe, je->del_bulk.items[i].version);
+            }
+        }
         pos += je->size;
         entry++;
     }
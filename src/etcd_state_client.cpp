@@ -615,6 +615,9 @@ void etcd_state_client_t::parse_state(const etcd_kv_t & kv)
             uint64_t min_stripe_size = bs_block_size * (pc.scheme == POOL_SCHEME_REPLICATED ? 1 : (pc.pg_size-pc.parity_chunks));
             if (pc.pg_stripe_size < min_stripe_size)
                 pc.pg_stripe_size = min_stripe_size;
+            // QoS limits
+            pc.qos_iops = pool_item.second["qos_iops"].uint64_value();
+            pc.qos_mbs = pool_item.second["qos_mbs"].uint64_value();
             // Save
             pc.real_pg_count = this->pool_config[pool_id].real_pg_count;
             std::swap(pc.pg_config, this->pool_config[pool_id].pg_config);
@@ -753,6 +756,8 @@ void etcd_state_client_t::parse_state(const etcd_kv_t & kv)
         {
             this->pool_config[pool_id].pg_config[pg_num].cur_primary = 0;
             this->pool_config[pool_id].pg_config[pg_num].cur_state = 0;
+            this->pool_config[pool_id].pg_config[pg_num].cur_set.clear();
+            this->pool_config[pool_id].pg_config[pg_num].state_revision = 0;
         }
         else
         {
@@ -785,6 +790,13 @@ void etcd_state_client_t::parse_state(const etcd_kv_t & kv)
             }
             this->pool_config[pool_id].pg_config[pg_num].cur_primary = cur_primary;
             this->pool_config[pool_id].pg_config[pg_num].cur_state = state;
+            this->pool_config[pool_id].pg_config[pg_num].state_revision = kv.mod_revision;
+            auto & cur_set = this->pool_config[pool_id].pg_config[pg_num].cur_set;
+            cur_set.clear();
+            for (auto & pg_osd: value["cur_set"].array_items())
+            {
+                cur_set.push_back(pg_osd.uint64_value());
+            }
         }
     }
     else if (key.substr(0, etcd_prefix.length()+11) == etcd_prefix+"/osd/state/")
@@ -869,6 +881,8 @@ void etcd_state_client_t::parse_state(const etcd_kv_t & kv)
                     .parent_id = parent_inode_num,
                     .readonly = value["readonly"].bool_value(),
                     .mod_revision = kv.mod_revision,
+                    .qos_iops = value["qos_iops"].uint64_value(),
+                    .qos_mbs = value["qos_mbs"].uint64_value(),
                 };
                 this->inode_config[inode_num] = cfg;
                 if (cfg.name != "")
@@ -929,6 +943,14 @@ json11::Json::object etcd_state_client_t::serialize_inode_cfg(inode_config_t *cf
     {
         new_cfg["readonly"] = true;
     }
+    if (cfg->qos_iops)
+    {
+        new_cfg["qos_iops"] = cfg->qos_iops;
+    }
+    if (cfg->qos_mbs)
+    {
+        new_cfg["qos_mbs"] = cfg->qos_mbs;
+    }
     return new_cfg;
 }
 
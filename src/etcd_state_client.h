@@ -36,6 +36,10 @@ struct pg_config_t
     bool pause;
     osd_num_t cur_primary;
     int cur_state;
+    // current (role => osd_num) set as reported by the primary
+    std::vector<osd_num_t> cur_set;
+    // etcd revision of the current PG state, changes every time the primary reports it
+    uint64_t state_revision;
     uint64_t epoch;
 };
 
@@ -51,6 +55,8 @@ struct pool_config_t
     std::string failure_domain;
     uint64_t max_osd_combinations;
     uint64_t pg_stripe_size;
+    // Total QoS limits for all inodes of the pool on each primary OSD, 0 = unlimited
+    uint64_t qos_iops, qos_mbs;
     std::map<pg_num_t, pg_config_t> pg_config;
 };
 
@@ -63,6 +69,8 @@ struct inode_config_t
     bool readonly;
     // Change revision of the metadata in etcd
     uint64_t mod_revision;
+    // QoS limits enforced by primary OSDs, 0 = unlimited
+    uint64_t qos_iops, qos_mbs;
 };
 
 struct inode_watch_t
@@ -163,6 +163,7 @@ static enum fio_q_status bs_queue(struct thread_data *td, struct io_u *io)
 
     blockstore_op_t *op = new blockstore_op_t;
     op->callback = NULL;
+    op->priority = BS_PRIO_CLIENT;
 
     switch (io->ddir)
     {
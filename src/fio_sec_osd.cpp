@@ -218,7 +218,7 @@ static enum fio_q_status sec_queue(struct thread_data *td, struct io_u *io)
     }
 
     io->engine_data = bsd;
-    op_buf_t *op_buf = new op_buf_t;
+    op_buf_t *op_buf = new op_buf_t();
     op_buf->fio_op = io;
     osd_any_op_t &op = op_buf->buf;
 
@@ -40,6 +40,10 @@ void osd_messenger_t::init()
         }
     }
 #endif
+    if (use_multishot_recv)
+    {
+        init_multishot();
+    }
     keepalive_timer_id = tfd->set_timer(1000, true, [this](int)
     {
         std::vector<int> to_stop;
@@ -47,7 +51,7 @@ void osd_messenger_t::init()
         for (auto cl_it = clients.begin(); cl_it != clients.end(); cl_it++)
         {
             auto cl = cl_it->second;
-            if (!cl->osd_num || cl->peer_state != PEER_CONNECTED && cl->peer_state != PEER_RDMA)
+            if (!cl->osd_num || cl->peer_state != PEER_CONNECTED && cl->peer_state != PEER_RDMA && cl->peer_state != PEER_SHM)
             {
                 // Do not run keepalive on regular clients
                 continue;
@@ -122,6 +126,19 @@ osd_messenger_t::~osd_messenger_t()
     {
         stop_client(clients.begin()->first, true, true);
     }
+    destroy_multishot();
+    if (shm_listen_fd >= 0)
+    {
+        tfd->set_fd_handler(shm_listen_fd, false, NULL);
+        close(shm_listen_fd);
+        shm_listen_fd = -1;
+    }
+    for (auto & hs: shm_handshakes)
+    {
+        tfd->set_fd_handler(hs.first, false, NULL);
+        close(hs.first);
+    }
+    shm_handshakes.clear();
 #ifdef WITH_RDMA
     if (rdma_context)
     {
@@ -162,12 +179,41 @@ void osd_messenger_t::parse_config(const json11::Json & config)
         this->receive_buffer_size = 65536;
     this->use_sync_send_recv = config["use_sync_send_recv"].bool_value() ||
         config["use_sync_send_recv"].uint64_value();
+    this->use_direct_recv = config["use_direct_recv"].bool_value() ||
+        config["use_direct_recv"].uint64_value();
+    this->tcp_zerocopy_threshold = config["tcp_zerocopy_threshold"].uint64_value();
+    this->use_multishot_recv = config["use_multishot_recv"].bool_value() ||
+        config["use_multishot_recv"].uint64_value();
+    this->multishot_recv_buffers = config["multishot_recv_buffers"].uint64_value();
+    if (!this->multishot_recv_buffers || this->multishot_recv_buffers > 32768)
+        this->multishot_recv_buffers = 16;
+    this->use_shm = config["use_shm"].bool_value() || config["use_shm"].uint64_value();
+    this->shm_ring_size = config["shm_ring_size"].uint64_value();
+    if (!this->shm_ring_size || this->shm_ring_size > 1024*1024*1024)
+        this->shm_ring_size = 1024*1024;
+    else if (this->shm_ring_size < 65536)
+        this->shm_ring_size = 65536;
+    // Ring positions are masked, so round the size up to a power of two
+    while (this->shm_ring_size & (this->shm_ring_size-1))
+        this->shm_ring_size = (this->shm_ring_size | (this->shm_ring_size-1)) + 1;
+    uint64_t peer_connections = config["osd_peer_connections"].uint64_value();
+    this->osd_peer_connections = peer_connections < 1 || peer_connections > 64 ? 1 : peer_connections;
     this->peer_connect_interval = config["peer_connect_interval"].uint64_value();
     if (!this->peer_connect_interval)
         this->peer_connect_interval = 5;
     this->peer_connect_timeout = config["peer_connect_timeout"].uint64_value();
     if (!this->peer_connect_timeout)
         this->peer_connect_timeout = 5;
+    if (!config["client_queue_depth"].is_null())
+    {
+        // Allow to set it to 0 (unlimited)
+        this->client_queue_depth = config["client_queue_depth"].uint64_value();
+    }
+    if (!config["primary_queue_depth"].is_null())
+    {
+        // Allow to set it to 0 (unlimited)
+        this->primary_queue_depth = config["primary_queue_depth"].uint64_value();
+    }
     this->osd_idle_timeout = config["osd_idle_timeout"].uint64_value();
     if (!this->osd_idle_timeout)
         this->osd_idle_timeout = 5;
@@ -228,19 +274,27 @@ void osd_messenger_t::try_connect_peer_addr(osd_num_t peer_osd, const char *peer
         on_connect_peer(peer_osd, -EINVAL);
         return;
     }
+    int r = connect_peer_sockaddr(peer_osd, addr, peer_port, false);
+    if (r < 0)
+    {
+        on_connect_peer(peer_osd, r);
+    }
+}
+
+int osd_messenger_t::connect_peer_sockaddr(osd_num_t peer_osd, const sockaddr & addr, int peer_port, bool extra)
+{
     int peer_fd = socket(addr.sa_family, SOCK_STREAM, 0);
     if (peer_fd < 0)
     {
-        on_connect_peer(peer_osd, -errno);
-        return;
+        return -errno;
     }
     fcntl(peer_fd, F_SETFL, fcntl(peer_fd, F_GETFL, 0) | O_NONBLOCK);
     int r = connect(peer_fd, (sockaddr*)&addr, sizeof(addr));
     if (r < 0 && errno != EINPROGRESS)
     {
+        r = -errno;
         close(peer_fd);
-        on_connect_peer(peer_osd, -errno);
-        return;
+        return r;
     }
     clients[peer_fd] = new osd_client_t();
     clients[peer_fd]->peer_addr = addr;
@@ -249,7 +303,9 @@ void osd_messenger_t::try_connect_peer_addr(osd_num_t peer_osd, const char *peer
     clients[peer_fd]->peer_state = PEER_CONNECTING;
     clients[peer_fd]->connect_timeout_id = -1;
     clients[peer_fd]->osd_num = peer_osd;
-    clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
+    clients[peer_fd]->peer_extra = extra;
+    if (!use_direct_recv && !multishot_recv)
+        clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
     tfd->set_fd_handler(peer_fd, true, [this](int peer_fd, int epoll_events)
     {
         // Either OUT (connected) or HUP
@@ -259,12 +315,18 @@ void osd_messenger_t::try_connect_peer_addr(osd_num_t peer_osd, const char *peer
     {
         clients[peer_fd]->connect_timeout_id = tfd->set_timer(1000*peer_connect_timeout, false, [this, peer_fd](int timer_id)
         {
-            osd_num_t peer_osd = clients.at(peer_fd)->osd_num;
+            osd_client_t *cl = clients.at(peer_fd);
+            osd_num_t peer_osd = cl->osd_num;
+            bool extra = cl->peer_extra;
             stop_client(peer_fd, true);
-            on_connect_peer(peer_osd, -EPIPE);
+            if (extra)
+                on_connect_peer_extra(peer_osd, -EPIPE);
+            else
+                on_connect_peer(peer_osd, -EPIPE);
             return;
         });
     }
+    return peer_fd;
 }
 
 void osd_messenger_t::handle_connect_epoll(int peer_fd)
@@ -276,6 +338,7 @@ void osd_messenger_t::handle_connect_epoll(int peer_fd)
         cl->connect_timeout_id = -1;
     }
     osd_num_t peer_osd = cl->osd_num;
+    bool extra = cl->peer_extra;
     int result = 0;
     socklen_t result_len = sizeof(result);
     if (getsockopt(peer_fd, SOL_SOCKET, SO_ERROR, &result, &result_len) < 0)
@@ -285,22 +348,39 @@ void osd_messenger_t::handle_connect_epoll(int peer_fd)
     if (result != 0)
     {
         stop_client(peer_fd, true);
-        on_connect_peer(peer_osd, -result);
+        if (extra)
+            on_connect_peer_extra(peer_osd, -result);
+        else
+            on_connect_peer(peer_osd, -result);
         return;
     }
     int one = 1;
     setsockopt(peer_fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
     cl->peer_state = PEER_CONNECTED;
-    tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
+    init_zerocopy(cl);
+    if (start_multishot_recv(cl) && !cl->zerocopy)
     {
-        handle_peer_epoll(peer_fd, epoll_events);
-    });
+        // epoll is only required for zero-copy send completions
+        tfd->set_fd_handler(peer_fd, false, NULL);
+    }
+    else
+    {
+        tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
+        {
+            handle_peer_epoll(peer_fd, epoll_events);
+        });
+    }
     // Check OSD number
     check_peer_config(cl);
 }
 
 void osd_messenger_t::handle_peer_epoll(int peer_fd, int epoll_events)
 {
+    if ((epoll_events & EPOLLERR) && clients[peer_fd]->zerocopy)
+    {
+        // Zero-copy send completions are reported through the socket error queue
+        handle_zerocopy_completions(clients[peer_fd]);
+    }
     // Mark client as ready (i.e. some data is available)
     if (epoll_events & EPOLLRDHUP)
     {
@@ -308,7 +388,7 @@ void osd_messenger_t::handle_peer_epoll(int peer_fd, int epoll_events)
         fprintf(stderr, "[OSD %lu] client %d disconnected\n", this->osd_num, peer_fd);
         stop_client(peer_fd, true);
     }
-    else if (epoll_events & EPOLLIN)
+    else if ((epoll_events & EPOLLIN) && !clients[peer_fd]->recv_multishot)
     {
         // Mark client as ready (i.e. some data is available)
         auto cl = clients[peer_fd];
@@ -360,9 +440,50 @@ void osd_messenger_t::on_connect_peer(osd_num_t peer_osd, int peer_fd)
         fprintf(stderr, "[OSD %lu] Connected with peer OSD %lu (client %d)\n", osd_num, peer_osd, peer_fd);
     }
     wanted_peers.erase(peer_osd);
+    auto cl = clients.at(peer_fd);
+    if (osd_peer_connections > 1 && cl->peer_state == PEER_CONNECTED)
+    {
+        // Open additional TCP connections to spread I/O between them.
+        // RDMA and shared memory connections don't need it
+        for (int i = osd_peer_extra_fds[peer_osd].size()+1; i < osd_peer_connections; i++)
+        {
+            connect_peer_extra(cl);
+        }
+    }
     repeer_pgs(peer_osd);
 }
 
+void osd_messenger_t::connect_peer_extra(osd_client_t *cl)
+{
+    int r = connect_peer_sockaddr(cl->osd_num, cl->peer_addr, cl->peer_port, true);
+    if (r < 0)
+    {
+        on_connect_peer_extra(cl->osd_num, r);
+    }
+}
+
+void osd_messenger_t::on_connect_peer_extra(osd_num_t peer_osd, int peer_fd)
+{
+    if (peer_fd < 0)
+    {
+        // Additional connections aren't retried until the main connection is reestablished
+        fprintf(stderr, "Failed to open an additional connection to peer OSD %lu: %s\n", peer_osd, strerror(-peer_fd));
+        return;
+    }
+    auto & extra_fds = osd_peer_extra_fds[peer_osd];
+    if (osd_peer_fds.find(peer_osd) == osd_peer_fds.end() || extra_fds.size()+1 >= (size_t)osd_peer_connections)
+    {
+        // The main connection is already closed, or reopened and has its own additional connections
+        stop_client(peer_fd);
+        return;
+    }
+    extra_fds.push_back(peer_fd);
+    if (log_level > 0)
+    {
+        fprintf(stderr, "[OSD %lu] Opened additional connection with peer OSD %lu (client %d)\n", osd_num, peer_osd, peer_fd);
+    }
+}
+
 void osd_messenger_t::check_peer_config(osd_client_t *cl)
 {
     osd_op_t *op = new osd_op_t();
@@ -377,24 +498,31 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
             },
         },
     };
+    json11::Json::object payload;
 #ifdef WITH_RDMA
-    if (rdma_context)
+    if (rdma_context && !cl->peer_extra)
     {
         cl->rdma_conn = msgr_rdma_connection_t::create(rdma_context, rdma_max_send, rdma_max_recv, rdma_max_sge, rdma_max_msg);
         if (cl->rdma_conn)
         {
-            json11::Json payload = json11::Json::object {
-                { "connect_rdma", cl->rdma_conn->addr.to_string() },
-                { "rdma_max_msg", cl->rdma_conn->max_msg },
-            };
-            std::string payload_str = payload.dump();
-            op->req.show_conf.json_len = payload_str.size();
-            op->buf = malloc_or_die(payload_str.size());
-            op->iov.push_back(op->buf, payload_str.size());
-            memcpy(op->buf, payload_str.c_str(), payload_str.size());
+            payload["connect_rdma"] = cl->rdma_conn->addr.to_string();
+            payload["rdma_max_msg"] = cl->rdma_conn->max_msg;
         }
     }
 #endif
+    if (use_shm && !cl->peer_extra && is_local_peer(cl->peer_fd))
+    {
+        // The OSD is on the same host, ask it for a shared memory connection
+        payload["connect_shm"] = true;
+    }
+    if (payload.size())
+    {
+        std::string payload_str = json11::Json(payload).dump();
+        op->req.show_conf.json_len = payload_str.size();
+        op->buf = malloc_or_die(payload_str.size());
+        op->iov.push_back(op->buf, payload_str.size());
+        memcpy(op->buf, payload_str.c_str(), payload_str.size());
+    }
     op->callback = [this, cl](osd_op_t *op)
     {
         std::string json_err;
@@ -431,8 +559,18 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
         if (err)
         {
             osd_num_t peer_osd = cl->osd_num;
+            bool extra = cl->peer_extra;
             stop_client(op->peer_fd);
-            on_connect_peer(peer_osd, -1);
+            if (extra)
+                on_connect_peer_extra(peer_osd, -EINVAL);
+            else
+                on_connect_peer(peer_osd, -1);
+            delete op;
+            return;
+        }
+        if (cl->peer_extra)
+        {
+            on_connect_peer_extra(cl->osd_num, cl->peer_fd);
             delete op;
             return;
         }
@@ -474,6 +612,13 @@ void osd_messenger_t::check_peer_config(osd_client_t *cl)
             }
         }
 #endif
+        if (cl->peer_state == PEER_CONNECTED && config["shm_socket"].is_string())
+        {
+            // on_connect_peer() is called after receiving shared memory from the OSD
+            connect_shm(cl, config["shm_socket"].string_value(), config["shm_token"].string_value());
+            delete op;
+            return;
+        }
         osd_peer_fds[cl->osd_num] = cl->peer_fd;
         on_connect_peer(cl->osd_num, cl->peer_fd);
         delete op;
@@ -489,23 +634,7 @@ void osd_messenger_t::accept_connections(int listen_fd)
     int peer_fd;
     while ((peer_fd = accept(listen_fd, &addr, &peer_addr_size)) >= 0)
     {
-        assert(peer_fd != 0);
-        fprintf(stderr, "[OSD %lu] new client %d: connection from %s\n", this->osd_num, peer_fd,
-            addr_to_string(addr).c_str());
-        fcntl(peer_fd, F_SETFL, fcntl(peer_fd, F_GETFL, 0) | O_NONBLOCK);
-        int one = 1;
-        setsockopt(peer_fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
-        clients[peer_fd] = new osd_client_t();
-        clients[peer_fd]->peer_addr = addr;
-        clients[peer_fd]->peer_port = ntohs(((sockaddr_in*)&addr)->sin_port);
-        clients[peer_fd]->peer_fd = peer_fd;
-        clients[peer_fd]->peer_state = PEER_CONNECTED;
-        clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
-        // Add FD to epoll
-        tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
-        {
-            handle_peer_epoll(peer_fd, epoll_events);
-        });
+        init_accepted_client(peer_fd, addr);
         // Try to accept next connection
         peer_addr_size = sizeof(addr);
     }
@@ -515,6 +644,32 @@ void osd_messenger_t::accept_connections(int listen_fd)
     }
 }
 
+void osd_messenger_t::init_accepted_client(int peer_fd, const sockaddr & addr)
+{
+    assert(peer_fd != 0);
+    fprintf(stderr, "[OSD %lu] new client %d: connection from %s\n", this->osd_num, peer_fd,
+        addr_to_string(addr).c_str());
+    fcntl(peer_fd, F_SETFL, fcntl(peer_fd, F_GETFL, 0) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(peer_fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+    clients[peer_fd] = new osd_client_t();
+    clients[peer_fd]->peer_addr = addr;
+    clients[peer_fd]->peer_port = ntohs(((sockaddr_in*)&addr)->sin_port);
+    clients[peer_fd]->peer_fd = peer_fd;
+    clients[peer_fd]->peer_state = PEER_CONNECTED;
+    if (!use_direct_recv && !multishot_recv)
+        clients[peer_fd]->in_buf = malloc_or_die(receive_buffer_size);
+    init_zerocopy(clients[peer_fd]);
+    if (!start_multishot_recv(clients[peer_fd]) || clients[peer_fd]->zerocopy)
+    {
+        // Add FD to epoll
+        tfd->set_fd_handler(peer_fd, false, [this](int peer_fd, int epoll_events)
+        {
+            handle_peer_epoll(peer_fd, epoll_events);
+        });
+    }
+}
+
 #ifdef WITH_RDMA
 bool osd_messenger_t::is_rdma_enabled()
 {
@@ -17,6 +17,7 @@
 #include "msgr_op.h"
 #include "timerfd_manager.h"
 #include <ringloop.h>
+#include "msgr_shm.h"
 
 #ifdef WITH_RDMA
 #include "msgr_rdma.h"
@@ -32,6 +33,8 @@
 #define PEER_RDMA_CONNECTING 3
 #define PEER_RDMA 4
 #define PEER_STOPPED 5
+#define PEER_SHM_CONNECTING 6
+#define PEER_SHM 7
 
 #define DEFAULT_BITMAP_GRANULARITY 4096
 #define VITASTOR_CONFIG_PATH "/etc/vitastor/vitastor.conf"
@@ -39,6 +42,18 @@
 #define MSGR_SENDP_HDR 1
 #define MSGR_SENDP_FREE 2
 
+// When both client and background operations are waiting to be sent, client operations
+// get up to MSGR_BG_RATIO times more bytes in each batch than background ones
+#define MSGR_BG_RATIO 3
+
+// Client operations are started in deficit round-robin order when the OSD runs
+// more than primary_queue_depth of them. Each client gets MSGR_DRR_QUANTUM bytes
+// per round, and each operation costs at least MSGR_DRR_MIN_COST bytes
+#define MSGR_DRR_QUANTUM 131072
+#define MSGR_DRR_MIN_COST 4096
+#define DEFAULT_CLIENT_QUEUE_DEPTH 128
+#define DEFAULT_PRIMARY_QUEUE_DEPTH 512
+
 struct msgr_sendp_t
 {
     osd_op_t *op;
@@ -57,12 +72,17 @@ struct osd_client_t
     int ping_time_remaining = 0;
     int idle_time_remaining = 0;
     osd_num_t osd_num = 0;
+    // Additional connection to the OSD peer, see osd_peer_connections
+    bool peer_extra = false;
+    // Request and reply bytes of outbound operations waiting for replies
+    uint64_t outstanding_bytes = 0;
 
     void *in_buf = NULL;
 
 #ifdef WITH_RDMA
     msgr_rdma_connection_t *rdma_conn = NULL;
 #endif
+    msgr_shm_connection_t *shm_conn = NULL;
 
     // Read state
     int read_ready = 0;
@@ -76,6 +96,20 @@ struct osd_client_t
     // Incoming operations
     std::vector<osd_op_t*> received_ops;
 
+    // Client operations waiting for execution, running client operations and DRR deficit
+    std::deque<osd_op_t*> exec_queue;
+    int exec_ops = 0;
+    int64_t exec_deficit = 0;
+    // The client is out of the round until this timer because of QoS limits
+    int exec_qos_timer_id = -1;
+    // Reading is paused because the client has too many operations in flight
+    bool read_blocked = false;
+
+    // Multishot recv state: data is received into the messenger's provided buffers
+    // by one long-running recv operation using recv_data instead of epoll and recvmsg
+    bool recv_multishot = false, recv_armed = false, recv_cancelling = false;
+    ring_data_t recv_data = {};
+
     // Outbound operations
     std::map<uint64_t, osd_op_t*> sent_ops;
 
@@ -87,11 +121,31 @@ struct osd_client_t
     int write_state = 0;
     std::vector<iovec> send_list, next_send_list;
     std::vector<msgr_sendp_t> outbox, next_outbox;
+    // Background operations waiting for the current send to complete
+    std::vector<iovec> bg_send_list;
+    std::vector<msgr_sendp_t> bg_outbox;
+
+    // MSG_ZEROCOPY state: every zero-copy sendmsg gets the next sequential ID from the kernel,
+    // and sent replies are held until the kernel reports that all previous sends are released
+    bool zerocopy = false, write_zerocopy = false;
+    uint32_t zc_next_id = 0, zc_done_upto = 0;
+    std::set<uint32_t> zc_done;
+    std::deque<std::pair<uint32_t, osd_op_t*>> zc_held;
 
     ~osd_client_t()
     {
         free(in_buf);
         in_buf = NULL;
+        if (shm_conn)
+        {
+            delete shm_conn;
+            shm_conn = NULL;
+        }
+        for (auto & held: zc_held)
+        {
+            delete held.second;
+        }
+        zc_held.clear();
     }
 };
 
@@ -113,6 +167,8 @@ struct osd_op_stats_t
     uint64_t op_stat_bytes[OSD_OP_MAX+1] = { 0 };
     uint64_t subop_stat_sum[OSD_OP_MAX+1] = { 0 };
     uint64_t subop_stat_count[OSD_OP_MAX+1] = { 0 };
+    // bytes sent with MSG_ZEROCOPY and zero-copy sends where the kernel had to copy data anyway
+    uint64_t zerocopy_send_bytes = 0, zerocopy_copied_sends = 0;
 };
 
 struct osd_messenger_t
@@ -127,6 +183,20 @@ protected:
     int osd_ping_timeout = 0;
     int log_level = 0;
     bool use_sync_send_recv = false;
+    // Receive headers and data directly into operations instead of copying them from in_buf
+    bool use_direct_recv = false;
+    // Send batches of at least this size with MSG_ZEROCOPY, 0 = disabled
+    uint64_t tcp_zerocopy_threshold = 0;
+    // Receive data and accept connections with io_uring multishot operations instead of epoll
+    bool use_multishot_recv = false;
+    uint32_t multishot_recv_buffers = 0;
+    // Connect to OSDs on the same host through shared memory
+    bool use_shm = false;
+    uint64_t shm_ring_size = 0;
+    // Number of TCP connections to each OSD peer, data operations are spread between them
+    int osd_peer_connections = 1;
+    int client_queue_depth = DEFAULT_CLIENT_QUEUE_DEPTH;
+    int primary_queue_depth = DEFAULT_PRIMARY_QUEUE_DEPTH;
 
 #ifdef WITH_RDMA
     bool use_rdma = true;
@@ -140,6 +210,27 @@ protected:
     std::vector<int> read_ready_clients;
     std::vector<int> write_ready_clients;
     std::vector<std::function<void()>> set_immediate;
+    // Clients with queued operations, in round-robin order
+    std::deque<int> exec_ready_clients;
+    int exec_inflight = 0;
+
+    // Provided buffer ring for multishot recv, multishot_recv is false when it isn't available
+    bool multishot_recv = false;
+    int recv_buf_group = -1;
+    void *recv_buf_ring = NULL;
+    uint8_t *recv_bufs = NULL;
+    uint32_t recv_buf_count = 0, recv_buf_size = 0;
+    uint16_t recv_buf_tail = 0;
+    // Multishot recvs which haven't returned their final CQE yet
+    int recv_armed_count = 0;
+    ring_data_t *accept_data = NULL;
+
+    // Local Unix socket for shared memory handshakes and connections waiting for them (token -> peer_fd)
+    int shm_listen_fd = -1;
+    std::string shm_socket_name;
+    std::map<std::string, int> shm_pending;
+    // Accepted handshake connections and the part of the token received from them
+    std::map<int, std::string> shm_handshakes;
 
 public:
     timerfd_manager_t *tfd;
@@ -150,6 +241,8 @@ public:
     std::map<int, osd_client_t*> clients;
     std::map<osd_num_t, osd_wanted_peer_t> wanted_peers;
     std::map<uint64_t, int> osd_peer_fds;
+    // Additional connections to OSD peers, they're only used through select_peer_fd()
+    std::map<uint64_t, std::vector<int>> osd_peer_extra_fds;
     // op statistics
     osd_op_stats_t stats;
 
@@ -158,11 +251,18 @@ public:
     void connect_peer(uint64_t osd_num, json11::Json peer_state);
     void stop_client(int peer_fd, bool force = false, bool force_delete = false);
     void outbox_push(osd_op_t *cur_op);
+    int select_peer_fd(osd_num_t peer_osd, const object_id & oid);
     std::function<void(osd_op_t*)> exec_op;
+    // Returns microseconds to wait before a client operation may start because of QoS limits, or 0
+    std::function<uint64_t(osd_op_t*)> qos_delay;
     std::function<void(osd_num_t)> repeer_pgs;
     void read_requests();
     void send_replies();
     void accept_connections(int listen_fd);
+    bool accept_multishot(int listen_fd);
+    bool listen_shm();
+    bool accept_shm(int peer_fd);
+    std::string get_shm_socket();
     ~osd_messenger_t();
 
     static json11::Json read_config(const json11::Json & config);
@@ -175,21 +275,54 @@ public:
 protected:
     void try_connect_peer(uint64_t osd_num);
     void try_connect_peer_addr(osd_num_t peer_osd, const char *peer_host, int peer_port);
+    int connect_peer_sockaddr(osd_num_t peer_osd, const sockaddr & addr, int peer_port, bool extra);
+    void connect_peer_extra(osd_client_t *cl);
+    void on_connect_peer_extra(osd_num_t peer_osd, int peer_fd);
     void handle_peer_epoll(int peer_fd, int epoll_events);
     void handle_connect_epoll(int peer_fd);
+    void init_accepted_client(int peer_fd, const sockaddr & addr);
     void on_connect_peer(osd_num_t peer_osd, int peer_fd);
     void check_peer_config(osd_client_t *cl);
     void cancel_osd_ops(osd_client_t *cl);
     void cancel_op(osd_op_t *op);
 
     bool try_send(osd_client_t *cl);
+    static uint64_t get_op_transfer_size(osd_op_t *cur_op);
     void measure_exec(osd_op_t *cur_op);
     void handle_send(int result, osd_client_t *cl);
+    void move_background_ops(osd_client_t *cl);
+    void init_zerocopy(osd_client_t *cl);
+    void handle_zerocopy_completions(osd_client_t *cl);
+    void free_sent_op(osd_client_t *cl, osd_op_t *op);
+
+    void init_multishot();
+    void destroy_multishot();
+    bool start_multishot_recv(osd_client_t *cl);
+    bool arm_multishot_recv(osd_client_t *cl);
+    void handle_multishot_read(osd_client_t *cl, int result, unsigned flags);
+    void handle_multishot_accept(int listen_fd, int result, unsigned flags);
+    void return_recv_buf(unsigned bid);
+
+    static bool is_local_peer(int peer_fd);
+    void connect_shm(osd_client_t *cl, const std::string & socket_name, const std::string & token);
+    void handle_shm_reply(int peer_fd);
+    void accept_shm_handshakes();
+    void handle_shm_handshake(int fd);
+    void start_shm(osd_client_t *cl);
+    void stop_shm(osd_client_t *cl);
+    void handle_shm_notify(osd_client_t *cl);
+    bool try_send_shm(osd_client_t *cl);
+    void try_recv_shm(osd_client_t *cl);
 
     bool handle_read(int result, osd_client_t *cl);
     bool handle_read_buffer(osd_client_t *cl, void *curbuf, int remain);
+    void begin_read_hdr(osd_client_t *cl);
     bool handle_finished_read(osd_client_t *cl);
     void handle_op_hdr(osd_client_t *cl);
+    static bool is_client_op(osd_op_t *cur_op);
+    void enqueue_client_op(osd_client_t *cl, osd_op_t *cur_op);
+    void exec_client_ops();
+    void finish_client_op(osd_client_t *cl);
     bool handle_reply_hdr(osd_client_t *cl);
     void handle_reply_ready(osd_op_t *op);
 
@@ -4,6 +4,15 @@
 #pragma once
 
 #include <functional>
+#include <sys/uio.h>
+
+struct ring_data_t
+{
+    struct iovec iov;
+    int res;
+    unsigned cqe_flags;
+    std::function<void(ring_data_t*)> callback;
+};
 
 struct ring_consumer_t
 {
@@ -22,4 +31,7 @@ public:
     void submit()
     {
     }
+    void wakeup()
+    {
+    }
 };
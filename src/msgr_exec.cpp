@@ -0,0 +1,101 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#include <assert.h>
+
+#include "messenger.h"
+
+bool osd_messenger_t::is_client_op(osd_op_t *cur_op)
+{
+    uint64_t opcode = cur_op->req.hdr.opcode;
+    return opcode == OSD_OP_READ || opcode == OSD_OP_WRITE || opcode == OSD_OP_SYNC ||
+        opcode == OSD_OP_DELETE || opcode == OSD_OP_DELETE_INODE;
+}
+
+// Secondary operations are always executed immediately: primary operations wait for them,
+// so delaying them behind primary operations could deadlock the cluster
+void osd_messenger_t::enqueue_client_op(osd_client_t *cl, osd_op_t *cur_op)
+{
+    cl->received_ops.push_back(cur_op);
+    if (!is_client_op(cur_op))
+    {
+        set_immediate.push_back([this, cur_op]() { exec_op(cur_op); });
+        return;
+    }
+    cl->exec_queue.push_back(cur_op);
+    if (cl->exec_queue.size() == 1 && cl->exec_qos_timer_id < 0)
+    {
+        exec_ready_clients.push_back(cl->peer_fd);
+        if (exec_ready_clients.size() == 1)
+        {
+            set_immediate.push_back([this]() { exec_client_ops(); });
+        }
+    }
+}
+
+// QoS limits are checked before taking an execution slot: a throttled client leaves
+// the round until its next operation is allowed, so it doesn't hold slots of
+// primary_queue_depth and doesn't delay other clients
+void osd_messenger_t::exec_client_ops()
+{
+    while (exec_ready_clients.size() && (!primary_queue_depth || exec_inflight < primary_queue_depth))
+    {
+        auto cl_it = clients.find(exec_ready_clients.front());
+        assert(cl_it != clients.end());
+        osd_client_t *cl = cl_it->second;
+        osd_op_t *cur_op = cl->exec_queue.front();
+        int64_t cost = cur_op->req.hdr.opcode == OSD_OP_READ || cur_op->req.hdr.opcode == OSD_OP_WRITE
+            ? cur_op->req.rw.len : 0;
+        if (cost < MSGR_DRR_MIN_COST)
+            cost = MSGR_DRR_MIN_COST;
+        if (cl->exec_deficit < cost)
+        {
+            // Give the client its quantum and move it to the end of the round
+            cl->exec_deficit += MSGR_DRR_QUANTUM;
+            exec_ready_clients.pop_front();
+            exec_ready_clients.push_back(cl->peer_fd);
+            continue;
+        }
+        uint64_t qos_wait_us = qos_delay ? qos_delay(cur_op) : 0;
+        if (qos_wait_us)
+        {
+            // Return the client to the round when the limit allows the operation
+            exec_ready_clients.pop_front();
+            cl->exec_qos_timer_id = tfd->set_timer_us(qos_wait_us, false, [this, cl](int timer_id)
+            {
+                cl->exec_qos_timer_id = -1;
+                exec_ready_clients.push_back(cl->peer_fd);
+                exec_client_ops();
+            });
+            continue;
+        }
+        cl->exec_deficit -= cost;
+        cl->exec_queue.pop_front();
+        if (!cl->exec_queue.size())
+        {
+            cl->exec_deficit = 0;
+            exec_ready_clients.pop_front();
+        }
+        cl->exec_ops++;
+        exec_inflight++;
+        exec_op(cur_op);
+    }
+}
+
+void osd_messenger_t::finish_client_op(osd_client_t *cl)
+{
+    cl->exec_ops--;
+    exec_inflight--;
+    if (cl->read_blocked && cl->exec_queue.size() + cl->exec_ops < client_queue_depth)
+    {
+        cl->read_blocked = false;
+        if (cl->read_ready > 0)
+        {
+            read_ready_clients.push_back(cl->peer_fd);
+        }
+    }
+    if ((exec_ready_clients.size() || read_ready_clients.size()) && ringloop)
+    {
+        ringloop->wakeup();
+    }
+}
@@ -0,0 +1,280 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Multishot receive: every connection has one io_uring multishot recv which picks buffers
+// from a ring of provided buffers shared by all connections and runs until it's cancelled,
+// so sockets don't need epoll events and a recvmsg submission for every read. The listening
+// socket uses multishot accept in the same way. Requires Linux 6.0, older kernels fall back
+// to the regular epoll + recvmsg receive.
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <stdexcept>
+
+#include "messenger.h"
+
+void osd_messenger_t::init_multishot()
+{
+#ifdef IORING_RECV_MULTISHOT
+    if (!ringloop || use_sync_send_recv || multishot_recv)
+    {
+        return;
+    }
+    recv_buf_count = 1;
+    while (recv_buf_count < multishot_recv_buffers)
+    {
+        recv_buf_count *= 2;
+    }
+    recv_buf_size = receive_buffer_size;
+    recv_buf_ring = memalign_or_die(4096, sizeof(io_uring_buf) * recv_buf_count);
+    memset(recv_buf_ring, 0, sizeof(io_uring_buf) * recv_buf_count);
+    recv_buf_group = ringloop->register_buf_ring(recv_buf_ring, recv_buf_count);
+    if (recv_buf_group < 0)
+    {
+        fprintf(stderr, "[OSD %lu] Couldn't register io_uring buffer ring: %s, proceeding with regular receive\n",
+            osd_num, strerror(-recv_buf_group));
+        free(recv_buf_ring);
+        recv_buf_ring = NULL;
+        return;
+    }
+    recv_bufs = (uint8_t*)malloc_or_die((size_t)recv_buf_size * recv_buf_count);
+    recv_buf_tail = 0;
+    for (unsigned bid = 0; bid < recv_buf_count; bid++)
+    {
+        return_recv_buf(bid);
+    }
+    multishot_recv = true;
+#else
+    fprintf(stderr, "[OSD %lu] Multishot receive is not supported by io_uring headers, proceeding with regular receive\n", osd_num);
+#endif
+}
+
+void osd_messenger_t::destroy_multishot()
+{
+    if (accept_data)
+    {
+        // The listening socket is closed by its owner, just cancel the accept
+        accept_data->callback = [](ring_data_t *data) {};
+        io_uring_sqe *sqe = ringloop->get_sqe();
+        if (sqe)
+        {
+            ring_data_t *data = ((ring_data_t*)sqe->user_data);
+            data->callback = [](ring_data_t *data) {};
+            my_uring_prep_cancel(sqe, accept_data, 0);
+            ringloop->submit();
+        }
+        accept_data = NULL;
+    }
+    // Stopped clients cancel their receives, but the kernel may still write into buffers and
+    // post CQEs referencing clients' recv_data until the final CQE, so wait for all of them
+    while (recv_armed_count > 0)
+    {
+        ringloop->submit();
+        ringloop->wait();
+        ringloop->loop();
+    }
+    if (recv_buf_group >= 0)
+    {
+        ringloop->unregister_buf_ring(recv_buf_group);
+        recv_buf_group = -1;
+    }
+    free(recv_buf_ring);
+    recv_buf_ring = NULL;
+    free(recv_bufs);
+    recv_bufs = NULL;
+    multishot_recv = false;
+}
+
+void osd_messenger_t::return_recv_buf(unsigned bid)
+{
+#ifdef IORING_RECV_MULTISHOT
+    io_uring_buf_ring *br = (io_uring_buf_ring*)recv_buf_ring;
+    // Not br->bufs[]: __DECLARE_FLEX_ARRAY() in kernel headers shifts it by 8 bytes in C++
+    io_uring_buf *buf = (io_uring_buf*)recv_buf_ring + (recv_buf_tail & (recv_buf_count-1));
+    buf->addr = (uint64_t)(recv_bufs + (size_t)bid*recv_buf_size);
+    buf->len = recv_buf_size;
+    buf->bid = bid;
+    recv_buf_tail++;
+    // The kernel picks buffers up to the tail, so publish it after filling the buffer entry
+    __atomic_store_n(&br->tail, recv_buf_tail, __ATOMIC_RELEASE);
+#endif
+}
+
+// Switch a newly connected client to multishot receive, returns false if it's not enabled
+bool osd_messenger_t::start_multishot_recv(osd_client_t *cl)
+{
+    if (!multishot_recv)
+    {
+        return false;
+    }
+    cl->recv_multishot = true;
+    // The client always stays read-ready, read_requests() only (re)arms the recv
+    cl->read_ready = 1;
+    read_ready_clients.push_back(cl->peer_fd);
+    ringloop->wakeup();
+    return true;
+}
+
+bool osd_messenger_t::arm_multishot_recv(osd_client_t *cl)
+{
+#ifdef IORING_RECV_MULTISHOT
+    io_uring_sqe *sqe = ringloop->get_sqe_for(&cl->recv_data);
+    if (!sqe)
+    {
+        return false;
+    }
+    cl->recv_data.callback = [this, cl](ring_data_t *data) { handle_multishot_read(cl, data->res, data->cqe_flags); };
+    my_uring_prep_recv(sqe, cl->peer_fd, NULL, 0, 0);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = recv_buf_group;
+    cl->recv_armed = true;
+    cl->recv_cancelling = false;
+    cl->refs++;
+    recv_armed_count++;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void osd_messenger_t::handle_multishot_read(osd_client_t *cl, int result, unsigned flags)
+{
+#ifdef IORING_RECV_MULTISHOT
+    if (result > 0 && (flags & IORING_CQE_F_BUFFER))
+    {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cl->peer_state != PEER_STOPPED)
+        {
+            handle_read_buffer(cl, recv_bufs + (size_t)bid*recv_buf_size, result);
+        }
+        return_recv_buf(bid);
+    }
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        // The recv is finished: cancelled, out of buffers, disconnected or failed
+        cl->recv_armed = false;
+        cl->refs--;
+        recv_armed_count--;
+        if (cl->peer_state == PEER_STOPPED)
+        {
+            if (cl->refs <= 0)
+            {
+                delete cl;
+            }
+        }
+        else if (result == -EINVAL)
+        {
+            // Multishot recv requires Linux 6.0
+            if (multishot_recv)
+            {
+                fprintf(stderr, "[OSD %lu] Multishot receive is not supported by the kernel, proceeding with regular receive\n", osd_num);
+                multishot_recv = false;
+            }
+            cl->recv_multishot = false;
+            if (!use_direct_recv && !cl->in_buf)
+            {
+                cl->in_buf = malloc_or_die(receive_buffer_size);
+            }
+            if (!cl->zerocopy)
+            {
+                tfd->set_fd_handler(cl->peer_fd, false, [this](int peer_fd, int epoll_events)
+                {
+                    handle_peer_epoll(peer_fd, epoll_events);
+                });
+            }
+            read_ready_clients.push_back(cl->peer_fd);
+            ringloop->wakeup();
+        }
+        else if (result == 0 || result < 0 && result != -ENOBUFS && result != -ECANCELED)
+        {
+            if (result != 0)
+            {
+                fprintf(stderr, "Client %d socket read error: %d (%s). Disconnecting client\n", cl->peer_fd, -result, strerror(-result));
+            }
+            stop_client(cl->peer_fd);
+        }
+        else if (cl->peer_state != PEER_RDMA)
+        {
+            // Re-arm the recv, read_requests() also checks the client queue depth
+            read_ready_clients.push_back(cl->peer_fd);
+            ringloop->wakeup();
+        }
+    }
+    else if (cl->peer_state != PEER_STOPPED && client_queue_depth > 0 && !cl->recv_cancelling &&
+        cl->exec_queue.size() + cl->exec_ops >= client_queue_depth)
+    {
+        // Too many operations in flight, stop receiving and resume when some of them complete
+        io_uring_sqe *sqe = ringloop->get_sqe();
+        if (sqe)
+        {
+            ring_data_t *data = ((ring_data_t*)sqe->user_data);
+            data->callback = [](ring_data_t *data) {};
+            my_uring_prep_cancel(sqe, &cl->recv_data, 0);
+            cl->recv_cancelling = true;
+        }
+    }
+    for (auto cb: set_immediate)
+    {
+        cb();
+    }
+    set_immediate.clear();
+#endif
+}
+
+// Start accepting connections with multishot accept, returns false if it's not enabled
+bool osd_messenger_t::accept_multishot(int listen_fd)
+{
+#ifdef IORING_ACCEPT_MULTISHOT
+    if (!multishot_recv)
+    {
+        return false;
+    }
+    io_uring_sqe *sqe = ringloop->get_sqe();
+    if (!sqe)
+    {
+        return false;
+    }
+    accept_data = ((ring_data_t*)sqe->user_data);
+    accept_data->callback = [this, listen_fd](ring_data_t *data)
+    {
+        handle_multishot_accept(listen_fd, data->res, data->cqe_flags);
+    };
+    my_uring_prep_accept(sqe, listen_fd, NULL, NULL, 0);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    ringloop->wakeup();
+    return true;
+#else
+    return false;
+#endif
+}
+
+void osd_messenger_t::handle_multishot_accept(int listen_fd, int result, unsigned flags)
+{
+#ifdef IORING_ACCEPT_MULTISHOT
+    if (result >= 0)
+    {
+        sockaddr addr = {};
+        socklen_t peer_addr_size = sizeof(addr);
+        getpeername(result, &addr, &peer_addr_size);
+        init_accepted_client(result, addr);
+    }
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        accept_data = NULL;
+        if (result < 0 && result != -EINVAL && result != -ECANCELED)
+        {
+            throw std::runtime_error(std::string("accept: ") + strerror(-result));
+        }
+        if (result == -EINVAL || !accept_multishot(listen_fd))
+        {
+            // Multishot accept isn't supported or there are no free SQEs, use epoll
+            tfd->set_fd_handler(listen_fd, false, [this](int fd, int events)
+            {
+                accept_connections(fd);
+            });
+            accept_connections(listen_fd);
+        }
+    }
+#endif
+}
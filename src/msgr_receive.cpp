@@ -9,11 +9,39 @@ void osd_messenger_t::read_requests()
     {
         int peer_fd = read_ready_clients[i];
         osd_client_t *cl = clients[peer_fd];
-        if (cl->read_msg.msg_iovlen)
+        if (cl->peer_state == PEER_SHM)
         {
+            // Data is received from shared memory, the socket is only used to detect disconnects
+            try_recv_shm(cl);
             continue;
         }
-        if (cl->read_remaining < receive_buffer_size)
+        if (cl->read_msg.msg_iovlen || cl->recv_armed)
+        {
+            continue;
+        }
+        if (client_queue_depth > 0 && !cl->read_op &&
+            cl->exec_queue.size() + cl->exec_ops >= client_queue_depth)
+        {
+            // Too many operations in flight, resume reading when some of them complete
+            cl->read_blocked = true;
+            continue;
+        }
+        if (cl->recv_multishot)
+        {
+            // One multishot recv receives everything until it's cancelled
+            if (!arm_multishot_recv(cl))
+            {
+                read_ready_clients.erase(read_ready_clients.begin(), read_ready_clients.begin() + i);
+                return;
+            }
+            continue;
+        }
+        if (use_direct_recv && !cl->read_op)
+        {
+            // Read the header directly into a new operation
+            begin_read_hdr(cl);
+        }
+        if (!use_direct_recv && cl->read_remaining < receive_buffer_size)
         {
             cl->read_iov.iov_base = cl->in_buf;
             cl->read_iov.iov_len = receive_buffer_size;
@@ -52,6 +80,10 @@ void osd_messenger_t::read_requests()
         }
     }
     read_ready_clients.clear();
+    if (exec_ready_clients.size())
+    {
+        exec_client_ops();
+    }
 }
 
 bool osd_messenger_t::handle_read(int result, osd_client_t *cl)
@@ -89,7 +121,7 @@ bool osd_messenger_t::handle_read(int result, osd_client_t *cl)
     }
     if (result > 0)
     {
-        if (cl->read_iov.iov_base == cl->in_buf)
+        if (cl->in_buf && cl->read_iov.iov_base == cl->in_buf)
         {
             if (!handle_read_buffer(cl, cl->in_buf, result))
             {
@@ -127,12 +159,7 @@ bool osd_messenger_t::handle_read_buffer(osd_client_t *cl, void *curbuf, int rem
     {
         if (!cl->read_op)
         {
-            cl->read_op = new osd_op_t;
-            cl->read_op->peer_fd = cl->peer_fd;
-            cl->read_op->op_type = OSD_OP_IN;
-            cl->recv_list.push_back(cl->read_op->req.buf, OSD_PACKET_SIZE);
-            cl->read_remaining = OSD_PACKET_SIZE;
-            cl->read_state = CL_READ_HDR;
+            begin_read_hdr(cl);
         }
         while (cl->recv_list.done < cl->recv_list.count && remain > 0)
         {
@@ -166,6 +193,16 @@ bool osd_messenger_t::handle_read_buffer(osd_client_t *cl, void *curbuf, int rem
     return true;
 }
 
+void osd_messenger_t::begin_read_hdr(osd_client_t *cl)
+{
+    cl->read_op = new osd_op_t;
+    cl->read_op->peer_fd = cl->peer_fd;
+    cl->read_op->op_type = OSD_OP_IN;
+    cl->recv_list.push_back(cl->read_op->req.buf, OSD_PACKET_SIZE);
+    cl->read_remaining = OSD_PACKET_SIZE;
+    cl->read_state = CL_READ_HDR;
+}
+
 bool osd_messenger_t::handle_finished_read(osd_client_t *cl)
 {
     cl->recv_list.reset();
@@ -185,8 +222,7 @@ bool osd_messenger_t::handle_finished_read(osd_client_t *cl)
     else if (cl->read_state == CL_READ_DATA)
     {
         // Operation is ready
-        cl->received_ops.push_back(cl->read_op);
-        set_immediate.push_back([this, op = cl->read_op]() { exec_op(op); });
+        enqueue_client_op(cl, cl->read_op);
         cl->read_op = NULL;
         cl->read_state = 0;
     }
@@ -279,8 +315,7 @@ void osd_messenger_t::handle_op_hdr(osd_client_t *cl)
     else
     {
         // Operation is ready
-        cl->received_ops.push_back(cur_op);
-        set_immediate.push_back([this, cur_op]() { exec_op(cur_op); });
+        enqueue_client_op(cl, cur_op);
         cl->read_op = NULL;
         cl->read_state = 0;
     }
@@ -299,6 +334,7 @@ bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
     osd_op_t *op = req_it->second;
     memcpy(op->reply.buf, cl->read_op->req.buf, OSD_PACKET_SIZE);
     cl->sent_ops.erase(req_it);
+    cl->outstanding_bytes -= get_op_transfer_size(op);
     if (op->reply.hdr.opcode == OSD_OP_SEC_READ || op->reply.hdr.opcode == OSD_OP_READ)
     {
         // Read data. In this case we assume that the buffer is preallocated by the caller (!)
@@ -342,6 +378,16 @@ bool osd_messenger_t::handle_reply_hdr(osd_client_t *cl)
         op->buf = memalign_or_die(MEM_ALIGNMENT, cl->read_remaining);
         cl->recv_list.push_back(op->buf, cl->read_remaining);
     }
+    else if (op->reply.hdr.opcode == OSD_OP_SEC_GET_LOG && op->reply.hdr.retval > 0)
+    {
+        assert(!op->iov.count);
+        delete cl->read_op;
+        cl->read_op = op;
+        cl->read_state = CL_READ_REPLY_DATA;
+        cl->read_remaining = sizeof(osd_pg_log_entry_t) * op->reply.hdr.retval;
+        op->buf = malloc_or_die(cl->read_remaining);
+        cl->recv_list.push_back(op->buf, cl->read_remaining);
+    }
     else if (op->reply.hdr.opcode == OSD_OP_SEC_READ_BMP && op->reply.hdr.retval > 0)
     {
         assert(!op->iov.count);
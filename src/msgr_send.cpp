@@ -3,9 +3,42 @@
 
 #define _XOPEN_SOURCE
 #include <limits.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
 
 #include "messenger.h"
 
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+// Background operations (recovery, rebalance, flush, listing) are sent after client operations
+static bool is_background_op(osd_op_t *cur_op)
+{
+    uint64_t opcode = cur_op->req.hdr.opcode;
+    if (opcode == OSD_OP_SEC_READ || opcode == OSD_OP_SEC_WRITE || opcode == OSD_OP_SEC_WRITE_STABLE)
+        return cur_op->req.sec_rw.priority != OSD_OP_PRIO_CLIENT;
+    else if (opcode == OSD_OP_SEC_DELETE)
+        return cur_op->req.sec_del.priority != OSD_OP_PRIO_CLIENT;
+    else if (opcode == OSD_OP_SEC_STABILIZE || opcode == OSD_OP_SEC_ROLLBACK)
+        return cur_op->req.sec_stab.priority != OSD_OP_PRIO_CLIENT;
+    return opcode == OSD_OP_SEC_LIST || opcode == OSD_OP_SEC_DELETE_INODE;
+}
+
+// Request and reply size of an outbound operation, used to balance OSD peer connections
+uint64_t osd_messenger_t::get_op_transfer_size(osd_op_t *cur_op)
+{
+    uint64_t opcode = cur_op->req.hdr.opcode;
+    if (opcode == OSD_OP_SEC_READ || opcode == OSD_OP_SEC_WRITE || opcode == OSD_OP_SEC_WRITE_STABLE)
+        return 2*OSD_PACKET_SIZE + cur_op->req.sec_rw.len;
+    else if (opcode == OSD_OP_READ || opcode == OSD_OP_WRITE)
+        return 2*OSD_PACKET_SIZE + cur_op->req.rw.len;
+    return 2*OSD_PACKET_SIZE;
+}
+
 void osd_messenger_t::outbox_push(osd_op_t *cur_op)
 {
     assert(cur_op->peer_fd);
@@ -25,6 +58,8 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
             {
                 found = true;
                 cl->received_ops.erase(it, it+1);
+                if (is_client_op(cur_op))
+                    finish_client_op(cl);
                 break;
             }
         }
@@ -34,8 +69,9 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
             return;
         }
     }
-    auto & to_send_list = cl->write_msg.msg_iovlen ? cl->next_send_list : cl->send_list;
-    auto & to_outbox = cl->write_msg.msg_iovlen ? cl->next_outbox : cl->outbox;
+    bool bg = cl->write_msg.msg_iovlen && is_background_op(cur_op);
+    auto & to_send_list = bg ? cl->bg_send_list : (cl->write_msg.msg_iovlen ? cl->next_send_list : cl->send_list);
+    auto & to_outbox = bg ? cl->bg_outbox : (cl->write_msg.msg_iovlen ? cl->next_outbox : cl->outbox);
     if (cur_op->op_type == OSD_OP_IN)
     {
         measure_exec(cur_op);
@@ -45,6 +81,7 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
     {
         to_send_list.push_back((iovec){ .iov_base = cur_op->req.buf, .iov_len = OSD_PACKET_SIZE });
         cl->sent_ops[cur_op->req.hdr.id] = cur_op;
+        cl->outstanding_bytes += get_op_transfer_size(cur_op);
     }
     to_outbox.push_back((msgr_sendp_t){ .op = cur_op, .flags = MSGR_SENDP_HDR });
     // Bitmap
@@ -73,6 +110,7 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
         ? (cur_op->req.hdr.opcode == OSD_OP_READ ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_READ ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_LIST ||
+        cur_op->req.hdr.opcode == OSD_OP_SEC_GET_LOG ||
         cur_op->req.hdr.opcode == OSD_OP_SHOW_CONFIG)
         : (cur_op->req.hdr.opcode == OSD_OP_WRITE ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE ||
@@ -107,6 +145,21 @@ void osd_messenger_t::outbox_push(osd_op_t *cur_op)
         return;
     }
 #endif
+    if (cl->peer_state == PEER_SHM && cl->write_msg.msg_iovlen == 0)
+    {
+        if (!ringloop)
+        {
+            try_send_shm(cl);
+        }
+        else if (cl->write_state == 0)
+        {
+            // Copy everything queued in this loop iteration at once in send_replies()
+            cl->write_state = CL_WRITE_READY;
+            write_ready_clients.push_back(cur_op->peer_fd);
+            ringloop->wakeup();
+        }
+        return;
+    }
     if (!ringloop)
     {
         // FIXME: It's worse because it doesn't allow batching
@@ -164,30 +217,52 @@ void osd_messenger_t::measure_exec(osd_op_t *cur_op)
 bool osd_messenger_t::try_send(osd_client_t *cl)
 {
     int peer_fd = cl->peer_fd;
+    if (cl->peer_state == PEER_SHM && cl->write_msg.msg_iovlen == 0)
+    {
+        cl->write_state = 0;
+        return try_send_shm(cl);
+    }
     if (!cl->send_list.size() || cl->write_msg.msg_iovlen > 0)
     {
         return true;
     }
+    io_uring_sqe* sqe = NULL;
     if (ringloop && !use_sync_send_recv)
     {
-        io_uring_sqe* sqe = ringloop->get_sqe();
+        sqe = ringloop->get_sqe();
         if (!sqe)
         {
             return false;
         }
-        cl->write_msg.msg_iov = cl->send_list.data();
-        cl->write_msg.msg_iovlen = cl->send_list.size() < IOV_MAX ? cl->send_list.size() : IOV_MAX;
+    }
+    cl->write_msg.msg_iov = cl->send_list.data();
+    cl->write_msg.msg_iovlen = cl->send_list.size() < IOV_MAX ? cl->send_list.size() : IOV_MAX;
+    cl->write_zerocopy = false;
+    if (cl->zerocopy)
+    {
+        if (cl->zc_held.size())
+        {
+            handle_zerocopy_completions(cl);
+        }
+        // Only large batches are worth pinning pages and waiting for completions
+        uint64_t len = 0;
+        for (int i = 0; i < cl->write_msg.msg_iovlen && len < tcp_zerocopy_threshold; i++)
+        {
+            len += cl->write_msg.msg_iov[i].iov_len;
+        }
+        cl->write_zerocopy = len >= tcp_zerocopy_threshold;
+    }
+    if (sqe)
+    {
         cl->refs++;
         ring_data_t* data = ((ring_data_t*)sqe->user_data);
         data->callback = [this, cl](ring_data_t *data) { handle_send(data->res, cl); };
-        my_uring_prep_sendmsg(sqe, peer_fd, &cl->write_msg, 0);
+        my_uring_prep_sendmsg(sqe, peer_fd, &cl->write_msg, cl->write_zerocopy ? MSG_ZEROCOPY : 0);
     }
     else
     {
-        cl->write_msg.msg_iov = cl->send_list.data();
-        cl->write_msg.msg_iovlen = cl->send_list.size() < IOV_MAX ? cl->send_list.size() : IOV_MAX;
         cl->refs++;
-        int result = sendmsg(peer_fd, &cl->write_msg, MSG_NOSIGNAL);
+        int result = sendmsg(peer_fd, &cl->write_msg, MSG_NOSIGNAL | (cl->write_zerocopy ? MSG_ZEROCOPY : 0));
         if (result < 0)
         {
             result = -errno;
@@ -212,6 +287,34 @@ void osd_messenger_t::send_replies()
     write_ready_clients.clear();
 }
 
+// Move whole background operations to the send list. At least one is always moved
+// so that background operations are never starved
+void osd_messenger_t::move_background_ops(osd_client_t *cl)
+{
+    uint64_t fg_bytes = 0, bg_bytes = 0;
+    for (auto & iov: cl->send_list)
+    {
+        fg_bytes += iov.iov_len;
+    }
+    int n = 0;
+    while (n < cl->bg_outbox.size())
+    {
+        if (n > 0 && fg_bytes > 0 && bg_bytes*MSGR_BG_RATIO >= fg_bytes)
+        {
+            break;
+        }
+        do
+        {
+            bg_bytes += cl->bg_send_list[n].iov_len;
+            n++;
+        } while (n < cl->bg_outbox.size() && !(cl->bg_outbox[n].flags & MSGR_SENDP_HDR));
+    }
+    cl->send_list.insert(cl->send_list.end(), cl->bg_send_list.begin(), cl->bg_send_list.begin()+n);
+    cl->outbox.insert(cl->outbox.end(), cl->bg_outbox.begin(), cl->bg_outbox.begin()+n);
+    cl->bg_send_list.erase(cl->bg_send_list.begin(), cl->bg_send_list.begin()+n);
+    cl->bg_outbox.erase(cl->bg_outbox.begin(), cl->bg_outbox.begin()+n);
+}
+
 void osd_messenger_t::handle_send(int result, osd_client_t *cl)
 {
     cl->write_msg.msg_iovlen = 0;
@@ -233,6 +336,11 @@ void osd_messenger_t::handle_send(int result, osd_client_t *cl)
     }
     if (result >= 0)
     {
+        if (cl->write_zerocopy && result > 0)
+        {
+            stats.zerocopy_send_bytes += result;
+            cl->zc_next_id++;
+        }
         int done = 0;
         while (result > 0 && done < cl->send_list.size())
         {
@@ -242,7 +350,7 @@ void osd_messenger_t::handle_send(int result, osd_client_t *cl)
                 if (cl->outbox[done].flags & MSGR_SENDP_FREE)
                 {
                     // Reply fully sent
-                    delete cl->outbox[done].op;
+                    free_sent_op(cl, cl->outbox[done].op);
                 }
                 result -= iov.iov_len;
                 done++;
@@ -266,6 +374,10 @@ void osd_messenger_t::handle_send(int result, osd_client_t *cl)
             cl->next_send_list.clear();
             cl->next_outbox.clear();
         }
+        if (cl->bg_send_list.size())
+        {
+            move_background_ops(cl);
+        }
         cl->write_state = cl->outbox.size() > 0 ? CL_WRITE_READY : 0;
 #ifdef WITH_RDMA
         if (cl->rdma_conn && !cl->outbox.size() && cl->peer_state == PEER_RDMA_CONNECTING)
@@ -282,9 +394,95 @@ void osd_messenger_t::handle_send(int result, osd_client_t *cl)
             try_recv_rdma(cl);
         }
 #endif
+        if (cl->shm_conn && !cl->outbox.size() && cl->peer_state == PEER_SHM_CONNECTING)
+        {
+            start_shm(cl);
+        }
     }
     if (cl->write_state != 0)
     {
         write_ready_clients.push_back(cl->peer_fd);
     }
 }
+
+void osd_messenger_t::init_zerocopy(osd_client_t *cl)
+{
+    if (tcp_zerocopy_threshold > 0)
+    {
+        int one = 1;
+        cl->zerocopy = setsockopt(cl->peer_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+        if (!cl->zerocopy && log_level > 0)
+        {
+            fprintf(stderr, "Failed to enable MSG_ZEROCOPY for client %d: %s\n", cl->peer_fd, strerror(errno));
+        }
+    }
+}
+
+// Free a sent reply. Its buffers may still be referenced by the kernel after a zero-copy send,
+// so it's held until all zero-copy sends made up to this moment are reported as completed.
+// Outbound operations don't need that: their buffers are held until the peer replies,
+// and it can only reply after receiving (and ACKing) all data
+void osd_messenger_t::free_sent_op(osd_client_t *cl, osd_op_t *op)
+{
+    if (cl->zc_done_upto != cl->zc_next_id)
+        cl->zc_held.push_back({ cl->zc_next_id-1, op });
+    else
+        delete op;
+}
+
+void osd_messenger_t::handle_zerocopy_completions(osd_client_t *cl)
+{
+    while (true)
+    {
+        char control[128];
+        msghdr msg = { 0 };
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(cl->peer_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            // EAGAIN means that there are no more notifications
+            break;
+        }
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR ||
+                cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+            {
+                continue;
+            }
+            sock_extended_err *serr = (sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+            // Notification covers the range of send IDs [ee_info, ee_data]
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                stats.zerocopy_copied_sends += serr->ee_data - serr->ee_info + 1;
+            }
+            if (serr->ee_info == cl->zc_done_upto)
+            {
+                cl->zc_done_upto = serr->ee_data+1;
+            }
+            else
+            {
+                for (uint32_t id = serr->ee_info; id != serr->ee_data+1; id++)
+                    cl->zc_done.insert(id);
+            }
+        }
+    }
+    while (cl->zc_done.size())
+    {
+        auto done_it = cl->zc_done.find(cl->zc_done_upto);
+        if (done_it == cl->zc_done.end())
+            break;
+        cl->zc_done.erase(done_it);
+        cl->zc_done_upto++;
+    }
+    // IDs wrap around, so compare them using the signed difference
+    while (cl->zc_held.size() && (int32_t)(cl->zc_held.front().first - cl->zc_done_upto) < 0)
+    {
+        delete cl->zc_held.front().second;
+        cl->zc_held.pop_front();
+    }
+}
@@ -0,0 +1,564 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+// Shared memory transport for clients and OSDs running on the same host. The connection is
+// established over TCP as usual, and if the peer address is local, the client asks the OSD for
+// shared memory in the configuration request. The OSD creates it and replies with the name of
+// its abstract Unix socket and a random token. The client connects to that socket, sends the
+// token and receives the memory and notification eventfds. After that both sides exchange
+// regular protocol messages through the shared memory rings, so there are no syscalls unless
+// one of the sides sleeps, and the TCP connection is only kept to detect disconnects.
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <random>
+
+#include "messenger.h"
+
+static_assert(sizeof(msgr_shm_header_t) <= MSGR_SHM_HEADER_SIZE, "msgr_shm_header_t is too large");
+
+msgr_shm_connection_t *msgr_shm_connection_t::create(uint64_t ring_size)
+{
+    msgr_shm_connection_t *conn = new msgr_shm_connection_t();
+    conn->is_server = true;
+    conn->ring_size = ring_size;
+    conn->mem_size = MSGR_SHM_HEADER_SIZE + 2*ring_size;
+    conn->mem_fd = memfd_create("vitastor-shm", MFD_CLOEXEC);
+    if (conn->mem_fd < 0 || ftruncate(conn->mem_fd, conn->mem_size) < 0 ||
+        (conn->notify_fds[0] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0 ||
+        (conn->notify_fds[1] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0 ||
+        (conn->mem = mmap(NULL, conn->mem_size, PROT_READ|PROT_WRITE, MAP_SHARED, conn->mem_fd, 0)) == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to create shared memory for a local connection: %s\n", strerror(errno));
+        if (conn->mem == MAP_FAILED)
+            conn->mem = NULL;
+        delete conn;
+        return NULL;
+    }
+    msgr_shm_header_t *hdr = (msgr_shm_header_t*)conn->mem;
+    hdr->magic = MSGR_SHM_MAGIC;
+    hdr->ring_size = ring_size;
+    // Both sides start sleeping, so the first message always wakes them up
+    hdr->rings[0].consumer_sleeping = hdr->rings[1].consumer_sleeping = 1;
+    conn->setup_rings();
+    return conn;
+}
+
+msgr_shm_connection_t *msgr_shm_connection_t::attach(int mem_fd, int osd_notify_fd, int client_notify_fd)
+{
+    msgr_shm_connection_t *conn = new msgr_shm_connection_t();
+    conn->mem_fd = mem_fd;
+    conn->notify_fds[0] = osd_notify_fd;
+    conn->notify_fds[1] = client_notify_fd;
+    struct stat st;
+    if (fstat(mem_fd, &st) < 0 || st.st_size < MSGR_SHM_HEADER_SIZE ||
+        (conn->mem = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, mem_fd, 0)) == MAP_FAILED)
+    {
+        fprintf(stderr, "Failed to map shared memory of a local connection: %s\n", strerror(errno));
+        if (conn->mem == MAP_FAILED)
+            conn->mem = NULL;
+        delete conn;
+        return NULL;
+    }
+    conn->mem_size = st.st_size;
+    msgr_shm_header_t *hdr = (msgr_shm_header_t*)conn->mem;
+    conn->ring_size = hdr->ring_size;
+    if (hdr->magic != MSGR_SHM_MAGIC || !conn->ring_size || (conn->ring_size & (conn->ring_size-1)) ||
+        conn->mem_size != MSGR_SHM_HEADER_SIZE + 2*conn->ring_size)
+    {
+        fprintf(stderr, "Shared memory of a local connection has invalid format\n");
+        delete conn;
+        return NULL;
+    }
+    conn->setup_rings();
+    return conn;
+}
+
+void msgr_shm_connection_t::setup_rings()
+{
+    msgr_shm_header_t *hdr = (msgr_shm_header_t*)mem;
+    uint8_t *data = (uint8_t*)mem + MSGR_SHM_HEADER_SIZE;
+    send_ring = &hdr->rings[is_server ? 1 : 0];
+    recv_ring = &hdr->rings[is_server ? 0 : 1];
+    send_buf = data + (is_server ? ring_size : 0);
+    recv_buf = data + (is_server ? 0 : ring_size);
+}
+
+void msgr_shm_connection_t::notify_peer()
+{
+    uint64_t one = 1;
+    write(notify_fds[is_server ? 1 : 0], &one, sizeof(one));
+}
+
+// Publish new data and wake up the consumer if it sleeps. The fence orders the tail update
+// before the flag check, and the consumer does the opposite, so at least one of them sees the other
+void msgr_shm_connection_t::publish_send(uint64_t tail)
+{
+    __atomic_store_n(&send_ring->tail, tail, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&send_ring->consumer_sleeping, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&send_ring->consumer_sleeping, 0, __ATOMIC_RELAXED))
+    {
+        notify_peer();
+    }
+}
+
+// Release consumed data and wake up the producer if it waits for free space
+void msgr_shm_connection_t::publish_recv(uint64_t head)
+{
+    __atomic_store_n(&recv_ring->head, head, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&recv_ring->producer_waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&recv_ring->producer_waiting, 0, __ATOMIC_RELAXED))
+    {
+        notify_peer();
+    }
+}
+
+// Connections to any local address go through the loopback interface,
+// so their local and remote addresses are the same
+bool osd_messenger_t::is_local_peer(int peer_fd)
+{
+    sockaddr_storage self = {}, peer = {};
+    socklen_t self_len = sizeof(self), peer_len = sizeof(peer);
+    if (getsockname(peer_fd, (sockaddr*)&self, &self_len) < 0 ||
+        getpeername(peer_fd, (sockaddr*)&peer, &peer_len) < 0 ||
+        self.ss_family != peer.ss_family)
+    {
+        return false;
+    }
+    if (self.ss_family == AF_INET)
+    {
+        in_addr_t peer_addr = ((sockaddr_in*)&peer)->sin_addr.s_addr;
+        return ((sockaddr_in*)&self)->sin_addr.s_addr == peer_addr ||
+            (ntohl(peer_addr) >> 24) == IN_LOOPBACKNET;
+    }
+    if (self.ss_family == AF_INET6)
+    {
+        return !memcmp(&((sockaddr_in6*)&self)->sin6_addr, &((sockaddr_in6*)&peer)->sin6_addr, sizeof(in6_addr));
+    }
+    return false;
+}
+
+static bool make_shm_socket_addr(const std::string & name, sockaddr_un *addr, socklen_t *addr_len)
+{
+    if (name.size() >= sizeof(addr->sun_path))
+    {
+        return false;
+    }
+    // Abstract socket: not bound to a file and only visible in the same network namespace
+    memset(addr, 0, sizeof(sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path+1, name.data(), name.size());
+    *addr_len = offsetof(sockaddr_un, sun_path) + 1 + name.size();
+    return true;
+}
+
+bool osd_messenger_t::listen_shm()
+{
+    if (!use_shm)
+    {
+        return false;
+    }
+    shm_socket_name = "vitastor-osd"+std::to_string(osd_num)+"-"+std::to_string(getpid());
+    sockaddr_un addr;
+    socklen_t addr_len;
+    make_shm_socket_addr(shm_socket_name, &addr, &addr_len);
+    shm_listen_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (shm_listen_fd < 0 || bind(shm_listen_fd, (sockaddr*)&addr, addr_len) < 0 || listen(shm_listen_fd, 128) < 0)
+    {
+        fprintf(stderr, "[OSD %lu] Couldn't listen for shared memory connections: %s, proceeding with TCP only\n",
+            osd_num, strerror(errno));
+        if (shm_listen_fd >= 0)
+        {
+            close(shm_listen_fd);
+            shm_listen_fd = -1;
+        }
+        return false;
+    }
+    tfd->set_fd_handler(shm_listen_fd, false, [this](int fd, int epoll_events)
+    {
+        accept_shm_handshakes();
+    });
+    return true;
+}
+
+std::string osd_messenger_t::get_shm_socket()
+{
+    return shm_socket_name;
+}
+
+// Prepare shared memory for a local client which requested it, returns false if it's not possible
+bool osd_messenger_t::accept_shm(int peer_fd)
+{
+    if (shm_listen_fd < 0)
+    {
+        return false;
+    }
+    osd_client_t *cl = clients.at(peer_fd);
+    if (cl->shm_conn || cl->peer_state != PEER_CONNECTED || !is_local_peer(peer_fd))
+    {
+        return false;
+    }
+    cl->shm_conn = msgr_shm_connection_t::create(shm_ring_size);
+    if (!cl->shm_conn)
+    {
+        return false;
+    }
+    std::random_device rnd;
+    char token[MSGR_SHM_TOKEN_LEN+1];
+    for (int i = 0; i < MSGR_SHM_TOKEN_LEN/8; i++)
+    {
+        snprintf(token + i*8, 9, "%08x", (uint32_t)rnd());
+    }
+    cl->shm_conn->token = std::string(token, MSGR_SHM_TOKEN_LEN);
+    shm_pending[cl->shm_conn->token] = peer_fd;
+    return true;
+}
+
+void osd_messenger_t::accept_shm_handshakes()
+{
+    int fd;
+    while ((fd = accept4(shm_listen_fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0)
+    {
+        // The token is handled when it arrives, the client may be an OSD waiting for us in its own loop
+        tfd->set_fd_handler(fd, false, [this](int fd, int epoll_events)
+        {
+            handle_shm_handshake(fd);
+        });
+    }
+}
+
+void osd_messenger_t::handle_shm_handshake(int fd)
+{
+    // The token may arrive in several parts, collect it until it's complete or the client disconnects
+    std::string & token = shm_handshakes[fd];
+    while (token.size() < MSGR_SHM_TOKEN_LEN)
+    {
+        char buf[MSGR_SHM_TOKEN_LEN];
+        int r = recv(fd, buf, MSGR_SHM_TOKEN_LEN-token.size(), MSG_DONTWAIT);
+        if (r < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (r < 0 && errno == EAGAIN)
+        {
+            // Wait for the rest of the token, the handler is called again on EPOLLIN
+            return;
+        }
+        if (r <= 0)
+        {
+            break;
+        }
+        token.append(buf, r);
+    }
+    tfd->set_fd_handler(fd, false, NULL);
+    auto pending_it = token.size() == MSGR_SHM_TOKEN_LEN ? shm_pending.find(token) : shm_pending.end();
+    shm_handshakes.erase(fd);
+    if (pending_it != shm_pending.end())
+    {
+        osd_client_t *cl = clients.at(pending_it->second);
+        shm_pending.erase(pending_it);
+        auto shm = cl->shm_conn;
+        int fds[3] = { shm->mem_fd, shm->notify_fds[0], shm->notify_fds[1] };
+        char data = 0;
+        iovec iov = { .iov_base = &data, .iov_len = 1 };
+        char control[CMSG_SPACE(sizeof(fds))] = { 0 };
+        msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) == 1)
+        {
+            if (log_level > 0)
+            {
+                fprintf(stderr, "[OSD %lu] Connected with client %d using shared memory\n", osd_num, cl->peer_fd);
+            }
+            if (cl->write_msg.msg_iovlen > 0 || cl->outbox.size())
+            {
+                // Switch to shared memory after sending the configuration response, like with RDMA
+                cl->peer_state = PEER_SHM_CONNECTING;
+            }
+            else
+            {
+                start_shm(cl);
+            }
+        }
+        else
+        {
+            delete shm;
+            cl->shm_conn = NULL;
+        }
+    }
+    close(fd);
+}
+
+// Client side: get shared memory from the OSD, on_connect_peer() is called when it's done
+void osd_messenger_t::connect_shm(osd_client_t *cl, const std::string & socket_name, const std::string & token)
+{
+    sockaddr_un addr;
+    socklen_t addr_len;
+    int fd = -1;
+    if (token.size() != MSGR_SHM_TOKEN_LEN || !make_shm_socket_addr(socket_name, &addr, &addr_len) ||
+        (fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0 ||
+        connect(fd, (sockaddr*)&addr, addr_len) < 0 ||
+        send(fd, token.data(), token.size(), MSG_NOSIGNAL) != token.size())
+    {
+        fprintf(stderr, "Failed to connect to OSD %lu using shared memory: %s, proceeding with TCP\n",
+            cl->osd_num, strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        osd_peer_fds[cl->osd_num] = cl->peer_fd;
+        on_connect_peer(cl->osd_num, cl->peer_fd);
+        return;
+    }
+    cl->shm_conn = new msgr_shm_connection_t();
+    cl->shm_conn->handshake_fd = fd;
+    int peer_fd = cl->peer_fd;
+    tfd->set_fd_handler(fd, false, [this, peer_fd](int fd, int epoll_events)
+    {
+        handle_shm_reply(peer_fd);
+    });
+}
+
+void osd_messenger_t::handle_shm_reply(int peer_fd)
+{
+    osd_client_t *cl = clients.at(peer_fd);
+    int fds[3] = { -1, -1, -1 };
+    char data = 0;
+    iovec iov = { .iov_base = &data, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof(fds))];
+    msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int r = recvmsg(cl->shm_conn->handshake_fd, &msg, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+    if (r < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+        return;
+    }
+    tfd->set_fd_handler(cl->shm_conn->handshake_fd, false, NULL);
+    delete cl->shm_conn;
+    cl->shm_conn = NULL;
+    cmsghdr *cmsg = r > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+    {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+    if (fds[0] < 0)
+    {
+        // The OSD didn't accept the token and still uses TCP
+        fprintf(stderr, "OSD %lu refused the shared memory connection, proceeding with TCP\n", cl->osd_num);
+        osd_peer_fds[cl->osd_num] = peer_fd;
+        on_connect_peer(cl->osd_num, peer_fd);
+        return;
+    }
+    cl->shm_conn = msgr_shm_connection_t::attach(fds[0], fds[1], fds[2]);
+    if (!cl->shm_conn)
+    {
+        // The OSD already waits for data in shared memory, so the connection can't be used
+        osd_num_t peer_osd = cl->osd_num;
+        stop_client(peer_fd);
+        on_connect_peer(peer_osd, -EIO);
+        return;
+    }
+    if (log_level > 0)
+    {
+        fprintf(stderr, "Connected to OSD %lu using shared memory\n", cl->osd_num);
+    }
+    start_shm(cl);
+    osd_peer_fds[cl->osd_num] = peer_fd;
+    on_connect_peer(cl->osd_num, peer_fd);
+}
+
+void osd_messenger_t::start_shm(osd_client_t *cl)
+{
+    int peer_fd = cl->peer_fd;
+    cl->peer_state = PEER_SHM;
+    tfd->set_fd_handler(cl->shm_conn->wait_fd(), false, [this, peer_fd](int fd, int epoll_events)
+    {
+        auto cl_it = clients.find(peer_fd);
+        if (cl_it != clients.end())
+        {
+            handle_shm_notify(cl_it->second);
+        }
+    });
+    // The peer may have already sent something
+    cl->read_ready = 1;
+    read_ready_clients.push_back(peer_fd);
+    if (ringloop)
+        ringloop->wakeup();
+    else
+        read_requests();
+}
+
+void osd_messenger_t::stop_shm(osd_client_t *cl)
+{
+    auto shm = cl->shm_conn;
+    if (shm->is_server)
+    {
+        shm_pending.erase(shm->token);
+    }
+    if (shm->wait_fd() >= 0)
+    {
+        tfd->set_fd_handler(shm->wait_fd(), false, NULL);
+    }
+    if (shm->handshake_fd >= 0)
+    {
+        // The connection is stopped before on_connect_peer(), so report the failure
+        tfd->set_fd_handler(shm->handshake_fd, false, NULL);
+        close(shm->handshake_fd);
+        shm->handshake_fd = -1;
+        on_connect_peer(cl->osd_num, -EPIPE);
+    }
+    // Memory is unmapped when the client is freed
+}
+
+void osd_messenger_t::handle_shm_notify(osd_client_t *cl)
+{
+    uint64_t value;
+    read(cl->shm_conn->wait_fd(), &value, sizeof(value));
+    // The peer either freed some space for sending or sent some data
+    if (cl->send_list.size() && !cl->write_msg.msg_iovlen)
+    {
+        try_send_shm(cl);
+    }
+    if (!cl->read_ready)
+    {
+        cl->read_ready = 1;
+        read_ready_clients.push_back(cl->peer_fd);
+        if (ringloop)
+            ringloop->wakeup();
+        else
+            read_requests();
+    }
+}
+
+bool osd_messenger_t::try_send_shm(osd_client_t *cl)
+{
+    auto shm = cl->shm_conn;
+    uint64_t tail = shm->send_ring->tail;
+    uint64_t head = __atomic_load_n(&shm->send_ring->head, __ATOMIC_ACQUIRE);
+    bool waiting = false;
+    int done = 0;
+    while (done < cl->send_list.size())
+    {
+        uint64_t space = shm->ring_size - (tail-head);
+        if (!space)
+        {
+            if (waiting)
+            {
+                // The consumer notifies us when it frees some space
+                break;
+            }
+            shm->publish_send(tail);
+            __atomic_store_n(&shm->send_ring->producer_waiting, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            head = __atomic_load_n(&shm->send_ring->head, __ATOMIC_ACQUIRE);
+            waiting = true;
+            continue;
+        }
+        waiting = false;
+        iovec & iov = cl->send_list[done];
+        uint64_t pos = tail & (shm->ring_size-1);
+        uint64_t len = iov.iov_len;
+        if (len > space)
+            len = space;
+        if (len > shm->ring_size-pos)
+            len = shm->ring_size-pos;
+        memcpy(shm->send_buf + pos, iov.iov_base, len);
+        tail += len;
+        if (len < iov.iov_len)
+        {
+            iov.iov_base = (uint8_t*)iov.iov_base + len;
+            iov.iov_len -= len;
+        }
+        else
+        {
+            if (cl->outbox[done].flags & MSGR_SENDP_FREE)
+            {
+                // Reply fully sent
+                free_sent_op(cl, cl->outbox[done].op);
+            }
+            done++;
+        }
+    }
+    shm->publish_send(tail);
+    if (done > 0)
+    {
+        cl->send_list.erase(cl->send_list.begin(), cl->send_list.begin()+done);
+        cl->outbox.erase(cl->outbox.begin(), cl->outbox.begin()+done);
+    }
+    return true;
+}
+
+void osd_messenger_t::try_recv_shm(osd_client_t *cl)
+{
+    auto shm = cl->shm_conn;
+    uint64_t head = shm->recv_ring->head;
+    bool sleeping = false;
+    cl->refs++;
+    while (cl->peer_state == PEER_SHM)
+    {
+        if (client_queue_depth > 0 && !cl->read_op &&
+            cl->exec_queue.size() + cl->exec_ops >= client_queue_depth)
+        {
+            // Too many operations in flight, finish_client_op() resumes reading
+            cl->read_blocked = true;
+            break;
+        }
+        uint64_t tail = __atomic_load_n(&shm->recv_ring->tail, __ATOMIC_ACQUIRE);
+        if (tail == head)
+        {
+            if (sleeping)
+            {
+                cl->read_ready = 0;
+                break;
+            }
+            // Ask the producer for a notification and check for new data again
+            __atomic_store_n(&shm->recv_ring->consumer_sleeping, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            sleeping = true;
+            continue;
+        }
+        sleeping = false;
+        uint64_t pos = head & (shm->ring_size-1);
+        uint64_t len = tail-head;
+        if (len > shm->ring_size-pos)
+            len = shm->ring_size-pos;
+        if (len > receive_buffer_size)
+            len = receive_buffer_size;
+        // handle_read_buffer() copies everything, so the space can be released right after it
+        bool ok = handle_read_buffer(cl, shm->recv_buf + pos, len);
+        head += len;
+        shm->publish_recv(head);
+        if (!ok)
+        {
+            break;
+        }
+    }
+    cl->refs--;
+    if (cl->peer_state == PEER_STOPPED && cl->refs <= 0)
+    {
+        delete cl;
+    }
+    for (auto cb: set_immediate)
+    {
+        cb();
+    }
+    set_immediate.clear();
+}
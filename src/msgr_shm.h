@@ -0,0 +1,77 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string>
+
+#define MSGR_SHM_MAGIC 0x31484d5341544956ul
+#define MSGR_SHM_HEADER_SIZE 4096
+#define MSGR_SHM_TOKEN_LEN 32
+
+// One direction of a shared memory connection: a byte stream in the regular wire format,
+// so operations are composed from it exactly like from data received over TCP.
+// Positions only grow, the data offset is (position & (ring_size-1))
+struct msgr_shm_ring_t
+{
+    // consumer position, written by the consumer
+    alignas(64) uint64_t head;
+    // producer position, written by the producer
+    alignas(64) uint64_t tail;
+    // set by the consumer before waiting for data, cleared by the producer when it notifies the consumer
+    alignas(64) uint32_t consumer_sleeping;
+    // set by the producer before waiting for free space, cleared by the consumer when it notifies the producer
+    alignas(64) uint32_t producer_waiting;
+};
+
+struct msgr_shm_header_t
+{
+    uint64_t magic;
+    uint64_t ring_size;
+    // rings[0] carries data from the connecting side to the OSD, rings[1] - from the OSD back
+    msgr_shm_ring_t rings[2];
+};
+
+// Shared memory (memfd) with the header and both rings, and two eventfds used to wake up
+// the sides when they sleep. The OSD creates it and passes file descriptors to the client
+// through its local Unix socket, the TCP connection is kept to detect disconnects
+struct msgr_shm_connection_t
+{
+    bool is_server = false;
+    std::string token;
+    int mem_fd = -1;
+    // notify_fds[0] wakes up the OSD, notify_fds[1] wakes up the client
+    int notify_fds[2] = { -1, -1 };
+    // client side: Unix socket used to receive file descriptors
+    int handshake_fd = -1;
+    void *mem = NULL;
+    uint64_t mem_size = 0, ring_size = 0;
+    msgr_shm_ring_t *send_ring = NULL, *recv_ring = NULL;
+    uint8_t *send_buf = NULL, *recv_buf = NULL;
+
+    static msgr_shm_connection_t *create(uint64_t ring_size);
+    static msgr_shm_connection_t *attach(int mem_fd, int osd_notify_fd, int client_notify_fd);
+    void setup_rings();
+    void notify_peer();
+    void publish_send(uint64_t tail);
+    void publish_recv(uint64_t head);
+    int wait_fd()
+    {
+        return notify_fds[is_server ? 0 : 1];
+    }
+
+    ~msgr_shm_connection_t()
+    {
+        if (mem)
+            munmap(mem, mem_size);
+        if (mem_fd >= 0)
+            close(mem_fd);
+        for (int i = 0; i < 2; i++)
+            if (notify_fds[i] >= 0)
+                close(notify_fds[i]);
+        if (handshake_fd >= 0)
+            close(handshake_fd);
+    }
+};
@@ -2,6 +2,7 @@
 // License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
 
 #include <unistd.h>
+#include <sys/socket.h>
 #include <assert.h>
 
 #include "messenger.h"
@@ -16,7 +17,10 @@ void osd_messenger_t::cancel_osd_ops(osd_client_t *cl)
         cancel_ops[i++] = p.second;
     }
     cl->sent_ops.clear();
+    cl->outstanding_bytes = 0;
     cl->outbox.clear();
+    cl->bg_send_list.clear();
+    cl->bg_outbox.clear();
     for (auto op: cancel_ops)
     {
         cancel_op(op);
@@ -41,6 +45,39 @@ void osd_messenger_t::cancel_op(osd_op_t *op)
     }
 }
 
+int osd_messenger_t::select_peer_fd(osd_num_t peer_osd, const object_id & oid)
+{
+    auto peer_it = osd_peer_fds.find(peer_osd);
+    if (peer_it == osd_peer_fds.end())
+    {
+        return -1;
+    }
+    auto extra_it = osd_peer_extra_fds.find(peer_osd);
+    if (extra_it == osd_peer_extra_fds.end() || !extra_it->second.size())
+    {
+        return peer_it->second;
+    }
+    // Start from the connection chosen by the object hash and pick the one with the least
+    // outstanding bytes, so small operations don't wait behind large transfers
+    auto & extra_fds = extra_it->second;
+    int n = extra_fds.size()+1;
+    int start = std::hash<object_id>()(oid) % n;
+    int best_fd = -1;
+    uint64_t best_bytes = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int j = (start+i) % n;
+        int fd = j == 0 ? peer_it->second : extra_fds[j-1];
+        uint64_t bytes = clients.at(fd)->outstanding_bytes;
+        if (best_fd < 0 || bytes < best_bytes)
+        {
+            best_fd = fd;
+            best_bytes = bytes;
+        }
+    }
+    return best_fd;
+}
+
 void osd_messenger_t::stop_client(int peer_fd, bool force, bool force_delete)
 {
     assert(peer_fd != 0);
@@ -68,10 +105,35 @@ void osd_messenger_t::stop_client(int peer_fd, bool force, bool force_delete)
     // First set state to STOPPED so another stop_client() call doesn't try to free it again
     cl->refs++;
     cl->peer_state = PEER_STOPPED;
-    if (cl->osd_num)
+    std::vector<int> extra_fds;
+    bool extra_used = false;
+    if (cl->osd_num && cl->peer_extra)
     {
-        // ...and forget OSD peer
+        // ...and forget the additional connection
+        auto extra_it = osd_peer_extra_fds.find(cl->osd_num);
+        if (extra_it != osd_peer_extra_fds.end())
+        {
+            for (auto fd_it = extra_it->second.begin(); fd_it != extra_it->second.end(); fd_it++)
+            {
+                if (*fd_it == peer_fd)
+                {
+                    extra_it->second.erase(fd_it);
+                    extra_used = true;
+                    break;
+                }
+            }
+        }
+    }
+    else if (cl->osd_num)
+    {
+        // ...and forget OSD peer together with its additional connections
         osd_peer_fds.erase(cl->osd_num);
+        auto extra_it = osd_peer_extra_fds.find(cl->osd_num);
+        if (extra_it != osd_peer_extra_fds.end())
+        {
+            extra_fds.swap(extra_it->second);
+            osd_peer_extra_fds.erase(extra_it);
+        }
     }
 #ifndef __MOCK__
     // Then remove FD from the eventloop so we don't accidentally read something
@@ -98,12 +160,56 @@ void osd_messenger_t::stop_client(int peer_fd, bool force, bool force_delete)
         }
     }
 #endif
-    if (cl->osd_num)
+    if (cl->osd_num && !cl->peer_extra)
     {
         // Then repeer PGs because cancel_op() callbacks can try to perform
         // some actions and we need correct PG states to not do something silly
         repeer_pgs(cl->osd_num);
     }
+    else if (extra_used)
+    {
+        // Operations sent through the additional connection are lost together with it,
+        // so drop the main connection too. It repeers PGs and stops other connections
+        auto main_it = osd_peer_fds.find(cl->osd_num);
+        if (main_it != osd_peer_fds.end())
+        {
+            stop_client(main_it->second);
+        }
+    }
+    for (int extra_fd: extra_fds)
+    {
+        stop_client(extra_fd, true);
+    }
+    // Forget queued client operations
+    if (cl->exec_queue.size())
+    {
+        for (auto eit = exec_ready_clients.begin(); eit != exec_ready_clients.end(); eit++)
+        {
+            if (*eit == peer_fd)
+            {
+                exec_ready_clients.erase(eit);
+                break;
+            }
+        }
+        for (auto op: cl->exec_queue)
+        {
+            delete op;
+        }
+        cl->exec_queue.clear();
+    }
+    if (cl->exec_qos_timer_id >= 0)
+    {
+        tfd->clear_timer(cl->exec_qos_timer_id);
+        cl->exec_qos_timer_id = -1;
+    }
+    exec_inflight -= cl->exec_ops;
+    cl->exec_ops = 0;
+#ifndef __MOCK__
+    if (exec_ready_clients.size())
+    {
+        ringloop->wakeup();
+    }
+#endif
     // Then cancel all operations
     if (cl->read_op)
     {
@@ -119,6 +225,19 @@ void osd_messenger_t::stop_client(int peer_fd, bool force, bool force_delete)
         cancel_osd_ops(cl);
     }
 #ifndef __MOCK__
+    if (cl->recv_armed)
+    {
+        // Terminate the multishot recv, it holds a reference to the client until its final CQE
+        shutdown(peer_fd, SHUT_RDWR);
+        io_uring_sqe *sqe = ringloop->get_sqe();
+        if (sqe)
+        {
+            ring_data_t *data = ((ring_data_t*)sqe->user_data);
+            data->callback = [](ring_data_t *data) {};
+            my_uring_prep_cancel(sqe, &cl->recv_data, 0);
+            ringloop->submit();
+        }
+    }
     // And close the FD only when everything is done
     // ...because peer_fd number can get reused after close()
     close(peer_fd);
@@ -128,6 +247,10 @@ void osd_messenger_t::stop_client(int peer_fd, bool force, bool force_delete)
         delete cl->rdma_conn;
     }
 #endif
+    if (cl->shm_conn)
+    {
+        stop_shm(cl);
+    }
 #endif
     // Find the item again because it can be invalidated at this point
     it = clients.find(peer_fd);
@@ -136,7 +259,12 @@ void osd_messenger_t::stop_client(int peer_fd, bool force, bool force_delete)
         clients.erase(it);
     }
     cl->refs--;
-    if (cl->refs <= 0 || force_delete)
+    if (force_delete && cl->recv_armed)
+    {
+        // Only the multishot recv may keep the client now, it's deleted after the final CQE
+        cl->refs = 1;
+    }
+    else if (cl->refs <= 0 || force_delete)
     {
         delete cl;
     }
@@ -28,6 +28,8 @@ static blockstore_config_t json_to_bs(const json11::Json::object & config)
 
 osd_t::osd_t(const json11::Json & config, ring_loop_t *ringloop)
 {
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
     zero_buffer_size = 1<<20;
     zero_buffer = malloc_or_die(zero_buffer_size);
     memset(zero_buffer, 0, zero_buffer_size);
@@ -39,6 +41,15 @@ osd_t::osd_t(const json11::Json & config, ring_loop_t *ringloop)
         this->config["log_level"] = 1;
     parse_config(this->config);
 
+    {
+        // PG logs are lost on restart, so they must be distinguishable from previous ones
+        timespec tv;
+        clock_gettime(CLOCK_REALTIME, &tv);
+        pg_log_id = ((uint64_t)tv.tv_sec*1000000000 + tv.tv_nsec) ^ ((uint64_t)getpid() << 40);
+        if (!pg_log_id)
+            pg_log_id = 1;
+    }
+
     epmgr = new epoll_manager_t(ringloop);
     // FIXME: Use timerfd_interval based directly on io_uring
     this->tfd = epmgr->tfd;
@@ -61,10 +72,18 @@ osd_t::osd_t(const json11::Json & config, ring_loop_t *ringloop)
     {
         print_slow();
     });
+    if (recovery_tune_interval > 0)
+    {
+        this->tfd->set_timer(recovery_tune_interval*1000, true, [this](int timer_id)
+        {
+            tune_recovery();
+        });
+    }
 
     msgr.tfd = this->tfd;
     msgr.ringloop = this->ringloop;
     msgr.exec_op = [this](osd_op_t *op) { exec_op(op); };
+    msgr.qos_delay = [this](osd_op_t *op) { return qos_delay_op(op); };
     msgr.repeer_pgs = [this](osd_num_t peer_osd) { repeer_pgs(peer_osd); };
     msgr.init();
 
@@ -116,6 +135,8 @@ void osd_t::parse_config(const json11::Json & config)
     run_primary = config["run_primary"] != "false" && config["run_primary"] != "0" && config["run_primary"] != "no";
     no_rebalance = config["no_rebalance"] == "true" || config["no_rebalance"] == "1" || config["no_rebalance"] == "yes";
     no_recovery = config["no_recovery"] == "true" || config["no_recovery"] == "1" || config["no_recovery"] == "yes";
+    detect_zero_writes = config["detect_zero_writes"] == "true" || config["detect_zero_writes"] == "1" || config["detect_zero_writes"] == "yes";
+    balanced_reads = config["balanced_reads"] == "true" || config["balanced_reads"] == "1" || config["balanced_reads"] == "yes";
     allow_test_ops = config["allow_test_ops"] == "true" || config["allow_test_ops"] == "1" || config["allow_test_ops"] == "yes";
     if (config["immediate_commit"] == "all")
         immediate_commit = IMMEDIATE_ALL;
@@ -135,18 +156,44 @@ void osd_t::parse_config(const json11::Json & config)
         // Allow to set it to 0
         autosync_writes = config["autosync_writes"].uint64_value();
     }
-    if (!config["client_queue_depth"].is_null())
-    {
-        client_queue_depth = config["client_queue_depth"].uint64_value();
-        if (client_queue_depth < 128)
-            client_queue_depth = 128;
-    }
     recovery_queue_depth = config["recovery_queue_depth"].uint64_value();
     if (recovery_queue_depth < 1 || recovery_queue_depth > MAX_RECOVERY_QUEUE)
         recovery_queue_depth = DEFAULT_RECOVERY_QUEUE;
     recovery_sync_batch = config["recovery_sync_batch"].uint64_value();
     if (recovery_sync_batch < 1 || recovery_sync_batch > MAX_RECOVERY_QUEUE)
         recovery_sync_batch = DEFAULT_RECOVERY_BATCH;
+    recovery_target_depth[0] = recovery_target_depth[1] = recovery_queue_depth;
+    if (!config["recovery_tune_interval"].is_null())
+    {
+        // Allow to set it to 0 (use fixed recovery_queue_depth)
+        recovery_tune_interval = config["recovery_tune_interval"].uint64_value();
+    }
+    recovery_tune_latency_us = config["recovery_tune_latency_us"].uint64_value();
+    if (!recovery_tune_latency_us)
+        recovery_tune_latency_us = DEFAULT_RECOVERY_TUNE_LATENCY;
+    recovery_tune_queue_depth = config["recovery_tune_queue_depth"].uint64_value();
+    if (!recovery_tune_queue_depth)
+        recovery_tune_queue_depth = DEFAULT_RECOVERY_TUNE_QUEUE;
+    recovery_max_mbs = config["recovery_max_mbs"].uint64_value();
+    if (!config["qos_burst_ms"].is_null())
+        qos_burst_us = config["qos_burst_ms"].uint64_value()*1000;
+    if (!config["peering_list_limit"].is_null())
+    {
+        // Allow to set it to 0 (list whole PGs at once)
+        peering_list_limit = config["peering_list_limit"].uint64_value();
+        if (peering_list_limit > 0 && peering_list_limit < MIN_PEERING_LIST_LIMIT)
+            peering_list_limit = MIN_PEERING_LIST_LIMIT;
+    }
+    if (!config["peering_pg_limit"].is_null())
+    {
+        // 0 means no limit
+        peering_pg_limit = config["peering_pg_limit"].uint64_value();
+    }
+    if (!config["peering_log_size"].is_null())
+    {
+        // 0 disables PG logs and incremental peering
+        peering_log_size = config["peering_log_size"].uint64_value();
+    }
     print_stats_interval = config["print_stats_interval"].uint64_value();
     if (!print_stats_interval)
         print_stats_interval = 3;
@@ -227,10 +274,15 @@ void osd_t::bind_socket()
 
     fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
 
-    epmgr->set_fd_handler(listen_fd, false, [this](int fd, int events)
+    if (!msgr.accept_multishot(listen_fd))
     {
-        msgr.accept_connections(listen_fd);
-    });
+        epmgr->set_fd_handler(listen_fd, false, [this](int fd, int events)
+        {
+            msgr.accept_connections(listen_fd);
+        });
+    }
+
+    msgr.listen_shm();
 }
 
 bool osd_t::shutdown()
@@ -282,6 +334,13 @@ void osd_t::exec_op(osd_op_t *cur_op)
         finish_op(cur_op, -EINVAL);
         return;
     }
+    if (cur_op->peer_fd && (cur_op->req.hdr.opcode == OSD_OP_READ ||
+        cur_op->req.hdr.opcode == OSD_OP_WRITE ||
+        cur_op->req.hdr.opcode == OSD_OP_DELETE))
+    {
+        // Only internal operations may use non-client priority classes
+        cur_op->req.rw.flags &= ~OSD_OP_RW_PRIO_MASK;
+    }
     if (cur_op->req.hdr.opcode == OSD_OP_PING)
     {
         // Pong
@@ -291,6 +350,7 @@ void osd_t::exec_op(osd_op_t *cur_op)
     if (readonly &&
         cur_op->req.hdr.opcode != OSD_OP_SEC_READ &&
         cur_op->req.hdr.opcode != OSD_OP_SEC_LIST &&
+        cur_op->req.hdr.opcode != OSD_OP_SEC_GET_LOG &&
         cur_op->req.hdr.opcode != OSD_OP_READ &&
         cur_op->req.hdr.opcode != OSD_OP_SEC_READ_BMP &&
         cur_op->req.hdr.opcode != OSD_OP_SHOW_CONFIG)
@@ -323,6 +383,10 @@ void osd_t::exec_op(osd_op_t *cur_op)
     {
         continue_primary_del(cur_op);
     }
+    else if (cur_op->req.hdr.opcode == OSD_OP_DELETE_INODE)
+    {
+        continue_primary_del_inode(cur_op);
+    }
     else
     {
         exec_secondary(cur_op);
@@ -335,6 +399,8 @@ void osd_t::reset_stats()
     prev_stats = {};
     memset(recovery_stat_count, 0, sizeof(recovery_stat_count));
     memset(recovery_stat_bytes, 0, sizeof(recovery_stat_bytes));
+    memset(stab_stat_count, 0, sizeof(stab_stat_count));
+    memset(stab_stat_objects, 0, sizeof(stab_stat_objects));
 }
 
 void osd_t::print_stats()
@@ -387,6 +453,28 @@ void osd_t::print_stats()
             recovery_stat_bytes[1][i] = recovery_stat_bytes[0][i];
         }
     }
+    if (stab_stat_count[0] != stab_stat_count[1])
+    {
+        printf(
+            "[OSD %lu] stabilize: %.1f msg/s, %.1f objects/msg\n", osd_num,
+            (stab_stat_count[0] - stab_stat_count[1]) * 1.0 / print_stats_interval,
+            (stab_stat_objects[0] - stab_stat_objects[1]) * 1.0 / (stab_stat_count[0] - stab_stat_count[1])
+        );
+        stab_stat_count[1] = stab_stat_count[0];
+        stab_stat_objects[1] = stab_stat_objects[0];
+    }
+    if (msgr.stats.zerocopy_send_bytes != prev_stats.zerocopy_send_bytes)
+    {
+        uint64_t bw = (msgr.stats.zerocopy_send_bytes - prev_stats.zerocopy_send_bytes) / print_stats_interval;
+        printf(
+            "[OSD %lu] zero-copy send: %.2f %s, %lu send(s) copied by the kernel\n", osd_num,
+            (bw > 1024*1024*1024 ? bw/1024.0/1024/1024 : (bw > 1024*1024 ? bw/1024.0/1024 : bw/1024.0)),
+            (bw > 1024*1024*1024 ? "GB/s" : (bw > 1024*1024 ? "MB/s" : "KB/s")),
+            msgr.stats.zerocopy_copied_sends - prev_stats.zerocopy_copied_sends
+        );
+        prev_stats.zerocopy_send_bytes = msgr.stats.zerocopy_send_bytes;
+        prev_stats.zerocopy_copied_sends = msgr.stats.zerocopy_copied_sends;
+    }
     if (incomplete_objects > 0)
     {
         printf("[OSD %lu] %lu object(s) incomplete\n", osd_num, incomplete_objects);
@@ -459,17 +547,40 @@ void osd_t::print_slow()
                         op->req.sec_list.list_pg, op->req.sec_list.pg_count,
                         op->req.sec_list.pg_stripe_size
                     );
+                    if (op->req.sec_list.stable_limit)
+                    {
+                        bufprintf(
+                            " from=%lx:%lx limit=%u", op->req.sec_list.cursor.inode,
+                            op->req.sec_list.cursor.stripe, op->req.sec_list.stable_limit
+                        );
+                    }
                 }
                 else if (op->req.hdr.opcode == OSD_OP_READ || op->req.hdr.opcode == OSD_OP_WRITE ||
                     op->req.hdr.opcode == OSD_OP_DELETE)
                 {
                     bufprintf(" inode=%lx offset=%lx len=%x", op->req.rw.inode, op->req.rw.offset, op->req.rw.len);
                 }
+                else if (op->req.hdr.opcode == OSD_OP_SEC_DELETE_INODE)
+                {
+                    bufprintf(
+                        " inode=%lx pg=%u/%u, stripe=%lu from=%lx:%lx",
+                        op->req.sec_del_inode.inode, op->req.sec_del_inode.del_pg,
+                        op->req.sec_del_inode.pg_count, op->req.sec_del_inode.pg_stripe_size,
+                        op->req.sec_del_inode.cursor.inode, op->req.sec_del_inode.cursor.stripe
+                    );
+                }
+                else if (op->req.hdr.opcode == OSD_OP_DELETE_INODE)
+                {
+                    bufprintf(
+                        " inode=%lx pg=%u min_offset=%lx", op->req.del_inode.inode,
+                        op->req.del_inode.pg_num, op->req.del_inode.min_offset
+                    );
+                }
                 if (op->req.hdr.opcode == OSD_OP_SEC_READ || op->req.hdr.opcode == OSD_OP_SEC_WRITE ||
                     op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE || op->req.hdr.opcode == OSD_OP_SEC_DELETE ||
                     op->req.hdr.opcode == OSD_OP_SEC_SYNC || op->req.hdr.opcode == OSD_OP_SEC_LIST ||
                     op->req.hdr.opcode == OSD_OP_SEC_STABILIZE || op->req.hdr.opcode == OSD_OP_SEC_ROLLBACK ||
-                    op->req.hdr.opcode == OSD_OP_SEC_READ_BMP)
+                    op->req.hdr.opcode == OSD_OP_SEC_READ_BMP || op->req.hdr.opcode == OSD_OP_SEC_DELETE_INODE)
                 {
                     bufprintf(" state=%d", PRIV(op->bs_op)->op_state);
                     int wait_for = PRIV(op->bs_op)->wait_for;
@@ -479,7 +590,8 @@ void osd_t::print_slow()
                     }
                 }
                 else if (op->req.hdr.opcode == OSD_OP_READ || op->req.hdr.opcode == OSD_OP_WRITE ||
-                    op->req.hdr.opcode == OSD_OP_SYNC || op->req.hdr.opcode == OSD_OP_DELETE)
+                    op->req.hdr.opcode == OSD_OP_SYNC || op->req.hdr.opcode == OSD_OP_DELETE ||
+                    op->req.hdr.opcode == OSD_OP_DELETE_INODE)
                 {
                     bufprintf(" state=%d", !op->op_data ? -1 : op->op_data->st);
                 }
@@ -38,7 +38,14 @@
 #define DEFAULT_AUTOSYNC_WRITES 128
 #define MAX_RECOVERY_QUEUE 2048
 #define DEFAULT_RECOVERY_QUEUE 4
+#define DEFAULT_RECOVERY_TUNE_LATENCY 10000
+#define DEFAULT_RECOVERY_TUNE_QUEUE 64
 #define DEFAULT_RECOVERY_BATCH 16
+#define DEFAULT_PEERING_LIST_LIMIT 262144
+#define DEFAULT_PEERING_LOG_SIZE 1024
+#define DEFAULT_PEERING_PG_LIMIT 16
+#define DEFAULT_QOS_BURST_MS 100
+#define MIN_PEERING_LIST_LIMIT 8192
 
 //#define OSD_STUB
 
@@ -65,6 +72,28 @@ struct inode_stats_t
     uint64_t op_sum[3] = { 0 };
     uint64_t op_count[3] = { 0 };
     uint64_t op_bytes[3] = { 0 };
+    // Time spent waiting for QoS limits
+    uint64_t op_qos_usec[3] = { 0 };
+};
+
+// GCRA state of a QoS limit: theoretical arrival times in microseconds
+struct osd_qos_bucket_t
+{
+    uint64_t iops_tat = 0, bytes_tat = 0;
+};
+
+struct osd_stab_wait_t
+{
+    osd_op_t *subop, *cur_op;
+};
+
+// STABILIZE requests to one OSD are merged while a previous one is in flight
+struct osd_stab_batch_t
+{
+    std::vector<obj_ver_id> versions;
+    std::vector<osd_stab_wait_t> waiting;
+    uint32_t priority = OSD_OP_PRIO_BACKGROUND;
+    bool in_flight = false;
 };
 
 struct bitmap_request_t
@@ -80,6 +109,15 @@ inline bool operator < (const bitmap_request_t & a, const bitmap_request_t & b)
     return a.osd_num < b.osd_num || a.osd_num == b.osd_num && a.oid < b.oid;
 }
 
+// Recent object modifications of one PG on this OSD, in the order of completion
+struct osd_pg_log_t
+{
+    // entries before this position are lost
+    uint64_t valid_from = 0;
+    std::deque<uint64_t> positions;
+    std::deque<osd_pg_log_entry_t> entries;
+};
+
 struct osd_chain_read_t
 {
     int chain_pos;
@@ -101,10 +139,10 @@ class osd_t
     bool run_primary = false;
     bool no_rebalance = false;
     bool no_recovery = false;
+    bool detect_zero_writes = false;
+    bool balanced_reads = false;
     std::string bind_address;
     int bind_port, listen_backlog = 128;
-    // FIXME: Implement client queue depth limit
-    int client_queue_depth = 128;
     bool allow_test_ops = false;
     int print_stats_interval = 3;
     int slow_log_interval = 10;
@@ -113,6 +151,14 @@ class osd_t
     int autosync_writes = DEFAULT_AUTOSYNC_WRITES;
     int recovery_queue_depth = DEFAULT_RECOVERY_QUEUE;
     int recovery_sync_batch = DEFAULT_RECOVERY_BATCH;
+    int recovery_tune_interval = 1;
+    uint64_t recovery_tune_latency_us = DEFAULT_RECOVERY_TUNE_LATENCY;
+    uint64_t recovery_tune_queue_depth = DEFAULT_RECOVERY_TUNE_QUEUE;
+    uint64_t recovery_max_mbs = 0;
+    uint32_t peering_list_limit = DEFAULT_PEERING_LIST_LIMIT;
+    uint64_t peering_log_size = DEFAULT_PEERING_LOG_SIZE;
+    uint64_t peering_pg_limit = DEFAULT_PEERING_PG_LIMIT;
+    uint64_t qos_burst_us = DEFAULT_QOS_BURST_MS*1000;
     int log_level = 0;
 
     // cluster state
@@ -137,14 +183,40 @@ class osd_t
     int copies_to_delete_after_sync_count = 0;
     uint64_t misplaced_objects = 0, degraded_objects = 0, incomplete_objects = 0;
     int peering_state = 0;
+    // PGs listing objects now and PGs waiting for their turn. PGs wanted by clients go first
+    std::set<pool_pg_num_t> peering_pgs;
+    std::deque<pool_pg_num_t> peering_queue, peering_wanted_queue;
+    timespec start_time = {}, peering_round_start = {};
+    uint64_t peering_round_pgs = 0;
+    bool startup_peering_done = false;
     std::map<object_id, osd_recovery_op_t> recovery_ops;
+    // PGs which may have objects to recover or rebalance. Cleaned up lazily in pick_next_recovery()
+    std::set<pool_pg_num_t> recovery_pgs;
     int recovery_done = 0;
+    // Current concurrency limits and running recovery operations, [0] = degraded, [1] = misplaced
+    int recovery_target_depth[2] = {};
+    int recovery_op_count[2] = {};
+    // Client op count, client op latency sum and recovery bytes at the previous tuning
+    uint64_t recovery_tune_prev[3] = {};
     osd_op_t *autosync_op = NULL;
 
     // Unstable writes
     uint64_t unstable_write_count = 0;
     std::map<osd_object_id_t, uint64_t> unstable_writes;
     std::deque<osd_op_t*> syncs_in_progress;
+    std::map<osd_num_t, osd_stab_batch_t> stab_batches;
+
+    // PG logs for incremental peering. They are kept in memory, so pg_log_id differs after restart.
+    // Logs of PGs without entries are valid from pg_log_valid_from
+    uint64_t pg_log_id = 0, pg_log_pos = 0, pg_log_valid_from = 0;
+    std::map<pool_pg_num_t, osd_pg_log_t> pg_logs;
+
+    // Balanced reads in flight to each OSD
+    std::map<osd_num_t, int> balanced_read_count;
+
+    // QoS token buckets of inodes and pools
+    std::map<inode_t, osd_qos_bucket_t> inode_qos;
+    std::map<pool_id_t, osd_qos_bucket_t> pool_qos;
 
     // client & peer I/O
 
@@ -168,6 +240,8 @@ class osd_t
     const char* recovery_stat_names[2] = { "degraded", "misplaced" };
     uint64_t recovery_stat_count[2][2] = {};
     uint64_t recovery_stat_bytes[2][2] = {};
+    // STABILIZE messages sent and objects in them, [0] = current, [1] = last printed
+    uint64_t stab_stat_count[2] = {}, stab_stat_objects[2] = {};
 
     // cluster connection
     void parse_config(const json11::Json & config);
@@ -201,9 +275,18 @@ class osd_t
     void handle_peers();
     void repeer_pgs(osd_num_t osd_num);
     void start_pg_peering(pg_t & pg);
+    void submit_peering_subops(pg_t & pg);
+    void finish_pg_peering_slot(pg_t & pg);
+    void want_pg_peering(pg_t & pg);
+    void report_peering_time();
     void submit_sync_and_list_subop(osd_num_t role_osd, pg_peering_state_t *ps);
     void submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps);
+    void submit_get_log_subop(osd_num_t role_osd, pg_peering_state_t *ps);
     void discard_list_subop(osd_op_t *list_op);
+    bool start_incremental_peering(pg_t & pg);
+    void restart_full_peering(pg_t & pg);
+    void update_pg_log_base(pg_t & pg);
+    void free_peering_logs(pg_peering_state_t *ps);
     bool stop_pg(pg_t & pg);
     void reset_pg(pg_t & pg);
     void finish_stop_pg(pg_t & pg);
@@ -212,33 +295,49 @@ class osd_t
     void submit_pg_flush_ops(pg_t & pg);
     void handle_flush_op(bool rollback, pool_id_t pool_id, pg_num_t pg_num, pg_flush_batch_t *fb, osd_num_t peer_osd, int retval);
     void submit_flush_op(pool_id_t pool_id, pg_num_t pg_num, pg_flush_batch_t *fb, bool rollback, osd_num_t peer_osd, int count, obj_ver_id *data);
-    bool pick_next_recovery(osd_recovery_op_t &op);
+    bool pick_next_recovery(osd_recovery_op_t &op, bool allow_degraded, bool allow_misplaced);
     void submit_recovery_op(osd_recovery_op_t *op);
     bool continue_recovery();
+    void tune_recovery();
     pg_osd_set_state_t* change_osd_set(pg_osd_set_state_t *st, pg_t *pg);
 
     // op execution
     void exec_op(osd_op_t *cur_op);
+    uint64_t qos_delay_op(osd_op_t *cur_op);
     void finish_op(osd_op_t *cur_op, int retval);
+    int get_op_priority(osd_op_t *cur_op);
+
+    // PG logs
+    void append_pg_log(blockstore_op_t *bs_op);
+    void add_pg_log_entry(object_id oid, uint64_t opcode, uint64_t version, uint64_t prev_version);
+    void clear_pg_logs(pool_id_t pool_id);
+    int read_pg_log(pool_id_t pool_id, pg_num_t pg_num, pg_num_t pg_count, uint64_t log_id, uint64_t log_pos, osd_pg_log_entry_t **entries);
 
     // secondary ops
     void exec_sync_stab_all(osd_op_t *cur_op);
     void exec_show_config(osd_op_t *cur_op);
     void exec_secondary(osd_op_t *cur_op);
+    bool check_direct_read(osd_op_t *cur_op);
     void secondary_op_callback(osd_op_t *cur_op);
 
     // primary ops
     void autosync();
     bool prepare_primary_rw(osd_op_t *cur_op);
     void continue_primary_read(osd_op_t *cur_op);
+    osd_num_t pick_balanced_read_osd(pg_t & pg, object_id & oid);
     void continue_primary_write(osd_op_t *cur_op);
     void cancel_primary_write(osd_op_t *cur_op);
     void continue_primary_sync(osd_op_t *cur_op);
     void continue_primary_del(osd_op_t *cur_op);
+    void continue_primary_del_inode(osd_op_t *cur_op);
+    bool prepare_primary_del_inode(osd_op_t *cur_op);
     bool check_write_queue(osd_op_t *cur_op, pg_t & pg);
+    void coalesce_writes(osd_op_t *cur_op, pg_t & pg);
     void remove_object_from_state(object_id & oid, pg_osd_set_state_t *object_state, pg_t &pg);
     void free_object_state(pg_t & pg, pg_osd_set_state_t **object_state);
     bool remember_unstable_write(osd_op_t *cur_op, pg_t & pg, pg_osd_set_t & loc_set, int base_state);
+    bool check_zero_write(osd_op_t *cur_op, pg_t & pg);
+    void remember_zero_delete(osd_op_t *cur_op, pg_t & pg, pg_osd_set_t & loc_set);
     void handle_primary_subop(osd_op_t *subop, osd_op_t *cur_op);
     void handle_primary_bs_subop(osd_op_t *subop);
     void add_bs_subop_stats(osd_op_t *subop);
@@ -249,8 +348,11 @@ class osd_t
         osd_rmw_stripe_t *stripes, const uint64_t* osd_set, osd_op_t *cur_op, int subop_idx, int zero_read);
     void submit_primary_del_subops(osd_op_t *cur_op, uint64_t *cur_set, uint64_t set_size, pg_osd_set_t & loc_set);
     void submit_primary_del_batch(osd_op_t *cur_op, obj_ver_osd_t *chunks_to_delete, int chunks_to_delete_count);
+    int submit_primary_del_inode_subops(osd_op_t *cur_op, pg_t & pg);
     int submit_primary_sync_subops(osd_op_t *cur_op);
     void submit_primary_stab_subops(osd_op_t *cur_op);
+    void submit_stab_batch(osd_num_t peer_osd);
+    void handle_stab_batch(osd_num_t peer_osd, std::vector<osd_stab_wait_t> & waiting, int retval);
 
     uint64_t* get_object_osd_set(pg_t &pg, object_id &oid, uint64_t *def, pg_osd_set_state_t **object_state);
 
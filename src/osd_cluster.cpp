@@ -171,6 +171,14 @@ json11::Json osd_t::get_statistics()
             { "bytes", recovery_stat_bytes[0][1] },
         } },
     };
+    st["zerocopy_send_stats"] = json11::Json::object {
+        { "bytes", msgr.stats.zerocopy_send_bytes },
+        { "copied_sends", msgr.stats.zerocopy_copied_sends },
+    };
+    st["stabilize_stats"] = json11::Json::object {
+        { "count", stab_stat_count[0] },
+        { "objects", stab_stat_objects[0] },
+    };
     return st;
 }
 
@@ -220,11 +228,13 @@ void osd_t::report_statistics()
                 { "count", kv.second.op_count[INODE_STATS_READ] },
                 { "usec", kv.second.op_sum[INODE_STATS_READ] },
                 { "bytes", kv.second.op_bytes[INODE_STATS_READ] },
+                { "qos_usec", kv.second.op_qos_usec[INODE_STATS_READ] },
             } },
             { "write", json11::Json::object {
                 { "count", kv.second.op_count[INODE_STATS_WRITE] },
                 { "usec", kv.second.op_sum[INODE_STATS_WRITE] },
                 { "bytes", kv.second.op_bytes[INODE_STATS_WRITE] },
+                { "qos_usec", kv.second.op_qos_usec[INODE_STATS_WRITE] },
             } },
             { "delete", json11::Json::object {
                 { "count", kv.second.op_count[INODE_STATS_DELETE] },
@@ -333,7 +343,10 @@ void osd_t::on_change_pg_history_hook(pool_id_t pool_id, pg_num_t pg_num)
             {
                 oid = op.first;
                 first = false;
-                continue_primary_write(op.second);
+                if (op.second->req.hdr.opcode == OSD_OP_DELETE_INODE)
+                    continue_primary_del_inode(op.second);
+                else
+                    continue_primary_write(op.second);
             }
         }
     }
@@ -563,6 +576,11 @@ void osd_t::apply_pg_count()
                 return;
             }
         }
+        if (pool_item.second.real_pg_count != pg_counts[pool_item.first])
+        {
+            // PG logs are split by PG
+            clear_pg_logs(pool_item.first);
+        }
         this->pg_counts[pool_item.first] = pool_item.second.real_pg_count;
     }
 }
@@ -788,6 +806,7 @@ void osd_t::report_pg_states()
                         { "primary", this->osd_num },
                         { "state", pg_state_keywords },
                         { "peers", pg.cur_peers },
+                        { "cur_set", pg.cur_set },
                     }).dump()) },
                     { "lease", etcd_lease_id },
                 } }
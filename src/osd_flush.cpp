@@ -175,6 +175,8 @@ void osd_t::submit_flush_op(pool_id_t pool_id, pg_num_t pg_num, pg_flush_batch_t
             .callback = [this, op, pool_id, pg_num, fb](blockstore_op_t *bs_op)
             {
                 add_bs_subop_stats(op);
+                if (bs_op->retval == 0)
+                    append_pg_log(bs_op);
                 handle_flush_op(bs_op->opcode == BS_OP_ROLLBACK, pool_id, pg_num, fb, this->osd_num, bs_op->retval);
                 delete op->bs_op;
                 op->bs_op = NULL;
@@ -182,6 +184,7 @@ void osd_t::submit_flush_op(pool_id_t pool_id, pg_num_t pg_num, pg_flush_batch_t
             },
             .len = (uint32_t)count,
             .buf = op->buf,
+            .priority = BS_PRIO_BACKGROUND,
         });
         bs->enqueue_op(op->bs_op);
     }
@@ -200,6 +203,7 @@ void osd_t::submit_flush_op(pool_id_t pool_id, pg_num_t pg_num, pg_flush_batch_t
                     .opcode = (uint64_t)(rollback ? OSD_OP_SEC_ROLLBACK : OSD_OP_SEC_STABILIZE),
                 },
                 .len = count * sizeof(obj_ver_id),
+                .priority = OSD_OP_PRIO_BACKGROUND,
             },
         };
         op->callback = [this, pool_id, pg_num, fb, peer_osd](osd_op_t *op)
@@ -211,42 +215,60 @@ void osd_t::submit_flush_op(pool_id_t pool_id, pg_num_t pg_num, pg_flush_batch_t
     }
 }
 
-bool osd_t::pick_next_recovery(osd_recovery_op_t &op)
+// Pick the first object after the cursor which isn't being recovered yet, wrapping around once.
+// Objects before the cursor are either being recovered or have failed recovery,
+// so usually the first object after the cursor is picked immediately
+static bool pick_from_cursor(pg_obj_state_map_t & objects, object_id & cursor,
+    std::map<object_id, osd_recovery_op_t> & recovery_ops, object_id & oid)
 {
-    if (!no_recovery)
+    size_t start = objects.lower_bound(cursor), pos = start;
+    for (int pass = 0; pass < 2; pass++)
     {
-        for (auto pg_it = pgs.begin(); pg_it != pgs.end(); pg_it++)
+        size_t end = pass == 0 ? objects.items.size() : start;
+        for (; pos < end; pos = objects.next(pos+1))
         {
-            if ((pg_it->second.state & (PG_ACTIVE | PG_HAS_DEGRADED)) == (PG_ACTIVE | PG_HAS_DEGRADED))
+            if (recovery_ops.find(objects.items[pos].oid) == recovery_ops.end())
             {
-                for (auto obj_it = pg_it->second.degraded_objects.begin(); obj_it != pg_it->second.degraded_objects.end(); obj_it++)
-                {
-                    if (recovery_ops.find(obj_it->first) == recovery_ops.end())
-                    {
-                        op.degraded = true;
-                        op.oid = obj_it->first;
-                        return true;
-                    }
-                }
+                oid = objects.items[pos].oid;
+                cursor = (object_id){ .inode = oid.inode, .stripe = oid.stripe+1 };
+                return true;
             }
         }
+        pos = objects.next(0);
+    }
+    return false;
+}
+
+bool osd_t::pick_next_recovery(osd_recovery_op_t &op, bool allow_degraded, bool allow_misplaced)
+{
+    for (auto pg_it = recovery_pgs.begin(); pg_it != recovery_pgs.end(); )
+    {
+        auto p_it = pgs.find(*pg_it);
+        if (p_it == pgs.end() || !(p_it->second.state & (PG_HAS_DEGRADED | PG_HAS_MISPLACED)))
+        {
+            // PG is stopped, repeered or has nothing to recover anymore
+            recovery_pgs.erase(pg_it++);
+            continue;
+        }
+        if (allow_degraded && !no_recovery && (p_it->second.state & (PG_ACTIVE | PG_HAS_DEGRADED)) == (PG_ACTIVE | PG_HAS_DEGRADED) &&
+            pick_from_cursor(p_it->second.degraded_objects, p_it->second.degraded_cursor, recovery_ops, op.oid))
+        {
+            op.degraded = true;
+            return true;
+        }
+        pg_it++;
     }
-    if (!no_rebalance)
+    if (allow_misplaced && !no_rebalance)
     {
-        for (auto pg_it = pgs.begin(); pg_it != pgs.end(); pg_it++)
+        for (auto pg_id: recovery_pgs)
         {
+            auto & pg = pgs.at(pg_id);
             // Don't try to "recover" misplaced objects if "recovery" would make them degraded
-            if ((pg_it->second.state & (PG_ACTIVE | PG_DEGRADED | PG_HAS_MISPLACED)) == (PG_ACTIVE | PG_HAS_MISPLACED))
+            if ((pg.state & (PG_ACTIVE | PG_DEGRADED | PG_HAS_MISPLACED)) == (PG_ACTIVE | PG_HAS_MISPLACED) &&
+                pick_from_cursor(pg.misplaced_objects, pg.misplaced_cursor, recovery_ops, op.oid))
             {
-                for (auto obj_it = pg_it->second.misplaced_objects.begin(); obj_it != pg_it->second.misplaced_objects.end(); obj_it++)
-                {
-                    if (recovery_ops.find(obj_it->first) == recovery_ops.end())
-                    {
-                        op.degraded = false;
-                        op.oid = obj_it->first;
-                        return true;
-                    }
-                }
+                op.degraded = false;
+                return true;
             }
         }
     }
@@ -267,6 +289,7 @@ void osd_t::submit_recovery_op(osd_recovery_op_t *op)
             .inode = op->oid.inode,
             .offset = op->oid.stripe,
             .len = 0,
+            .flags = (uint32_t)(op->degraded ? OSD_OP_PRIO_RECOVERY : OSD_OP_PRIO_REBALANCE),
         },
     };
     if (log_level > 2)
@@ -294,6 +317,7 @@ void osd_t::submit_recovery_op(osd_recovery_op_t *op)
         }
         // CAREFUL! op = &recovery_ops[op->oid]. Don't access op->* after recovery_ops.erase()
         op->osd_op = NULL;
+        recovery_op_count[op->degraded ? 0 : 1]--;
         recovery_ops.erase(op->oid);
         delete osd_op;
         if (immediate_commit != IMMEDIATE_ALL)
@@ -313,18 +337,97 @@ void osd_t::submit_recovery_op(osd_recovery_op_t *op)
 }
 
 // Just trigger write requests for degraded objects. They'll be recovered during writing
+// Degraded and misplaced objects have separate concurrency limits, and their total
+// is still limited by recovery_queue_depth
 bool osd_t::continue_recovery()
 {
     while (recovery_ops.size() < recovery_queue_depth)
     {
-        osd_recovery_op_t op;
-        if (pick_next_recovery(op))
+        bool allow_degraded = recovery_op_count[0] < recovery_target_depth[0];
+        bool allow_misplaced = recovery_op_count[1] < recovery_target_depth[1];
+        if (!allow_degraded && !allow_misplaced)
         {
-            recovery_ops[op.oid] = op;
-            submit_recovery_op(&recovery_ops[op.oid]);
+            return true;
         }
-        else
+        osd_recovery_op_t op;
+        if (!pick_next_recovery(op, allow_degraded, allow_misplaced))
+        {
             return false;
+        }
+        recovery_op_count[op.degraded ? 0 : 1]++;
+        recovery_ops[op.oid] = op;
+        submit_recovery_op(&recovery_ops[op.oid]);
     }
     return true;
 }
+
+// Adjust recovery concurrency based on client operation latency and blockstore queue depth:
+// - when clients are idle, allow up to recovery_queue_depth operations of each kind (in total
+//   they are still limited by recovery_queue_depth)
+// - when client latency or disk queue depth is above the target, halve rebalance concurrency
+//   first, then recovery concurrency, but always keep at least 1 operation of each kind running
+// - otherwise increase recovery concurrency by 1, then rebalance concurrency
+// - optionally halve both (down to 0) when recovery bandwidth exceeds recovery_max_mbs
+void osd_t::tune_recovery()
+{
+    // msgr.stats only count operations replied to clients, recovery operations are completed
+    // through callbacks and never get there
+    const int client_ops[] = { OSD_OP_READ, OSD_OP_WRITE, OSD_OP_SYNC, OSD_OP_DELETE };
+    uint64_t op_count = 0, op_sum = 0;
+    for (int opcode: client_ops)
+    {
+        op_count += msgr.stats.op_stat_count[opcode];
+        op_sum += msgr.stats.op_stat_sum[opcode];
+    }
+    uint64_t recovery_bytes = recovery_stat_bytes[0][0] + recovery_stat_bytes[0][1];
+    // Stats may be reset in the meantime
+    uint64_t d_count = op_count >= recovery_tune_prev[0] ? op_count - recovery_tune_prev[0] : op_count;
+    uint64_t d_sum = op_sum >= recovery_tune_prev[1] ? op_sum - recovery_tune_prev[1] : op_sum;
+    uint64_t d_bytes = recovery_bytes >= recovery_tune_prev[2] ? recovery_bytes - recovery_tune_prev[2] : recovery_bytes;
+    recovery_tune_prev[0] = op_count;
+    recovery_tune_prev[1] = op_sum;
+    recovery_tune_prev[2] = recovery_bytes;
+    uint64_t avg_latency = d_count ? d_sum/d_count : 0;
+    int prev_depth[2] = { recovery_target_depth[0], recovery_target_depth[1] };
+    if (recovery_max_mbs > 0 && d_bytes > recovery_max_mbs*1024*1024*recovery_tune_interval)
+    {
+        recovery_target_depth[0] /= 2;
+        recovery_target_depth[1] /= 2;
+    }
+    else if (avg_latency > recovery_tune_latency_us || bs->get_queue_depth() > recovery_tune_queue_depth)
+    {
+        if (recovery_target_depth[1] > 1)
+            recovery_target_depth[1] /= 2;
+        else if (recovery_target_depth[0] > 1)
+            recovery_target_depth[0] /= 2;
+        recovery_target_depth[0] = recovery_target_depth[0] < 1 ? 1 : recovery_target_depth[0];
+        recovery_target_depth[1] = recovery_target_depth[1] < 1 ? 1 : recovery_target_depth[1];
+    }
+    else if (!d_count && !recovery_max_mbs)
+    {
+        recovery_target_depth[0] = recovery_target_depth[1] = recovery_queue_depth;
+    }
+    else
+    {
+        if (recovery_target_depth[0] < recovery_queue_depth)
+            recovery_target_depth[0]++;
+        else if (recovery_target_depth[1] < recovery_queue_depth)
+            recovery_target_depth[1]++;
+        if (!recovery_target_depth[1])
+            recovery_target_depth[1] = 1;
+    }
+    if (prev_depth[0] != recovery_target_depth[0] || prev_depth[1] != recovery_target_depth[1])
+    {
+        if (log_level > 2)
+        {
+            printf(
+                "[OSD %lu] Recovery concurrency changed to %d degraded + %d misplaced (client latency %lu us)\n",
+                osd_num, recovery_target_depth[0], recovery_target_depth[1], avg_latency
+            );
+        }
+        if ((peering_state & OSD_RECOVERING) && !readonly)
+        {
+            continue_recovery();
+        }
+    }
+}
@@ -21,4 +21,7 @@ const char* osd_op_names[] = {
     "primary_delete",
     "ping",
     "sec_read_bmp",
+    "sec_delete_inode",
+    "primary_delete_inode",
+    "sec_get_log",
 };
@@ -29,13 +29,23 @@
 #define OSD_OP_DELETE               14
 #define OSD_OP_PING                 15
 #define OSD_OP_SEC_READ_BMP         16
-#define OSD_OP_MAX                  16
+#define OSD_OP_SEC_DELETE_INODE     17
+#define OSD_OP_DELETE_INODE         18
+#define OSD_OP_SEC_GET_LOG          19
+#define OSD_OP_MAX                  19
 // Alignment & limit for read/write operations
 #ifndef MEM_ALIGNMENT
 #define MEM_ALIGNMENT               512
 #endif
 #define OSD_RW_MAX                  64*1024*1024
 #define OSD_PROTOCOL_VERSION        1
+// Operation priority classes, same as BS_PRIO_* in blockstore.h
+#define OSD_OP_PRIO_CLIENT          0
+#define OSD_OP_PRIO_RECOVERY        1
+#define OSD_OP_PRIO_REBALANCE       2
+#define OSD_OP_PRIO_BACKGROUND      3
+// Priority class is stored in the lowest bits of osd_op_rw_t::flags
+#define OSD_OP_RW_PRIO_MASK         3
 
 // common request and reply headers
 struct __attribute__((__packed__)) osd_op_header_t
@@ -75,7 +85,13 @@ struct __attribute__((__packed__)) osd_op_sec_rw_t
     uint32_t len;
     // bitmap/attribute length - bitmap comes after header, but before data
     uint32_t attr_len;
-    uint32_t pad0;
+    // priority class (OSD_OP_PRIO_*)
+    uint32_t priority;
+    // for direct reads from clients: PG primary and PG state revision seen by the client,
+    // the read is refused with -EPIPE if the OSD sees a different PG state, and with -EAGAIN
+    // if the object has unstable or in-progress writes. 0 = don't check
+    uint64_t pg_primary;
+    uint64_t pg_state_revision;
 };
 
 struct __attribute__((__packed__)) osd_reply_sec_rw_t
@@ -96,6 +112,8 @@ struct __attribute__((__packed__)) osd_op_sec_del_t
     object_id oid;
     // delete version (automatic or specific)
     uint64_t version;
+    // priority class (OSD_OP_PRIO_*)
+    uint32_t priority;
 };
 
 struct __attribute__((__packed__)) osd_reply_sec_del_t
@@ -104,6 +122,28 @@ struct __attribute__((__packed__)) osd_reply_sec_del_t
     uint64_t version;
 };
 
+// delete a batch of objects of an inode in a PG on the secondary OSD
+struct __attribute__((__packed__)) osd_op_sec_del_inode_t
+{
+    osd_op_header_t header;
+    // inode
+    uint64_t inode;
+    // placement group number and total count
+    pg_num_t del_pg, pg_count;
+    // size of an area that maps to one PG continuously
+    uint64_t pg_stripe_size;
+    // object to continue deletion from, 0 to start from the beginning
+    object_id cursor;
+};
+
+struct __attribute__((__packed__)) osd_reply_sec_del_inode_t
+{
+    // header.retval = deleted object count
+    osd_reply_header_t header;
+    // cursor for the next request, 0 if all objects are deleted
+    object_id next_cursor;
+};
+
 // sync to the secondary OSD
 struct __attribute__((__packed__)) osd_op_sec_sync_t
 {
@@ -121,6 +161,8 @@ struct __attribute__((__packed__)) osd_op_sec_stab_t
     osd_op_header_t header;
     // obj_ver_id array length in bytes
     uint64_t len;
+    // priority class (OSD_OP_PRIO_*)
+    uint32_t priority;
 };
 typedef osd_op_sec_stab_t osd_op_sec_rollback_t;
 
@@ -167,6 +209,10 @@ struct __attribute__((__packed__)) osd_op_sec_list_t
     uint64_t pg_stripe_size;
     // inode range (used to select pools)
     uint64_t min_inode, max_inode;
+    // object to continue listing from, 0 to list from the beginning
+    object_id cursor;
+    // max number of clean objects in the reply, 0 to list all objects at once
+    uint32_t stable_limit;
 };
 
 struct __attribute__((__packed__)) osd_reply_sec_list_t
@@ -175,6 +221,40 @@ struct __attribute__((__packed__)) osd_reply_sec_list_t
     // stable object version count. header.retval = total object version count
     // FIXME: maybe change to the number of bytes in the reply...
     uint64_t stable_count;
+    // cursor for the next request, 0 if all objects are listed
+    object_id next_cursor;
+    // PG log instance and position at the moment of listing, 0 if the PG log is disabled
+    uint64_t log_id, log_pos;
+};
+
+// get PG log entries from the secondary OSD
+struct __attribute__((__packed__)) osd_op_sec_get_log_t
+{
+    osd_op_header_t header;
+    pool_id_t pool_id;
+    // placement group number and total count
+    pg_num_t pg_num, pg_count;
+    // PG log instance and position to return entries after
+    uint64_t log_id, log_pos;
+};
+
+struct __attribute__((__packed__)) osd_reply_sec_get_log_t
+{
+    // retval = entry count or -ENOENT if the log is truncated or lost. payload is osd_pg_log_entry_t[]
+    osd_reply_header_t header;
+    // current PG log position
+    uint64_t log_pos;
+};
+
+// PG log entry: a successful modification of an object on the OSD
+struct __attribute__((__packed__)) osd_pg_log_entry_t
+{
+    object_id oid;
+    // OSD_OP_SEC_WRITE, OSD_OP_SEC_WRITE_STABLE, OSD_OP_SEC_DELETE, OSD_OP_SEC_STABILIZE or OSD_OP_SEC_ROLLBACK
+    uint64_t opcode;
+    uint64_t version;
+    // version of the object before the modification, for writes and deletes
+    uint64_t prev_version;
 };
 
 // read or write to the primary OSD (must be within individual stripe)
@@ -187,7 +267,7 @@ struct __attribute__((__packed__)) osd_op_rw_t
     uint64_t offset;
     // length
     uint32_t len;
-    // flags (for future)
+    // flags. lowest bits are the priority class (OSD_OP_RW_PRIO_MASK), 0 for client operations
     uint32_t flags;
     // inode metadata revision
     uint64_t meta_revision;
@@ -206,6 +286,24 @@ struct __attribute__((__packed__)) osd_reply_rw_t
     uint64_t version;
 };
 
+// delete all objects of an inode in a PG through the primary OSD
+struct __attribute__((__packed__)) osd_op_delete_inode_t
+{
+    osd_op_header_t header;
+    // inode
+    uint64_t inode;
+    // minimum object offset to delete
+    uint64_t min_offset;
+    // placement group number
+    pg_num_t pg_num;
+    uint32_t pad0;
+};
+
+struct __attribute__((__packed__)) osd_reply_delete_inode_t
+{
+    osd_reply_header_t header;
+};
+
 // sync to the primary OSD
 struct __attribute__((__packed__)) osd_op_sync_t
 {
@@ -223,13 +321,16 @@ union osd_any_op_t
     osd_op_header_t hdr;
     osd_op_sec_rw_t sec_rw;
     osd_op_sec_del_t sec_del;
+    osd_op_sec_del_inode_t sec_del_inode;
     osd_op_sec_sync_t sec_sync;
     osd_op_sec_stab_t sec_stab;
     osd_op_sec_read_bmp_t sec_read_bmp;
     osd_op_sec_list_t sec_list;
+    osd_op_sec_get_log_t sec_get_log;
     osd_op_show_config_t show_conf;
     osd_op_rw_t rw;
     osd_op_sync_t sync;
+    osd_op_delete_inode_t del_inode;
     uint8_t buf[OSD_PACKET_SIZE];
 };
 
@@ -238,13 +339,16 @@ union osd_any_reply_t
     osd_reply_header_t hdr;
     osd_reply_sec_rw_t sec_rw;
     osd_reply_sec_del_t sec_del;
+    osd_reply_sec_del_inode_t sec_del_inode;
     osd_reply_sec_sync_t sec_sync;
     osd_reply_sec_stab_t sec_stab;
     osd_reply_sec_read_bmp_t sec_read_bmp;
     osd_reply_sec_list_t sec_list;
+    osd_reply_sec_get_log_t sec_get_log;
     osd_reply_show_config_t show_conf;
     osd_reply_rw_t rw;
     osd_reply_sync_t sync;
+    osd_reply_delete_inode_t del_inode;
     uint8_t buf[OSD_PACKET_SIZE];
 };
 
@@ -19,14 +19,38 @@ void osd_t::handle_peers()
         {
             if (p.second.state == PG_PEERING)
             {
-                if (!p.second.peering_state->list_ops.size())
+                if (p.second.peering_queued)
                 {
-                    p.second.calc_object_states(log_level);
+                    still = true;
+                }
+                else if (!p.second.peering_state->list_ops.size())
+                {
+                    if (p.second.peering_state->incremental && !start_incremental_peering(p.second))
+                    {
+                        restart_full_peering(p.second);
+                        still = true;
+                        continue;
+                    }
+                    if (!p.second.calc_object_states(log_level))
+                    {
+                        // Request the next window of object lists
+                        for (osd_num_t peer_osd: p.second.cur_peers)
+                        {
+                            submit_list_subop(peer_osd, p.second.peering_state);
+                        }
+                        still = true;
+                        continue;
+                    }
+                    update_pg_log_base(p.second);
                     report_pg_state(p.second);
+                    finish_pg_peering_slot(p.second);
+                    peering_round_pgs++;
                     incomplete_objects += p.second.incomplete_objects.size();
                     misplaced_objects += p.second.misplaced_objects.size();
                     // FIXME: degraded objects may currently include misplaced, too! Report them separately?
                     degraded_objects += p.second.degraded_objects.size();
+                    if (p.second.state & (PG_HAS_DEGRADED | PG_HAS_MISPLACED))
+                        recovery_pgs.insert(p.first);
                     if ((p.second.state & (PG_ACTIVE | PG_HAS_UNCLEAN)) == (PG_ACTIVE | PG_HAS_UNCLEAN))
                         peering_state = peering_state | OSD_FLUSHING_PGS;
                     else if (p.second.state & PG_ACTIVE)
@@ -46,6 +70,7 @@ void osd_t::handle_peers()
         {
             // Done all PGs
             peering_state = peering_state & ~OSD_PEERING_PGS;
+            report_peering_time();
         }
     }
     if ((peering_state & OSD_FLUSHING_PGS) && !readonly)
@@ -80,6 +105,35 @@ void osd_t::handle_peers()
     }
 }
 
+void osd_t::report_peering_time()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int active = 0;
+    for (auto & p: pgs)
+    {
+        if (p.second.state & PG_ACTIVE)
+            active++;
+    }
+    if (!startup_peering_done)
+    {
+        // The first peering round after start
+        startup_peering_done = true;
+        printf(
+            "[OSD %lu] %d of %lu PGs are active %.3f s after start\n", this->osd_num, active, pgs.size(),
+            (now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec)/1000000000.0
+        );
+    }
+    else
+    {
+        printf(
+            "[OSD %lu] Peered %lu PGs in %.3f s, %d of %lu PGs are active\n", this->osd_num, peering_round_pgs,
+            (now.tv_sec - peering_round_start.tv_sec) + (now.tv_nsec - peering_round_start.tv_nsec)/1000000000.0,
+            active, pgs.size()
+        );
+    }
+}
+
 void osd_t::repeer_pgs(osd_num_t peer_osd)
 {
     // Re-peer affected PGs
@@ -121,6 +175,7 @@ void osd_t::reset_pg(pg_t & pg)
 {
     pg.cur_peers.clear();
     pg.state_dict.clear();
+    pg.state_ids.clear();
     copies_to_delete_after_sync_count -= pg.copies_to_delete_after_sync.size();
     pg.copies_to_delete_after_sync.clear();
     incomplete_objects -= pg.incomplete_objects.size();
@@ -129,6 +184,7 @@ void osd_t::reset_pg(pg_t & pg)
     pg.incomplete_objects.clear();
     pg.misplaced_objects.clear();
     pg.degraded_objects.clear();
+    pg.degraded_cursor = pg.misplaced_cursor = {};
     pg.flush_actions.clear();
     pg.ver_override.clear();
     if (pg.flush_batch)
@@ -157,6 +213,11 @@ void osd_t::reset_pg(pg_t & pg)
 void osd_t::start_pg_peering(pg_t & pg)
 {
     pg.state = PG_PEERING;
+    if (!(this->peering_state & OSD_PEERING_PGS))
+    {
+        clock_gettime(CLOCK_MONOTONIC, &peering_round_start);
+        peering_round_pgs = 0;
+    }
     this->peering_state |= OSD_PEERING_PGS;
     reset_pg(pg);
     report_pg_state(pg);
@@ -198,6 +259,7 @@ void osd_t::start_pg_peering(pg_t & pg)
     {
         pg.state = PG_INCOMPLETE;
         report_pg_state(pg);
+        finish_pg_peering_slot(pg);
         return;
     }
     std::set<osd_num_t> cur_peers;
@@ -236,17 +298,30 @@ void osd_t::start_pg_peering(pg_t & pg)
             {
                 pg.state = PG_INCOMPLETE;
                 report_pg_state(pg);
+                finish_pg_peering_slot(pg);
                 return;
             }
         }
     }
     pg.cur_peers.insert(pg.cur_peers.begin(), cur_peers.begin(), cur_peers.end());
+    // Only request PG log tails if all peers were in the PG when it was active+clean last time
+    bool incremental = peering_log_size > 0 && pg.log_base.size() > 0 && pg.target_set == pg.log_base_set;
+    for (auto peer_osd: cur_peers)
+    {
+        if (incremental && pg.log_base.find(peer_osd) == pg.log_base.end())
+            incremental = false;
+    }
     if (pg.peering_state)
     {
-        // Adjust the peering operation that's still in progress - discard unneeded results
+        // Adjust the peering operation that's still in progress - discard unneeded results.
+        // If some listing windows are already processed or PG logs are requested, restart from the beginning
+        bool restart = pg.peering_state->list_cursor.inode != 0 || pg.peering_state->list_cursor.stripe != 0 ||
+            pg.peering_state->incremental || incremental;
+        pg.peering_state->list_cursor = { 0 };
+        free_peering_logs(pg.peering_state);
         for (auto it = pg.peering_state->list_ops.begin(); it != pg.peering_state->list_ops.end();)
         {
-            if (pg.state == PG_INCOMPLETE || cur_peers.find(it->first) == cur_peers.end())
+            if (restart || pg.state == PG_INCOMPLETE || cur_peers.find(it->first) == cur_peers.end())
             {
                 // Discard the result after completion, which, chances are, will be unsuccessful
                 discard_list_subop(it->second);
@@ -257,7 +332,7 @@ void osd_t::start_pg_peering(pg_t & pg)
         }
         for (auto it = pg.peering_state->list_results.begin(); it != pg.peering_state->list_results.end();)
         {
-            if (pg.state == PG_INCOMPLETE || cur_peers.find(it->first) == cur_peers.end())
+            if (restart || pg.state == PG_INCOMPLETE || cur_peers.find(it->first) == cur_peers.end())
             {
                 if (it->second.buf)
                 {
@@ -268,6 +343,13 @@ void osd_t::start_pg_peering(pg_t & pg)
             else
                 it++;
         }
+        for (auto it = pg.peering_state->list_log_pos.begin(); it != pg.peering_state->list_log_pos.end();)
+        {
+            if (restart || pg.state == PG_INCOMPLETE || cur_peers.find(it->first) == cur_peers.end())
+                pg.peering_state->list_log_pos.erase(it++);
+            else
+                it++;
+        }
     }
     if (pg.state == PG_INCOMPLETE)
     {
@@ -276,6 +358,7 @@ void osd_t::start_pg_peering(pg_t & pg)
             delete pg.peering_state;
             pg.peering_state = NULL;
         }
+        finish_pg_peering_slot(pg);
         return;
     }
     if (!pg.peering_state)
@@ -284,7 +367,26 @@ void osd_t::start_pg_peering(pg_t & pg)
         pg.peering_state->pool_id = pg.pool_id;
         pg.peering_state->pg_num = pg.pg_num;
     }
-    for (osd_num_t peer_osd: cur_peers)
+    pg.peering_state->incremental = incremental;
+    pg.peering_state->log_failed = false;
+    pool_pg_num_t pg_id = { .pool_id = pg.pool_id, .pg_num = pg.pg_num };
+    if (peering_pgs.find(pg_id) != peering_pgs.end() || !peering_pg_limit || peering_pgs.size() < peering_pg_limit)
+    {
+        submit_peering_subops(pg);
+    }
+    else if (!pg.peering_queued)
+    {
+        // Wait until other PGs finish listing objects
+        pg.peering_queued = true;
+        peering_queue.push_back(pg_id);
+    }
+    ringloop->wakeup();
+}
+
+void osd_t::submit_peering_subops(pg_t & pg)
+{
+    peering_pgs.insert({ .pool_id = pg.pool_id, .pg_num = pg.pg_num });
+    for (osd_num_t peer_osd: pg.cur_peers)
     {
         if (pg.peering_state->list_ops.find(peer_osd) != pg.peering_state->list_ops.end() ||
             pg.peering_state->list_results.find(peer_osd) != pg.peering_state->list_results.end())
@@ -293,7 +395,37 @@ void osd_t::start_pg_peering(pg_t & pg)
         }
         submit_sync_and_list_subop(peer_osd, pg.peering_state);
     }
-    ringloop->wakeup();
+}
+
+// Free the peering slot of a PG and let queued PGs start listing
+void osd_t::finish_pg_peering_slot(pg_t & pg)
+{
+    pg.peering_queued = pg.peering_wanted = false;
+    peering_pgs.erase({ .pool_id = pg.pool_id, .pg_num = pg.pg_num });
+    while ((peering_wanted_queue.size() || peering_queue.size()) &&
+        (!peering_pg_limit || peering_pgs.size() < peering_pg_limit))
+    {
+        // PGs which clients are waiting for go first
+        auto & queue = peering_wanted_queue.size() ? peering_wanted_queue : peering_queue;
+        pool_pg_num_t pg_id = queue.front();
+        queue.pop_front();
+        auto pg_it = pgs.find(pg_id);
+        if (pg_it != pgs.end() && pg_it->second.peering_queued && pg_it->second.state == PG_PEERING)
+        {
+            pg_it->second.peering_queued = pg_it->second.peering_wanted = false;
+            submit_peering_subops(pg_it->second);
+        }
+    }
+}
+
+// Client operation hit a PG waiting for its peering turn, move it to the head of the queue
+void osd_t::want_pg_peering(pg_t & pg)
+{
+    if (pg.peering_queued && !pg.peering_wanted)
+    {
+        pg.peering_wanted = true;
+        peering_wanted_queue.push_back({ .pool_id = pg.pool_id, .pg_num = pg.pg_num });
+    }
 }
 
 void osd_t::submit_sync_and_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
@@ -301,7 +433,10 @@ void osd_t::submit_sync_and_list_subop(osd_num_t role_osd, pg_peering_state_t *p
     // Sync before listing, if not readonly
     if (readonly)
     {
-        submit_list_subop(role_osd, ps);
+        if (ps->incremental)
+            submit_get_log_subop(role_osd, ps);
+        else
+            submit_list_subop(role_osd, ps);
     }
     else if (role_osd == this->osd_num)
     {
@@ -325,7 +460,10 @@ void osd_t::submit_sync_and_list_subop(osd_num_t role_osd, pg_peering_state_t *p
             op->bs_op = NULL;
             delete op;
             ps->list_ops.erase(role_osd);
-            submit_list_subop(role_osd, ps);
+            if (ps->incremental)
+                submit_get_log_subop(role_osd, ps);
+            else
+                submit_list_subop(role_osd, ps);
         };
         bs->enqueue_op(op->bs_op);
         ps->list_ops[role_osd] = op;
@@ -360,7 +498,10 @@ void osd_t::submit_sync_and_list_subop(osd_num_t role_osd, pg_peering_state_t *p
             }
             delete op;
             ps->list_ops.erase(role_osd);
-            submit_list_subop(role_osd, ps);
+            if (ps->incremental)
+                submit_get_log_subop(role_osd, ps);
+            else
+                submit_list_subop(role_osd, ps);
         };
         msgr.outbox_push(op);
         ps->list_ops[role_osd] = op;
@@ -378,12 +519,16 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
         clock_gettime(CLOCK_REALTIME, &op->tv_begin);
         op->bs_op = new blockstore_op_t();
         op->bs_op->opcode = BS_OP_LIST;
+        op->bs_op->priority = BS_PRIO_BACKGROUND;
         op->bs_op->oid.stripe = st_cli.pool_config[ps->pool_id].pg_stripe_size;
         op->bs_op->oid.inode = ((uint64_t)ps->pool_id << (64 - POOL_ID_BITS));
         op->bs_op->version = ((uint64_t)(ps->pool_id+1) << (64 - POOL_ID_BITS)) - 1;
         op->bs_op->len = pg_counts[ps->pool_id];
         op->bs_op->offset = ps->pg_num-1;
-        op->bs_op->callback = [this, ps, op, role_osd](blockstore_op_t *bs_op)
+        op->bs_op->list_cursor = ps->list_cursor;
+        op->bs_op->list_stable_limit = peering_list_limit;
+        pg_log_pos_t log_pos = { .log_id = peering_log_size ? pg_log_id : 0, .log_pos = pg_log_pos };
+        op->bs_op->callback = [this, ps, op, role_osd, log_pos](blockstore_op_t *bs_op)
         {
             if (op->bs_op->retval < 0)
             {
@@ -398,7 +543,12 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
                 .buf = (obj_ver_id*)op->bs_op->buf,
                 .total_count = (uint64_t)op->bs_op->retval,
                 .stable_count = op->bs_op->version,
+                .next_cursor = op->bs_op->list_cursor,
             };
+            if (ps->list_cursor.inode == 0 && ps->list_cursor.stripe == 0)
+            {
+                ps->list_log_pos[role_osd] = log_pos;
+            }
             ps->list_ops.erase(role_osd);
             delete op->bs_op;
             op->bs_op = NULL;
@@ -425,6 +575,8 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
                 .pg_stripe_size = st_cli.pool_config[ps->pool_id].pg_stripe_size,
                 .min_inode = ((uint64_t)(ps->pool_id) << (64 - POOL_ID_BITS)),
                 .max_inode = ((uint64_t)(ps->pool_id+1) << (64 - POOL_ID_BITS)) - 1,
+                .cursor = ps->list_cursor,
+                .stable_limit = peering_list_limit,
             },
         };
         op->callback = [this, ps, role_osd](osd_op_t *op)
@@ -446,7 +598,15 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
                 .buf = (obj_ver_id*)op->buf,
                 .total_count = (uint64_t)op->reply.hdr.retval,
                 .stable_count = op->reply.sec_list.stable_count,
+                .next_cursor = op->reply.sec_list.next_cursor,
             };
+            if (ps->list_cursor.inode == 0 && ps->list_cursor.stripe == 0)
+            {
+                ps->list_log_pos[role_osd] = {
+                    .log_id = op->reply.sec_list.log_id,
+                    .log_pos = op->reply.sec_list.log_pos,
+                };
+            }
             // set op->buf to NULL so it doesn't get freed
             op->buf = NULL;
             ps->list_ops.erase(role_osd);
@@ -457,6 +617,146 @@ void osd_t::submit_list_subop(osd_num_t role_osd, pg_peering_state_t *ps)
     }
 }
 
+void osd_t::submit_get_log_subop(osd_num_t role_osd, pg_peering_state_t *ps)
+{
+    auto & pg = pgs.at({ .pool_id = ps->pool_id, .pg_num = ps->pg_num });
+    auto & base = pg.log_base.at(role_osd);
+    if (role_osd == this->osd_num)
+    {
+        // Self
+        osd_pg_log_entry_t *entries = NULL;
+        int count = read_pg_log(ps->pool_id, ps->pg_num, pg_counts[ps->pool_id], base.log_id, base.log_pos, &entries);
+        if (count < 0)
+        {
+            printf("[PG %u/%u] Local PG log is truncated\n", ps->pool_id, ps->pg_num);
+            ps->log_failed = true;
+            return;
+        }
+        printf("[PG %u/%u] Got PG log from OSD %lu (local): %d entries\n", ps->pool_id, ps->pg_num, role_osd, count);
+        ps->log_results[role_osd] = {
+            .entries = entries,
+            .count = (uint64_t)count,
+            .pos = { .log_id = pg_log_id, .log_pos = pg_log_pos },
+        };
+    }
+    else
+    {
+        // Peer
+        osd_op_t *op = new osd_op_t();
+        op->op_type = OSD_OP_OUT;
+        op->peer_fd = msgr.osd_peer_fds[role_osd];
+        op->req = (osd_any_op_t){
+            .sec_get_log = {
+                .header = {
+                    .magic = SECONDARY_OSD_OP_MAGIC,
+                    .id = msgr.next_subop_id++,
+                    .opcode = OSD_OP_SEC_GET_LOG,
+                },
+                .pool_id = ps->pool_id,
+                .pg_num = ps->pg_num,
+                .pg_count = pg_counts[ps->pool_id],
+                .log_id = base.log_id,
+                .log_pos = base.log_pos,
+            },
+        };
+        op->callback = [this, ps, role_osd](osd_op_t *op)
+        {
+            ps->list_ops.erase(role_osd);
+            if (op->reply.hdr.retval < 0)
+            {
+                // -ENOENT means that the log is truncated, -EINVAL is returned by OSDs without PG logs
+                printf("[PG %u/%u] Failed to get PG log from OSD %lu (retval=%ld)\n", ps->pool_id, ps->pg_num, role_osd, op->reply.hdr.retval);
+                ps->log_failed = true;
+                int fail_fd = op->peer_fd;
+                bool disconnect = op->reply.hdr.retval != -ENOENT && op->reply.hdr.retval != -EINVAL;
+                delete op;
+                if (disconnect)
+                    msgr.stop_client(fail_fd);
+                return;
+            }
+            printf("[PG %u/%u] Got PG log from OSD %lu: %ld entries\n", ps->pool_id, ps->pg_num, role_osd, op->reply.hdr.retval);
+            ps->log_results[role_osd] = {
+                .entries = (osd_pg_log_entry_t*)op->buf,
+                .count = (uint64_t)op->reply.hdr.retval,
+                .pos = { .log_id = op->req.sec_get_log.log_id, .log_pos = op->reply.sec_get_log.log_pos },
+            };
+            // set op->buf to NULL so it doesn't get freed
+            op->buf = NULL;
+            delete op;
+        };
+        msgr.outbox_push(op);
+        ps->list_ops[role_osd] = op;
+    }
+}
+
+void osd_t::free_peering_logs(pg_peering_state_t *ps)
+{
+    for (auto & lp: ps->log_results)
+    {
+        if (lp.second.entries)
+        {
+            free(lp.second.entries);
+        }
+    }
+    ps->log_results.clear();
+}
+
+// Replay PG log tails instead of listing objects, or fall back to the full listing
+bool osd_t::start_incremental_peering(pg_t & pg)
+{
+    auto ps = pg.peering_state;
+    ps->incremental = false;
+    bool ok = !ps->log_failed && pg.replay_peering_logs();
+    if (ok)
+    {
+        // New log positions become the base if the PG turns out to be active+clean
+        for (auto & lp: ps->log_results)
+        {
+            ps->list_log_pos[lp.first] = lp.second.pos;
+        }
+    }
+    free_peering_logs(ps);
+    return ok;
+}
+
+void osd_t::restart_full_peering(pg_t & pg)
+{
+    printf("[PG %u/%u] PG logs are incomplete, listing all objects\n", pg.pool_id, pg.pg_num);
+    pg.log_base.clear();
+    pg.log_base_set.clear();
+    pg.peering_state->log_failed = false;
+    for (osd_num_t peer_osd: pg.cur_peers)
+    {
+        submit_sync_and_list_subop(peer_osd, pg.peering_state);
+    }
+}
+
+// Remember PG log positions of an active+clean PG for the next peering
+void osd_t::update_pg_log_base(pg_t & pg)
+{
+    auto ps = pg.peering_state;
+    if (pg.state == PG_ACTIVE)
+    {
+        pg.log_base.clear();
+        for (osd_num_t peer_osd: pg.cur_peers)
+        {
+            auto pos_it = ps->list_log_pos.find(peer_osd);
+            if (pos_it == ps->list_log_pos.end() || !pos_it->second.log_id)
+            {
+                // PG logs are disabled on this OSD
+                pg.log_base.clear();
+                break;
+            }
+            pg.log_base[peer_osd] = pos_it->second;
+        }
+        pg.log_base_set = pg.log_base.size() ? pg.target_set : std::vector<osd_num_t>();
+        pg.log_base_epoch = pg.epoch;
+        pg.log_base_objects = pg.total_count;
+    }
+    ps->list_log_pos.clear();
+    ps->base_epoch = ps->base_count = 0;
+}
+
 void osd_t::discard_list_subop(osd_op_t *list_op)
 {
     if (list_op->peer_fd == 0)
@@ -497,9 +797,11 @@ bool osd_t::stop_pg(pg_t & pg)
                 free(it->second.buf);
             }
         }
+        free_peering_logs(pg.peering_state);
         delete pg.peering_state;
         pg.peering_state = NULL;
     }
+    finish_pg_peering_slot(pg);
     if (pg.state & (PG_STOPPING | PG_OFFLINE))
     {
         return false;
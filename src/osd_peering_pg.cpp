@@ -1,8 +1,11 @@
 // Copyright (c) Vitaliy Filippov, 2019+
 // License: VNPL-1.1 (see README.md for details)
 
+#include <string.h>
 #include <unordered_map>
 #include "osd_peering_pg.h"
+#include "malloc_or_die.h"
+#include "radix_sort.h"
 
 struct obj_ver_role
 {
@@ -27,6 +30,21 @@ inline bool operator < (const obj_ver_role & a, const obj_ver_role & b)
     );
 }
 
+// Sorted run of one OSD's object listing
+struct obj_list_run_t
+{
+    obj_ver_id *pos, *end;
+    osd_num_t osd_num;
+    bool is_stable;
+};
+
+// Object (inode, stripe & ~STRIPE_MASK) at the head of a run
+static inline bool run_head_after(const obj_list_run_t & a, const obj_list_run_t & b)
+{
+    return a.pos->oid.inode > b.pos->oid.inode || a.pos->oid.inode == b.pos->oid.inode &&
+        (a.pos->oid.stripe & ~STRIPE_MASK) > (b.pos->oid.stripe & ~STRIPE_MASK);
+}
+
 struct obj_piece_ver_t
 {
     uint64_t max_ver = 0;
@@ -38,6 +56,10 @@ struct pg_obj_state_check_t
 {
     pg_t *pg;
     bool replicated = false;
+    // min-heap of sorted listing runs, merged object by object
+    std::vector<obj_list_run_t> runs;
+    object_id window_end = { 0 };
+    // all versions of the current object from all OSDs
     std::vector<obj_ver_role> list;
     int list_pos;
     int obj_start = 0, obj_end = 0, ver_start = 0, ver_end = 0;
@@ -50,34 +72,105 @@ struct pg_obj_state_check_t
     pg_osd_set_t osd_set;
     int log_level;
 
+    void add_runs(obj_ver_id *buf, uint64_t count, osd_num_t osd_num, bool is_stable);
+    bool next_object();
     void walk();
+    void finish_pg();
     void start_object();
     void handle_version();
     void finish_object();
 };
 
-void pg_obj_state_check_t::walk()
+// Listings are sorted by object_id and version, but stable entries from the metadata
+// and from the journal are concatenated, as well as unstable ones, so split them into runs
+void pg_obj_state_check_t::add_runs(obj_ver_id *buf, uint64_t count, osd_num_t osd_num, bool is_stable)
+{
+    obj_ver_id *end = buf+count;
+    while (true)
+    {
+        // Entries beyond the window will be listed again in the next window
+        while (buf < end && window_end.inode != 0 && !(buf->oid < window_end))
+        {
+            buf++;
+        }
+        if (buf >= end)
+        {
+            break;
+        }
+        obj_ver_id *run_end = buf+1;
+        while (run_end < end && !(*run_end < *(run_end-1)) &&
+            (window_end.inode == 0 || run_end->oid < window_end))
+        {
+            run_end++;
+        }
+        runs.push_back((obj_list_run_t){
+            .pos = buf,
+            .end = run_end,
+            .osd_num = osd_num,
+            .is_stable = is_stable,
+        });
+        buf = run_end;
+    }
+}
+
+// Take all versions of the next object from the heads of all runs
+bool pg_obj_state_check_t::next_object()
 {
-    pg->clean_count = 0;
-    pg->total_count = 0;
-    pg->state = 0;
-    for (list_pos = 0; list_pos < list.size(); list_pos++)
+    list.clear();
+    if (!runs.size())
     {
-        if (oid.inode != list[list_pos].oid.inode ||
-            oid.stripe != (list[list_pos].oid.stripe & ~STRIPE_MASK))
+        return false;
+    }
+    object_id next = { .inode = runs[0].pos->oid.inode, .stripe = runs[0].pos->oid.stripe & ~STRIPE_MASK };
+    while (runs.size() && runs[0].pos->oid.inode == next.inode &&
+        (runs[0].pos->oid.stripe & ~STRIPE_MASK) == next.stripe)
+    {
+        std::pop_heap(runs.begin(), runs.end(), run_head_after);
+        auto & run = runs.back();
+        while (run.pos < run.end && run.pos->oid.inode == next.inode &&
+            (run.pos->oid.stripe & ~STRIPE_MASK) == next.stripe)
         {
-            if (oid.inode != 0)
+            if ((run.pos->version >> (64-PG_EPOCH_BITS)) > pg->epoch)
             {
-                finish_object();
+                pg->epoch = (run.pos->version >> (64-PG_EPOCH_BITS));
             }
-            start_object();
+            list.push_back((obj_ver_role){
+                .oid = run.pos->oid,
+                .version = run.pos->version,
+                .osd_num = run.osd_num,
+                .is_stable = run.is_stable,
+            });
+            run.pos++;
         }
-        handle_version();
+        if (run.pos < run.end)
+            std::push_heap(runs.begin(), runs.end(), run_head_after);
+        else
+            runs.pop_back();
     }
-    if (oid.inode != 0)
+    // Only a few entries, usually one per OSD
+    std::sort(list.begin(), list.end());
+    return true;
+}
+
+void pg_obj_state_check_t::walk()
+{
+    std::make_heap(runs.begin(), runs.end(), run_head_after);
+    while (next_object())
     {
+        for (list_pos = 0; list_pos < list.size(); list_pos++)
+        {
+            if (list_pos == 0)
+            {
+                start_object();
+            }
+            handle_version();
+        }
         finish_object();
     }
+}
+
+void pg_obj_state_check_t::finish_pg()
+{
     if (pg->state & PG_HAS_INVALID)
     {
         // Stop PGs with "invalid" objects
@@ -374,8 +467,10 @@ void pg_obj_state_check_t::finish_object()
                 .osd_set = osd_set,
                 .state = state,
                 .object_count = 1,
+                .set_id = (uint32_t)pg->state_ids.size(),
             };
             it = pg->state_dict.find(osd_set);
+            pg->state_ids.push_back(&it->second);
         }
         else
         {
@@ -383,63 +478,239 @@ void pg_obj_state_check_t::finish_object()
         }
         if (state & OBJ_INCOMPLETE)
         {
-            pg->incomplete_objects[oid] = &it->second;
+            pg->incomplete_objects.add(oid, it->second.set_id);
         }
         else if (state & OBJ_DEGRADED)
         {
-            pg->degraded_objects[oid] = &it->second;
+            pg->degraded_objects.add(oid, it->second.set_id);
         }
         else
         {
-            pg->misplaced_objects[oid] = &it->second;
+            pg->misplaced_objects.add(oid, it->second.set_id);
         }
     }
 }
 
+// State of one object piece on one OSD, replayed from its PG log
+struct pg_log_piece_t
+{
+    uint64_t stable_ver = 0;
+    std::vector<uint64_t> unstable;
+};
+
+// Rebuild object lists of all peers from their PG log tails and the last clean state of the PG.
+// Objects not mentioned in any log are unchanged since then, i.e. present on all OSDs in the
+// same stable version, so only changed objects are listed and the rest are just counted.
+// Returns false if logs don't match the last clean state and a full listing is required
+bool pg_t::replay_peering_logs()
+{
+    auto ps = peering_state;
+    bool replicated = (this->scheme == POOL_SCHEME_REPLICATED);
+    std::map<osd_num_t, uint64_t> roles;
+    for (auto & lp: ps->log_results)
+    {
+        uint64_t role = 0;
+        if (!replicated)
+        {
+            while (role < log_base_set.size() && log_base_set[role] != lp.first)
+                role++;
+            if (role >= log_base_set.size())
+                return false;
+        }
+        roles[lp.first] = role;
+    }
+    // Object versions in the last clean state, taken from the first change of each object
+    std::map<object_id, uint64_t> base_vers;
+    std::map<obj_piece_id_t, pg_log_piece_t> pieces;
+    for (auto & lp: ps->log_results)
+    {
+        osd_num_t osd_num = lp.first;
+        for (uint64_t i = 0; i < lp.second.count; i++)
+        {
+            auto & e = lp.second.entries[i];
+            if ((e.oid.stripe & STRIPE_MASK) != roles[osd_num])
+            {
+                // Pieces don't move between OSDs without a change of the OSD set
+                return false;
+            }
+            auto pc_it = pieces.find((obj_piece_id_t){ .oid = e.oid, .osd_num = osd_num });
+            if (pc_it == pieces.end())
+            {
+                if (e.opcode != OSD_OP_SEC_WRITE && e.opcode != OSD_OP_SEC_WRITE_STABLE && e.opcode != OSD_OP_SEC_DELETE)
+                {
+                    // Clean state can't have unstable versions
+                    return false;
+                }
+                object_id obj = { .inode = e.oid.inode, .stripe = e.oid.stripe & ~STRIPE_MASK };
+                auto bv_it = base_vers.find(obj);
+                if (bv_it == base_vers.end())
+                    base_vers[obj] = e.prev_version;
+                else if (bv_it->second != e.prev_version)
+                    return false;
+                pc_it = pieces.emplace((obj_piece_id_t){ .oid = e.oid, .osd_num = osd_num }, pg_log_piece_t()).first;
+                pc_it->second.stable_ver = e.prev_version;
+            }
+            auto & pc = pc_it->second;
+            if (e.opcode == OSD_OP_SEC_WRITE)
+            {
+                pc.unstable.push_back(e.version);
+            }
+            else if (e.opcode == OSD_OP_SEC_WRITE_STABLE || e.opcode == OSD_OP_SEC_STABILIZE)
+            {
+                // Stabilizing a version also stabilizes all previous ones
+                int j = 0;
+                while (j < pc.unstable.size() && pc.unstable[j] <= e.version)
+                    j++;
+                if (j > 0 && pc.unstable[j-1] > pc.stable_ver)
+                    pc.stable_ver = pc.unstable[j-1];
+                if (e.opcode == OSD_OP_SEC_WRITE_STABLE)
+                    pc.stable_ver = e.version;
+                pc.unstable.erase(pc.unstable.begin(), pc.unstable.begin()+j);
+            }
+            else if (e.opcode == OSD_OP_SEC_ROLLBACK)
+            {
+                while (pc.unstable.size() && pc.unstable.back() > e.version)
+                    pc.unstable.pop_back();
+            }
+            else if (e.opcode == OSD_OP_SEC_DELETE)
+            {
+                pc.stable_ver = 0;
+                pc.unstable.clear();
+            }
+        }
+    }
+    uint64_t changed_count = 0;
+    for (auto & bv: base_vers)
+    {
+        if (bv.second != 0)
+            changed_count++;
+    }
+    if (changed_count > log_base_objects)
+    {
+        return false;
+    }
+    std::map<osd_num_t, std::vector<obj_ver_id>> stable, unstable;
+    for (auto & pp: pieces)
+    {
+        if (pp.second.stable_ver)
+        {
+            stable[pp.first.osd_num].push_back((obj_ver_id){ .oid = pp.first.oid, .version = pp.second.stable_ver });
+        }
+        for (uint64_t ver: pp.second.unstable)
+        {
+            unstable[pp.first.osd_num].push_back((obj_ver_id){ .oid = pp.first.oid, .version = ver });
+        }
+    }
+    // OSDs which didn't change an object still have its base version
+    for (auto & bv: base_vers)
+    {
+        if (!bv.second)
+        {
+            continue;
+        }
+        for (auto & rp: roles)
+        {
+            object_id oid = { .inode = bv.first.inode, .stripe = bv.first.stripe | rp.second };
+            if (pieces.find((obj_piece_id_t){ .oid = oid, .osd_num = rp.first }) == pieces.end())
+            {
+                stable[rp.first].push_back((obj_ver_id){ .oid = oid, .version = bv.second });
+            }
+        }
+    }
+    for (auto & rp: roles)
+    {
+        auto & st = stable[rp.first];
+        auto & unst = unstable[rp.first];
+        radix_sort(st);
+        radix_sort(unst);
+        auto & res = ps->list_results[rp.first];
+        res.total_count = st.size() + unst.size();
+        res.stable_count = st.size();
+        res.next_cursor = { 0 };
+        res.buf = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * (res.total_count ? res.total_count : 1));
+        memcpy(res.buf, st.data(), sizeof(obj_ver_id) * st.size());
+        memcpy(res.buf + st.size(), unst.data(), sizeof(obj_ver_id) * unst.size());
+    }
+    ps->base_epoch = log_base_epoch;
+    ps->base_count = log_base_objects - changed_count;
+    return true;
+}
+
 // FIXME: Write at least some tests for this function
-void pg_t::calc_object_states(int log_level)
+// Returns false if the current window is processed, but PG object lists are incomplete yet
+bool pg_t::calc_object_states(int log_level)
 {
-    // Copy all object lists into one array
     pg_obj_state_check_t st;
     st.log_level = log_level;
     st.pg = this;
     st.replicated = (this->scheme == POOL_SCHEME_REPLICATED);
     auto ps = peering_state;
-    epoch = 0;
-    for (auto it: ps->list_results)
-    {
-        auto nstab = it.second.stable_count;
-        auto n = it.second.total_count;
-        auto osd_num = it.first;
-        uint64_t start = st.list.size();
-        st.list.resize(start + n);
-        obj_ver_id *ov = it.second.buf;
-        for (uint64_t i = 0; i < n; i++, ov++)
+    if (ps->list_cursor.inode == 0 && ps->list_cursor.stripe == 0)
+    {
+        // First window. After a PG log replay, objects not present in lists are clean
+        epoch = ps->base_epoch;
+        clean_count = ps->base_count;
+        total_count = ps->base_count;
+        ps->list_state = 0;
+    }
+    // Only objects below the end of the shortest listing are known from all OSDs
+    object_id window_end = { 0 };
+    for (auto & it: ps->list_results)
+    {
+        if (it.second.next_cursor.inode != 0 &&
+            (window_end.inode == 0 || it.second.next_cursor < window_end))
         {
-            if ((ov->version >> (64-PG_EPOCH_BITS)) > epoch)
-            {
-                epoch = (ov->version >> (64-PG_EPOCH_BITS));
-            }
-            st.list[start+i] = {
-                .oid = ov->oid,
-                .version = ov->version,
-                .osd_num = osd_num,
-                .is_stable = i < nstab,
-            };
+            window_end = it.second.next_cursor;
         }
+    }
+    // Don't split parts of one object between windows
+    window_end.stripe &= ~STRIPE_MASK;
+    st.window_end = window_end;
+    // Merge sorted object lists instead of copying them into one array and sorting it
+    for (auto & it: ps->list_results)
+    {
+        st.add_runs(it.second.buf, it.second.stable_count, it.first, true);
+        st.add_runs(it.second.buf + it.second.stable_count, it.second.total_count - it.second.stable_count, it.first, false);
+    }
+    // Walk over it and check object states
+    this->state = ps->list_state;
+    st.walk();
+    for (auto & it: ps->list_results)
+    {
         free(it.second.buf);
         it.second.buf = NULL;
     }
     ps->list_results.clear();
-    // Sort
-    std::sort(st.list.begin(), st.list.end());
-    // Walk over it and check object states
-    st.walk();
+    if (window_end.inode != 0)
+    {
+        // Continue with the next window
+        ps->list_state = this->state;
+        ps->list_cursor = window_end;
+        this->state = PG_PEERING;
+        return false;
+    }
+    st.finish_pg();
+    // Objects are only added during peering, so give unused capacity back
+    incomplete_objects.items.shrink_to_fit();
+    degraded_objects.items.shrink_to_fit();
+    misplaced_objects.items.shrink_to_fit();
     if (this->state & (PG_DEGRADED|PG_LEFT_ON_DEAD))
     {
         assert(epoch != ((1ul << PG_EPOCH_BITS)-1));
         epoch++;
     }
+    return true;
+}
+
+// Returns the OSD set of an object which isn't in the clean state, or NULL
+pg_osd_set_state_t* pg_t::find_object_state(const object_id & oid)
+{
+    uint32_t set_id = incomplete_objects.find(oid);
+    if (set_id == PG_OBJ_STATE_NONE)
+        set_id = degraded_objects.find(oid);
+    if (set_id == PG_OBJ_STATE_NONE)
+        set_id = misplaced_objects.find(oid);
+    return set_id == PG_OBJ_STATE_NONE ? NULL : state_ids[set_id];
 }
 
 void pg_t::print_state()
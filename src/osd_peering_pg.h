@@ -30,6 +30,107 @@ struct pg_osd_set_state_t
     pg_osd_set_t osd_set;
     uint64_t state = 0;
     uint64_t object_count = 0;
+    // index in pg.state_ids
+    uint32_t set_id = 0;
+};
+
+#define PG_OBJ_STATE_NONE UINT32_MAX
+
+struct __attribute__((__packed__)) pg_obj_state_item_t
+{
+    object_id oid;
+    // interned OSD set (index in pg.state_ids) or PG_OBJ_STATE_NONE if the object is removed
+    uint32_t set_id;
+};
+
+// Sorted array of objects with their interned OSD set IDs: 20 bytes per object instead of
+// ~60 bytes of a btree_map<object_id, pg_osd_set_state_t*>. Objects are only added during
+// peering, in ascending order, and removed one by one after recovery or overwrite, so removed
+// objects are only marked and the array is compacted when more than a half of it is removed.
+struct pg_obj_state_map_t
+{
+    std::vector<pg_obj_state_item_t> items;
+    size_t removed = 0;
+
+    size_t size() const
+    {
+        return items.size() - removed;
+    }
+
+    void clear()
+    {
+        items.clear();
+        items.shrink_to_fit();
+        removed = 0;
+    }
+
+    void add(const object_id & oid, uint32_t set_id)
+    {
+        if (!items.size() || items.back().oid < oid)
+            items.push_back({ .oid = oid, .set_id = set_id });
+        else
+        {
+            auto it = std::lower_bound(items.begin(), items.end(), oid, item_less);
+            if (it != items.end() && it->oid == oid)
+            {
+                if (it->set_id == PG_OBJ_STATE_NONE)
+                    removed--;
+                it->set_id = set_id;
+            }
+            else
+                items.insert(it, { .oid = oid, .set_id = set_id });
+        }
+    }
+
+    // Returns the set ID of the object or PG_OBJ_STATE_NONE if it's absent
+    uint32_t find(const object_id & oid) const
+    {
+        auto it = std::lower_bound(items.begin(), items.end(), oid, item_less);
+        return it != items.end() && it->oid == oid ? it->set_id : PG_OBJ_STATE_NONE;
+    }
+
+    bool erase(const object_id & oid)
+    {
+        auto it = std::lower_bound(items.begin(), items.end(), oid, item_less);
+        if (it == items.end() || !(it->oid == oid) || it->set_id == PG_OBJ_STATE_NONE)
+            return false;
+        it->set_id = PG_OBJ_STATE_NONE;
+        removed++;
+        if (removed == items.size())
+            clear();
+        else if (removed > items.size()/2)
+            compact();
+        return true;
+    }
+
+    // Position of the first present object starting from <pos>, or items.size()
+    size_t next(size_t pos) const
+    {
+        while (pos < items.size() && items[pos].set_id == PG_OBJ_STATE_NONE)
+            pos++;
+        return pos;
+    }
+
+    // Position of the first present object >= oid, or items.size()
+    size_t lower_bound(const object_id & oid) const
+    {
+        return next(std::lower_bound(items.begin(), items.end(), oid, item_less) - items.begin());
+    }
+
+    void compact()
+    {
+        items.erase(std::remove_if(items.begin(), items.end(), [](const pg_obj_state_item_t & item)
+        {
+            return item.set_id == PG_OBJ_STATE_NONE;
+        }), items.end());
+        items.shrink_to_fit();
+        removed = 0;
+    }
+
+    static bool item_less(const pg_obj_state_item_t & item, const object_id & oid)
+    {
+        return item.oid < oid;
+    }
 };
 
 struct pg_list_result_t
@@ -37,6 +138,22 @@ struct pg_list_result_t
     obj_ver_id *buf = NULL;
     uint64_t total_count;
     uint64_t stable_count;
+    // where the next listing window starts, 0 if the OSD has listed everything
+    object_id next_cursor = { 0 };
+};
+
+// Position in the PG log of one OSD
+struct pg_log_pos_t
+{
+    uint64_t log_id = 0;
+    uint64_t log_pos = 0;
+};
+
+struct pg_log_result_t
+{
+    osd_pg_log_entry_t *entries = NULL;
+    uint64_t count = 0;
+    pg_log_pos_t pos;
 };
 
 struct osd_op_t;
@@ -48,6 +165,17 @@ struct pg_peering_state_t
     std::map<osd_num_t, pg_list_result_t> list_results;
     pool_id_t pool_id = 0;
     pg_num_t pg_num = 0;
+    // object lists are requested and processed in windows, starting from list_cursor
+    object_id list_cursor = { 0 };
+    // PG state flags accumulated over the previous windows
+    uint64_t list_state = 0;
+    // PG log positions of OSDs at the moment of the first listing window
+    std::map<osd_num_t, pg_log_pos_t> list_log_pos;
+    // incremental peering: only PG log tails are requested and replayed over the last clean state
+    bool incremental = false, log_failed = false;
+    std::map<osd_num_t, pg_log_result_t> log_results;
+    // epoch and object count of objects not present in log tails
+    uint64_t base_epoch = 0, base_count = 0;
 };
 
 struct obj_piece_id_t
@@ -103,20 +231,32 @@ struct pg_t
     pg_osd_set_t cur_loc_set;
     // moved object map. by default, each object is considered to reside on cur_set.
     // this map stores all objects that differ.
-    // it may consume up to ~ (raw storage / object size) * 24 bytes in the worst case scenario
-    // which is up to ~192 MB per 1 TB in the worst case scenario
+    // it may consume up to ~ (raw storage / object size) * 20 bytes in the worst case scenario
+    // which is up to ~160 MB per 1 TB in the worst case scenario
     std::map<pg_osd_set_t, pg_osd_set_state_t> state_dict;
-    btree::btree_map<object_id, pg_osd_set_state_t*> incomplete_objects, misplaced_objects, degraded_objects;
+    // OSD sets from state_dict interned by their set_id, NULL when freed
+    std::vector<pg_osd_set_state_t*> state_ids;
+    pg_obj_state_map_t incomplete_objects, misplaced_objects, degraded_objects;
+    // recovery resumes from these positions instead of scanning objects from the beginning
+    object_id degraded_cursor = {}, misplaced_cursor = {};
     std::map<obj_piece_id_t, flush_action_t> flush_actions;
     std::vector<obj_ver_osd_t> copies_to_delete_after_sync;
     btree::btree_map<object_id, uint64_t> ver_override;
     pg_peering_state_t *peering_state = NULL;
+    // PG waits in the peering queue, and a client is waiting for it
+    bool peering_queued = false, peering_wanted = false;
     pg_flush_batch_t *flush_batch = NULL;
+    // PG log positions of all OSDs at the last active+clean peering, for incremental peering
+    std::map<osd_num_t, pg_log_pos_t> log_base;
+    std::vector<osd_num_t> log_base_set;
+    uint64_t log_base_epoch = 0, log_base_objects = 0;
 
     int inflight = 0; // including write_queue
     std::multimap<object_id, osd_op_t*> write_queue;
 
-    void calc_object_states(int log_level);
+    bool replay_peering_logs();
+    bool calc_object_states(int log_level);
+    pg_osd_set_state_t* find_object_state(const object_id & oid);
     void print_state();
 };
 
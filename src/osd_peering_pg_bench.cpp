@@ -0,0 +1,100 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#define _LARGEFILE64_SOURCE
+
+#include <time.h>
+#include <unistd.h>
+#include <assert.h>
+#include "malloc_or_die.h"
+#include "osd_peering_pg.h"
+#define STRIPE_SHIFT 12
+
+static uint64_t get_rss()
+{
+    uint64_t size = 0, rss = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp)
+    {
+        if (fscanf(fp, "%lu %lu", &size, &rss) != 2)
+            rss = 0;
+        fclose(fp);
+    }
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+// Object state memory and lookup benchmark for a large PG with many misplaced objects
+int main(int argc, char *argv[])
+{
+    // 30% of objects have their third chunk on OSD 4 instead of OSD 3, i.e. are misplaced
+    pg_t pg2 = {
+        .state = PG_PEERING,
+        .scheme = POOL_SCHEME_XOR,
+        .pg_cursize = 3,
+        .pg_size = 3,
+        .pg_minsize = 2,
+        .pg_data_size = 2,
+        .pg_num = 1,
+        .target_set = { 1, 2, 3 },
+        .cur_set = { 1, 2, 3 },
+        .peering_state = new pg_peering_state_t(),
+    };
+    const uint64_t obj_count = 1024*1024*4;
+    uint64_t rss_before = get_rss();
+    for (uint64_t osd_num = 1; osd_num <= 4; osd_num++)
+    {
+        pg_list_result_t r = {
+            .buf = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * obj_count),
+            .total_count = 0,
+        };
+        for (uint64_t i = 0; i < obj_count; i++)
+        {
+            bool misplaced = (i % 10) < 3;
+            if (osd_num < 3 || osd_num == (misplaced ? 4 : 3))
+            {
+                r.buf[r.total_count++] = {
+                    .oid = { .inode = 1, .stripe = (i << STRIPE_SHIFT) | (osd_num == 4 ? 2 : osd_num-1) },
+                    .version = 1,
+                };
+            }
+        }
+        r.stable_count = r.total_count;
+        pg2.peering_state->list_results[osd_num] = r;
+    }
+    pg2.calc_object_states(0);
+    uint64_t rss_after = get_rss();
+    printf(
+        "30%% misplaced: %lu of %lu objects, state memory %.1f MB, RSS delta %.1f MB\n",
+        pg2.misplaced_objects.size(), pg2.total_count,
+        pg2.misplaced_objects.items.capacity()*sizeof(pg_obj_state_item_t)/1024.0/1024.0,
+        ((int64_t)rss_after-(int64_t)rss_before)/1024.0/1024.0
+    );
+    assert(pg2.total_count == obj_count && pg2.misplaced_objects.size() == obj_count/10*3 + (obj_count%10 > 3 ? 3 : obj_count%10));
+    assert(pg2.state == (PG_ACTIVE | PG_HAS_MISPLACED));
+    // Lookups in a scattered order, like the ones done by get_object_osd_set()
+    uint64_t found = 0;
+    timespec tv_begin, tv_end;
+    clock_gettime(CLOCK_REALTIME, &tv_begin);
+    for (uint64_t i = 0; i < obj_count; i++)
+    {
+        object_id oid = { .inode = 1, .stripe = ((i * 2654435761) % obj_count) << STRIPE_SHIFT };
+        if (pg2.find_object_state(oid))
+            found++;
+    }
+    clock_gettime(CLOCK_REALTIME, &tv_end);
+    printf(
+        "find_object_state: %lu lookups in %.3f ms, %.1f ns per lookup\n", obj_count,
+        (tv_end.tv_sec - tv_begin.tv_sec)*1000.0 + (tv_end.tv_nsec - tv_begin.tv_nsec)/1000000.0,
+        ((tv_end.tv_sec - tv_begin.tv_sec)*1000000000.0 + (tv_end.tv_nsec - tv_begin.tv_nsec))/obj_count
+    );
+    assert(found == pg2.misplaced_objects.size());
+    // Removal of recovered objects
+    for (uint64_t i = 0; i < obj_count; i += 10)
+    {
+        pg2.misplaced_objects.erase({ .inode = 1, .stripe = i << STRIPE_SHIFT });
+    }
+    assert(pg2.misplaced_objects.size() == obj_count/10*2 + (obj_count%10 > 3 ? 2 : 0));
+    assert(!pg2.find_object_state({ .inode = 1, .stripe = 0 }));
+    assert(pg2.find_object_state({ .inode = 1, .stripe = 1 << STRIPE_SHIFT }));
+    return 0;
+}
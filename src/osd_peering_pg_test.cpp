@@ -3,6 +3,9 @@
 
 #define _LARGEFILE64_SOURCE
 
+#include <time.h>
+#include <string.h>
+#include <assert.h>
 #include "malloc_or_die.h"
 #include "osd_peering_pg.h"
 #define STRIPE_SHIFT 12
@@ -24,6 +27,11 @@ int main(int argc, char *argv[])
 {
     pg_t pg = {
         .state = PG_PEERING,
+        .scheme = POOL_SCHEME_XOR,
+        .pg_cursize = 3,
+        .pg_size = 3,
+        .pg_minsize = 2,
+        .pg_data_size = 2,
         .pg_num = 1,
         .target_set = { 1, 2, 3 },
         .cur_set = { 1, 2, 3 },
@@ -48,11 +56,107 @@ int main(int argc, char *argv[])
         }
         pg.peering_state->list_results[osd_num] = r;
     }
+    // Peering time benchmark
+    timespec tv_begin, tv_end;
+    clock_gettime(CLOCK_REALTIME, &tv_begin);
     pg.calc_object_states(0);
+    clock_gettime(CLOCK_REALTIME, &tv_end);
+    printf(
+        "calc_object_states: %lu objects in %.3f ms\n", pg.total_count,
+        (tv_end.tv_sec - tv_begin.tv_sec)*1000.0 + (tv_end.tv_nsec - tv_begin.tv_nsec)/1000000.0
+    );
     printf("deviation variants=%ld clean=%lu\n", pg.state_dict.size(), pg.clean_count);
     for (auto it: pg.state_dict)
     {
         printf("dev: state=%lx\n", it.second.state);
     }
+    // Incremental peering: replay PG logs over 100 clean objects
+    // object 1 is rewritten everywhere, but stabilized only on OSD 1 and 2
+    // object 2 is rewritten only on OSD 1, object 3 is created, object 4 is deleted
+    pg.state_dict.clear();
+    pg.flush_actions.clear();
+    pg.log_base_set = pg.target_set;
+    pg.log_base_objects = 100;
+    for (uint64_t osd_num = 1; osd_num <= 3; osd_num++)
+    {
+        std::vector<osd_pg_log_entry_t> log;
+        uint64_t role = osd_num-1;
+        log.push_back({ .oid = { 1, (1 << STRIPE_SHIFT) | role }, .opcode = OSD_OP_SEC_WRITE, .version = 6, .prev_version = 5 });
+        if (osd_num != 3)
+            log.push_back({ .oid = { 1, (1 << STRIPE_SHIFT) | role }, .opcode = OSD_OP_SEC_STABILIZE, .version = 6 });
+        if (osd_num == 1)
+            log.push_back({ .oid = { 1, (2 << STRIPE_SHIFT) | role }, .opcode = OSD_OP_SEC_WRITE, .version = 4, .prev_version = 3 });
+        log.push_back({ .oid = { 1, (3 << STRIPE_SHIFT) | role }, .opcode = OSD_OP_SEC_WRITE_STABLE, .version = 1 });
+        log.push_back({ .oid = { 1, (4 << STRIPE_SHIFT) | role }, .opcode = OSD_OP_SEC_DELETE, .version = 8, .prev_version = 7 });
+        auto & r = pg.peering_state->log_results[osd_num];
+        r.count = log.size();
+        r.entries = (osd_pg_log_entry_t*)malloc_or_die(sizeof(osd_pg_log_entry_t) * log.size());
+        memcpy(r.entries, log.data(), sizeof(osd_pg_log_entry_t) * log.size());
+    }
+    bool replayed = pg.replay_peering_logs();
+    assert(replayed);
+    pg.calc_object_states(0);
+    printf("after log replay: objects=%lu clean=%lu flush_actions=%lu\n", pg.total_count, pg.clean_count, pg.flush_actions.size());
+    assert(pg.total_count == 100 && pg.clean_count == 100 && pg.state == (PG_ACTIVE | PG_HAS_UNCLEAN));
+    assert(pg.flush_actions.size() == 2);
+    obj_piece_id_t stab_piece = { .oid = { 1, (1 << STRIPE_SHIFT) | 2 }, .osd_num = 3 };
+    obj_piece_id_t rollback_piece = { .oid = { 1, (2 << STRIPE_SHIFT) }, .osd_num = 1 };
+    assert(pg.flush_actions[stab_piece].stable_to == 6);
+    assert(pg.flush_actions[rollback_piece].rollback_to == 3);
+    // Object states of misplaced objects: 30% of objects have their
+    // third chunk on OSD 4 instead of OSD 3
+    pg_t pg2 = {
+        .state = PG_PEERING,
+        .scheme = POOL_SCHEME_XOR,
+        .pg_cursize = 3,
+        .pg_size = 3,
+        .pg_minsize = 2,
+        .pg_data_size = 2,
+        .pg_num = 1,
+        .target_set = { 1, 2, 3 },
+        .cur_set = { 1, 2, 3 },
+        .peering_state = new pg_peering_state_t(),
+    };
+    const uint64_t obj_count = 1000;
+    for (uint64_t osd_num = 1; osd_num <= 4; osd_num++)
+    {
+        pg_list_result_t r = {
+            .buf = (obj_ver_id*)malloc_or_die(sizeof(obj_ver_id) * obj_count),
+            .total_count = 0,
+        };
+        for (uint64_t i = 0; i < obj_count; i++)
+        {
+            bool misplaced = (i % 10) < 3;
+            if (osd_num < 3 || osd_num == (misplaced ? 4 : 3))
+            {
+                r.buf[r.total_count++] = {
+                    .oid = { .inode = 1, .stripe = (i << STRIPE_SHIFT) | (osd_num == 4 ? 2 : osd_num-1) },
+                    .version = 1,
+                };
+            }
+        }
+        r.stable_count = r.total_count;
+        pg2.peering_state->list_results[osd_num] = r;
+    }
+    pg2.calc_object_states(0);
+    assert(pg2.total_count == obj_count && pg2.misplaced_objects.size() == obj_count/10*3);
+    assert(pg2.state == (PG_ACTIVE | PG_HAS_MISPLACED));
+    // Lookups in a scattered order, like the ones done by get_object_osd_set()
+    uint64_t found = 0;
+    for (uint64_t i = 0; i < obj_count; i++)
+    {
+        object_id oid = { .inode = 1, .stripe = ((i * 2654435761) % obj_count) << STRIPE_SHIFT };
+        if (pg2.find_object_state(oid))
+            found++;
+    }
+    assert(found == pg2.misplaced_objects.size());
+    // Removal of recovered objects
+    for (uint64_t i = 0; i < obj_count; i += 10)
+    {
+        pg2.misplaced_objects.erase({ .inode = 1, .stripe = i << STRIPE_SHIFT });
+    }
+    assert(pg2.misplaced_objects.size() == obj_count/10*2);
+    assert(!pg2.find_object_state({ .inode = 1, .stripe = 0 }));
+    assert(pg2.find_object_state({ .inode = 1, .stripe = 1 << STRIPE_SHIFT }));
     return 0;
 }
@@ -0,0 +1,147 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+// PG logs: every OSD remembers the last <peering_log_size> modifications of each PG.
+// A primary OSD which peered a PG into the active+clean state remembers log positions
+// of all its OSDs, and the next time it peers the PG it requests only log tails after
+// these positions instead of listing all objects. If any log is truncated or lost
+// (for example, if the OSD has been restarted), peering falls back to the full listing.
+
+#include "osd.h"
+
+void osd_t::append_pg_log(blockstore_op_t *bs_op)
+{
+    if (!peering_log_size)
+    {
+        return;
+    }
+    if (bs_op->opcode == BS_OP_WRITE || bs_op->opcode == BS_OP_WRITE_STABLE || bs_op->opcode == BS_OP_DELETE)
+    {
+        uint64_t prev_version = 0;
+        if (bs->read_bitmap(bs_op->oid, bs_op->version-1, NULL, &prev_version) < 0)
+        {
+            // Object didn't exist or was deleted
+            prev_version = 0;
+        }
+        add_pg_log_entry(bs_op->oid, bs_op->opcode == BS_OP_WRITE ? OSD_OP_SEC_WRITE
+            : (bs_op->opcode == BS_OP_WRITE_STABLE ? OSD_OP_SEC_WRITE_STABLE : OSD_OP_SEC_DELETE),
+            bs_op->version, prev_version);
+    }
+    else if (bs_op->opcode == BS_OP_STABLE || bs_op->opcode == BS_OP_ROLLBACK)
+    {
+        obj_ver_id *ov = (obj_ver_id*)bs_op->buf;
+        for (uint32_t i = 0; i < bs_op->len; i++)
+        {
+            add_pg_log_entry(ov[i].oid, bs_op->opcode == BS_OP_STABLE ? OSD_OP_SEC_STABILIZE : OSD_OP_SEC_ROLLBACK,
+                ov[i].version, 0);
+        }
+    }
+    else if (bs_op->opcode == BS_OP_SYNC_STAB_ALL)
+    {
+        // Everything is stabilized without a list of changes
+        pg_logs.clear();
+        pg_log_valid_from = ++pg_log_pos;
+    }
+    else if (bs_op->opcode == BS_OP_DELETE_INODE && bs_op->retval > 0)
+    {
+        // Bulk deletion versions are always the next versions of objects
+        obj_ver_id *ov = (obj_ver_id*)bs_op->buf;
+        for (int i = 0; i < bs_op->retval; i++)
+        {
+            if (ov[i].version)
+            {
+                add_pg_log_entry(ov[i].oid, OSD_OP_SEC_DELETE, ov[i].version, ov[i].version-1);
+            }
+        }
+    }
+}
+
+void osd_t::add_pg_log_entry(object_id oid, uint64_t opcode, uint64_t version, uint64_t prev_version)
+{
+    pool_id_t pool_id = INODE_POOL(oid.inode);
+    auto pool_it = st_cli.pool_config.find(pool_id);
+    auto count_it = pg_counts.find(pool_id);
+    if (pool_it == st_cli.pool_config.end() || !pool_it->second.pg_stripe_size ||
+        count_it == pg_counts.end() || !count_it->second)
+    {
+        // PG is unknown, so it can't be peered using this log anyway
+        return;
+    }
+    pool_pg_num_t pg_id = {
+        .pool_id = pool_id,
+        .pg_num = (pg_num_t)((oid.stripe / pool_it->second.pg_stripe_size) % count_it->second + 1), // like map_to_pg()
+    };
+    auto log_it = pg_logs.find(pg_id);
+    if (log_it == pg_logs.end())
+    {
+        log_it = pg_logs.emplace(pg_id, osd_pg_log_t()).first;
+        log_it->second.valid_from = pg_log_valid_from;
+    }
+    auto & log = log_it->second;
+    pg_log_pos++;
+    if (prev_version >= version && (opcode == OSD_OP_SEC_WRITE || opcode == OSD_OP_SEC_WRITE_STABLE ||
+        opcode == OSD_OP_SEC_DELETE))
+    {
+        // Previous version is unknown, forget everything before this change
+        log.positions.clear();
+        log.entries.clear();
+        log.valid_from = pg_log_pos;
+        return;
+    }
+    log.positions.push_back(pg_log_pos);
+    log.entries.push_back((osd_pg_log_entry_t){
+        .oid = oid,
+        .opcode = opcode,
+        .version = version,
+        .prev_version = prev_version,
+    });
+    while (log.entries.size() > peering_log_size)
+    {
+        log.valid_from = log.positions.front();
+        log.positions.pop_front();
+        log.entries.pop_front();
+    }
+}
+
+void osd_t::clear_pg_logs(pool_id_t pool_id)
+{
+    for (auto it = pg_logs.begin(); it != pg_logs.end(); )
+    {
+        if (it->first.pool_id == pool_id)
+            pg_logs.erase(it++);
+        else
+            it++;
+    }
+    pg_log_valid_from = ++pg_log_pos;
+}
+
+// Returns the number of log entries after <log_pos> or -ENOENT if some of them are lost
+int osd_t::read_pg_log(pool_id_t pool_id, pg_num_t pg_num, pg_num_t pg_count, uint64_t log_id, uint64_t log_pos,
+    osd_pg_log_entry_t **entries)
+{
+    *entries = NULL;
+    auto count_it = pg_counts.find(pool_id);
+    if (!peering_log_size || log_id != pg_log_id || log_pos > pg_log_pos ||
+        count_it == pg_counts.end() || count_it->second != pg_count)
+    {
+        return -ENOENT;
+    }
+    auto log_it = pg_logs.find({ .pool_id = pool_id, .pg_num = pg_num });
+    if (log_it == pg_logs.end())
+    {
+        return log_pos >= pg_log_valid_from ? 0 : -ENOENT;
+    }
+    auto & log = log_it->second;
+    if (log_pos < log.valid_from)
+    {
+        return -ENOENT;
+    }
+    auto pos_it = std::upper_bound(log.positions.begin(), log.positions.end(), log_pos);
+    int count = log.positions.end() - pos_it;
+    if (count > 0)
+    {
+        *entries = (osd_pg_log_entry_t*)malloc_or_die(sizeof(osd_pg_log_entry_t) * count);
+        std::copy(log.entries.begin() + (pos_it - log.positions.begin()), log.entries.end(), *entries);
+    }
+    return count;
+}
@@ -41,6 +41,11 @@ bool osd_t::prepare_primary_rw(osd_op_t *cur_op)
     if (pg_it == pgs.end() || !(pg_it->second.state & PG_ACTIVE))
     {
         // This OSD is not primary for this PG or the PG is inactive
+        if (pg_it != pgs.end())
+        {
+            // Clients will retry, so peer this PG sooner
+            want_pg_peering(pg_it->second);
+        }
         // FIXME: Allow reads from PGs degraded under pg_minsize, but don't allow writes
         finish_op(cur_op, -EPIPE);
         return false;
@@ -145,26 +150,41 @@ uint64_t* osd_t::get_object_osd_set(pg_t &pg, object_id &oid, uint64_t *def, pg_
         *object_state = NULL;
         return def;
     }
-    auto st_it = pg.incomplete_objects.find(oid);
-    if (st_it != pg.incomplete_objects.end())
+    *object_state = pg.find_object_state(oid);
+    if (*object_state)
     {
-        *object_state = st_it->second;
-        return st_it->second->read_target.data();
+        return (*object_state)->read_target.data();
     }
-    st_it = pg.degraded_objects.find(oid);
-    if (st_it != pg.degraded_objects.end())
+    return def;
+}
+
+// Pick the replica with the least balanced reads in flight, preferring the local one.
+// Objects with writes in progress are always read locally so that reads never go back
+// in time when replicas apply the write at different moments
+osd_num_t osd_t::pick_balanced_read_osd(pg_t & pg, object_id & oid)
+{
+    if (pg.write_queue.find(oid) != pg.write_queue.end())
     {
-        *object_state = st_it->second;
-        return st_it->second->read_target.data();
+        return 0;
     }
-    st_it = pg.misplaced_objects.find(oid);
-    if (st_it != pg.misplaced_objects.end())
+    osd_num_t best_osd = 0;
+    int best_count = 0;
+    for (int role = 0; role < pg.pg_size; role++)
     {
-        *object_state = st_it->second;
-        return st_it->second->read_target.data();
+        osd_num_t role_osd = pg.cur_set[role];
+        if (!role_osd || role_osd != this->osd_num && msgr.osd_peer_fds.find(role_osd) == msgr.osd_peer_fds.end())
+        {
+            continue;
+        }
+        auto cnt_it = balanced_read_count.find(role_osd);
+        int count = cnt_it != balanced_read_count.end() ? cnt_it->second : 0;
+        if (!best_osd || count < best_count || count == best_count && role_osd == this->osd_num)
+        {
+            best_osd = role_osd;
+            best_count = count;
+        }
     }
-    *object_state = NULL;
-    return def;
+    return best_osd;
 }
 
 void osd_t::continue_primary_read(osd_op_t *cur_op)
@@ -194,7 +214,29 @@ void osd_t::continue_primary_read(osd_op_t *cur_op)
         // Determine version
         auto vo_it = pg.ver_override.find(op_data->oid);
         op_data->target_ver = vo_it != pg.ver_override.end() ? vo_it->second : UINT64_MAX;
-        if (pg.state == PG_ACTIVE || op_data->scheme == POOL_SCHEME_REPLICATED)
+        if (balanced_reads && pg.state == PG_ACTIVE && op_data->scheme == POOL_SCHEME_REPLICATED &&
+            vo_it == pg.ver_override.end())
+        {
+            op_data->balanced_osd = pick_balanced_read_osd(pg, op_data->oid);
+        }
+        if (op_data->balanced_osd)
+        {
+            // Read from a single replica
+            std::vector<uint64_t> read_set(pg.pg_size, 0);
+            for (int role = 0; role < pg.pg_size; role++)
+            {
+                if (pg.cur_set[role] == op_data->balanced_osd)
+                {
+                    read_set[role] = op_data->balanced_osd;
+                    break;
+                }
+            }
+            balanced_read_count[op_data->balanced_osd]++;
+            cur_op->buf = alloc_read_buffer(op_data->stripes, op_data->pg_data_size, 0);
+            submit_primary_subops(SUBMIT_RMW_READ, op_data->target_ver, read_set.data(), cur_op);
+            op_data->st = 1;
+        }
+        else if (pg.state == PG_ACTIVE || op_data->scheme == POOL_SCHEME_REPLICATED)
         {
             // Fast happy-path
             cur_op->buf = alloc_read_buffer(op_data->stripes, op_data->pg_data_size, 0);
@@ -222,6 +264,10 @@ void osd_t::continue_primary_read(osd_op_t *cur_op)
 resume_1:
     return;
 resume_2:
+    if (op_data->balanced_osd)
+    {
+        balanced_read_count[op_data->balanced_osd]--;
+    }
     if (op_data->errors > 0)
     {
         finish_op(cur_op, op_data->epipe > 0 ? -EPIPE : -EIO);
@@ -306,6 +352,7 @@ void osd_t::free_object_state(pg_t & pg, pg_osd_set_state_t **object_state)
 {
     if (*object_state && !(--(*object_state)->object_count))
     {
+        pg.state_ids[(*object_state)->set_id] = NULL;
         pg.state_dict.erase((*object_state)->osd_set);
         *object_state = NULL;
     }
@@ -356,10 +403,18 @@ resume_3:
         cur_op->reply.rw.version = op_data->fact_ver;
         goto continue_others;
     }
+    if (op_data->zero_del && !op_data->fact_ver)
+    {
+        // Zeroes written into a non-existing object, nothing to do
+        cur_op->reply.hdr.retval = cur_op->req.rw.len;
+        cur_op->reply.rw.version = 0;
+        goto continue_others;
+    }
     // Save version override for parallel reads
     pg.ver_override[op_data->oid] = op_data->fact_ver;
-    // Submit deletes
+    // Submit deletes. Their version is the new object version reported for zero writes
     op_data->fact_ver++;
+    op_data->target_ver = op_data->fact_ver;
     submit_primary_del_subops(cur_op, NULL, 0, op_data->object_state ? op_data->object_state->osd_set : pg.cur_loc_set);
 resume_4:
     op_data->st = 4;
@@ -372,6 +427,10 @@ resume_5:
     }
     // Remove version override
     pg.ver_override.erase(op_data->oid);
+    if (op_data->zero_del)
+    {
+        remember_zero_delete(cur_op, pg, op_data->object_state ? op_data->object_state->osd_set : pg.cur_loc_set);
+    }
     // Adjust PG stats after "instant stabilize", because we need object_state above
     if (!op_data->object_state)
     {
@@ -383,7 +442,13 @@ resume_5:
         free_object_state(pg, &op_data->object_state);
     }
     pg.total_count--;
-    cur_op->reply.hdr.retval = 0;
+    if (op_data->zero_del)
+    {
+        cur_op->reply.hdr.retval = cur_op->req.rw.len;
+        cur_op->reply.rw.version = op_data->target_ver;
+    }
+    else
+        cur_op->reply.hdr.retval = 0;
 continue_others:
     osd_op_t *next_op = NULL;
     auto next_it = pg.write_queue.find(op_data->oid);
@@ -400,3 +465,152 @@ continue_others:
         continue_primary_write(next_op);
     }
 }
+
+bool osd_t::prepare_primary_del_inode(osd_op_t *cur_op)
+{
+    inode_t inode = cur_op->req.del_inode.inode;
+    pool_id_t pool_id = INODE_POOL(inode);
+    auto pool_cfg_it = st_cli.pool_config.find(pool_id);
+    if (pool_cfg_it == st_cli.pool_config.end())
+    {
+        // Pool config is not loaded yet
+        finish_op(cur_op, -EPIPE);
+        return false;
+    }
+    auto pg_it = pgs.find({ .pool_id = pool_id, .pg_num = cur_op->req.del_inode.pg_num });
+    if (pg_it == pgs.end() || !(pg_it->second.state & PG_ACTIVE))
+    {
+        // This OSD is not primary for this PG or the PG is inactive
+        finish_op(cur_op, -EPIPE);
+        return false;
+    }
+    auto & pg = pg_it->second;
+    // Bulk delete makes deletions stable at once on all OSDs, so it's only allowed in clean PGs
+    // without any pending flushes, writes to the same inode or unstable writes.
+    // Otherwise the client should fall back to deleting objects one by one
+    if ((pg.state & (PG_DEGRADED | PG_LEFT_ON_DEAD | PG_HAS_INCOMPLETE | PG_HAS_DEGRADED |
+        PG_HAS_MISPLACED | PG_HAS_UNCLEAN | PG_HAS_INVALID)) || pg.flush_batch || pg.flush_actions.size() > 0 ||
+        immediate_commit != IMMEDIATE_ALL && syncs_in_progress.size() > 0)
+    {
+        finish_op(cur_op, -EBUSY);
+        return false;
+    }
+    auto wr_it = pg.write_queue.lower_bound((object_id){ .inode = inode, .stripe = 0 });
+    if (wr_it != pg.write_queue.end() && wr_it->first.inode == inode)
+    {
+        finish_op(cur_op, -EBUSY);
+        return false;
+    }
+    for (auto & uw: unstable_writes)
+    {
+        if (uw.first.oid.inode == inode)
+        {
+            finish_op(cur_op, -EBUSY);
+            return false;
+        }
+    }
+    int n_osds = 0;
+    for (auto osd_num: pg.cur_set)
+    {
+        if (osd_num && !contains_osd(pg.cur_set.data(), &osd_num - pg.cur_set.data(), osd_num))
+        {
+            n_osds++;
+        }
+    }
+    osd_primary_op_data_t *op_data = (osd_primary_op_data_t*)calloc_or_die(
+        1, sizeof(osd_primary_op_data_t) + n_osds * (sizeof(osd_num_t) + sizeof(object_id))
+    );
+    op_data->pg_num = pg.pg_num;
+    // Deletion is tracked in the write queue under a special object ID
+    // so that writes to the same inode are postponed until it completes
+    op_data->oid = { .inode = inode, .stripe = UINT64_MAX };
+    op_data->del_osds = (osd_num_t*)((uint8_t*)op_data + sizeof(osd_primary_op_data_t));
+    op_data->del_cursors = (object_id*)((uint8_t*)op_data->del_osds + n_osds * sizeof(osd_num_t));
+    op_data->del_osd_count = n_osds;
+    for (int i = 0, j = 0; i < pg.cur_set.size(); i++)
+    {
+        osd_num_t osd_num = pg.cur_set[i];
+        if (osd_num && !contains_osd(pg.cur_set.data(), i, osd_num))
+        {
+            op_data->del_osds[j] = osd_num;
+            op_data->del_cursors[j] = { .inode = inode, .stripe = cur_op->req.del_inode.min_offset };
+            j++;
+        }
+    }
+    cur_op->op_data = op_data;
+    pg.inflight++;
+    pg.write_queue.emplace(op_data->oid, cur_op);
+    return true;
+}
+
+void osd_t::continue_primary_del_inode(osd_op_t *cur_op)
+{
+    if (!cur_op->op_data && !prepare_primary_del_inode(cur_op))
+    {
+        return;
+    }
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    auto & pg = pgs.at({ .pool_id = INODE_POOL(op_data->oid.inode), .pg_num = op_data->pg_num });
+    if (op_data->st == 1)      goto resume_1;
+    else if (op_data->st == 2) goto resume_2;
+    else if (op_data->st == 3) goto resume_3;
+resume_1:
+    // Delete the next batch of objects on all OSDs which still have something to delete
+    op_data->del_batch_count = 0;
+    if (submit_primary_del_inode_subops(cur_op, pg))
+    {
+resume_2:
+        op_data->st = 2;
+        return;
+    }
+resume_3:
+    if (op_data->errors > 0)
+    {
+        cur_op->reply.hdr.retval = op_data->epipe > 0 ? -EPIPE : (op_data->del_busy > 0 ? -EBUSY : -EIO);
+        if (op_data->del_batch_count > 0 && (pg.state & PG_ACTIVE))
+        {
+            // Some OSDs already deleted their part of the batch and others didn't, so copies
+            // of these objects now differ. Repeer the PG when the operation finishes to find them
+            printf(
+                "[PG %u/%u] Bulk delete of inode %lx failed on some OSDs, repeering\n",
+                pg.pool_id, pg.pg_num, op_data->oid.inode
+            );
+            pg.state = pg.state & ~PG_ACTIVE | PG_REPEERING;
+            report_pg_state(pg);
+        }
+        goto continue_others;
+    }
+    // Adjust PG stats. All objects are clean because we don't run in unclean PGs
+    pg.clean_count -= pg.clean_count < op_data->del_local_count ? pg.clean_count : op_data->del_local_count;
+    pg.total_count -= pg.total_count < op_data->del_local_count ? pg.total_count : op_data->del_local_count;
+    op_data->del_local_count = 0;
+    for (int i = 0; i < op_data->del_osd_count; i++)
+    {
+        if (op_data->del_cursors[i].inode)
+        {
+            goto resume_1;
+        }
+    }
+    cur_op->reply.hdr.retval = 0;
+continue_others:
+    // Resume writes postponed during the deletion. They'll be requeued under their own object IDs
+    std::vector<osd_op_t*> continue_ops;
+    auto next_it = pg.write_queue.find(op_data->oid);
+    if (next_it != pg.write_queue.end() && next_it->second == cur_op)
+    {
+        pg.write_queue.erase(next_it++);
+        while (next_it != pg.write_queue.end() && next_it->first == op_data->oid)
+        {
+            continue_ops.push_back(next_it->second);
+            pg.write_queue.erase(next_it++);
+        }
+    }
+    finish_op(cur_op, cur_op->reply.hdr.retval);
+    for (auto op: continue_ops)
+    {
+        if (op->req.hdr.opcode == OSD_OP_DELETE)
+            continue_primary_del(op);
+        else
+            continue_primary_write(op);
+    }
+}
@@ -30,6 +30,13 @@ struct osd_primary_op_data_t
     osd_op_t *subops = NULL;
     uint64_t *prev_set = NULL;
     pg_osd_set_state_t *object_state = NULL;
+    // all-zero write in a replicated pool: skip it if the object doesn't exist,
+    // or delete the object instead of writing if it's a full-object write
+    bool zero_write = false, zero_del = false;
+    // queued writes to the same object merged into this one, linked through their op_data
+    osd_op_t *coalesced_next = NULL;
+    // replica chosen for a balanced read
+    osd_num_t balanced_osd = 0;
 
     union
     {
@@ -44,6 +51,8 @@ struct osd_primary_op_data_t
             obj_ver_id *unstable_writes;
             obj_ver_osd_t *copies_to_delete;
             int copies_to_delete_count;
+            // error of a previous sync which failed while this one was in progress
+            int prev_sync_error;
         };
         struct
         {
@@ -55,6 +64,17 @@ struct osd_primary_op_data_t
             osd_chain_read_t *chain_reads;
             int chain_read_count;
         };
+        struct
+        {
+            // for delete_inode
+            osd_num_t *del_osds;
+            object_id *del_cursors;
+            int del_osd_count;
+            int del_busy;
+            uint64_t del_local_count;
+            // objects deleted in the current batch, summed over all OSDs
+            uint64_t del_batch_count;
+        };
     };
 };
 
@@ -2,6 +2,7 @@
 // License: VNPL-1.1 (see README.md for details)
 
 #include "osd_primary.h"
+#include "radix_sort.h"
 
 void osd_t::autosync()
 {
@@ -31,14 +32,45 @@ void osd_t::autosync()
     }
 }
 
-void osd_t::finish_op(osd_op_t *cur_op, int retval)
+// Priority class of subops of a primary operation
+int osd_t::get_op_priority(osd_op_t *cur_op)
 {
-    inflight_ops--;
     if (cur_op->req.hdr.opcode == OSD_OP_READ ||
         cur_op->req.hdr.opcode == OSD_OP_WRITE ||
         cur_op->req.hdr.opcode == OSD_OP_DELETE)
     {
-        // Track inode statistics
+        return cur_op->req.rw.flags & OSD_OP_RW_PRIO_MASK;
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_DELETE_INODE)
+    {
+        return OSD_OP_PRIO_BACKGROUND;
+    }
+    return OSD_OP_PRIO_CLIENT;
+}
+
+void osd_t::finish_op(osd_op_t *cur_op, int retval)
+{
+    if (cur_op->op_data && cur_op->op_data->coalesced_next)
+    {
+        // Complete writes merged into this one with the same result
+        osd_op_t *next_op = cur_op->op_data->coalesced_next;
+        cur_op->op_data->coalesced_next = NULL;
+        while (next_op)
+        {
+            osd_op_t *following = next_op->op_data->coalesced_next;
+            next_op->op_data->coalesced_next = NULL;
+            next_op->reply.rw.version = cur_op->reply.rw.version;
+            finish_op(next_op, retval >= 0 ? (int)next_op->req.rw.len : retval);
+            next_op = following;
+        }
+    }
+    inflight_ops--;
+    if ((cur_op->req.hdr.opcode == OSD_OP_READ ||
+        cur_op->req.hdr.opcode == OSD_OP_WRITE ||
+        cur_op->req.hdr.opcode == OSD_OP_DELETE) &&
+        get_op_priority(cur_op) == OSD_OP_PRIO_CLIENT)
+    {
+        // Track inode statistics, but only for client operations, not for recovery
         if (!cur_op->tv_end.tv_sec)
         {
             clock_gettime(CLOCK_REALTIME, &cur_op->tv_end);
@@ -169,6 +201,7 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
                     .len = wr ? stripes[stripe_num].write_end - stripes[stripe_num].write_start : stripes[stripe_num].read_end - stripes[stripe_num].read_start,
                     .buf = wr ? stripes[stripe_num].write_buf : stripes[stripe_num].read_buf,
                     .bitmap = stripes[stripe_num].bmp_buf,
+                    .priority = (uint32_t)get_op_priority(cur_op),
                 });
 #ifdef OSD_DEBUG
                 printf(
@@ -182,7 +215,7 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
             else
             {
                 subop->op_type = OSD_OP_OUT;
-                subop->peer_fd = msgr.osd_peer_fds.at(role_osd_num);
+                subop->peer_fd = msgr.select_peer_fd(role_osd_num, op_data->oid);
                 subop->bitmap = stripes[stripe_num].bmp_buf;
                 subop->bitmap_len = clean_entry_bitmap_size;
                 subop->req.sec_rw = {
@@ -199,6 +232,7 @@ int osd_t::submit_primary_subop_batch(int submit_type, inode_t inode, uint64_t o
                     .offset = wr ? stripes[stripe_num].write_start : stripes[stripe_num].read_start,
                     .len = wr ? stripes[stripe_num].write_end - stripes[stripe_num].write_start : stripes[stripe_num].read_end - stripes[stripe_num].read_start,
                     .attr_len = wr ? clean_entry_bitmap_size : 0,
+                    .priority = (uint32_t)get_op_priority(cur_op),
                 };
 #ifdef OSD_DEBUG
                 printf(
@@ -244,6 +278,7 @@ static uint64_t bs_op_to_osd_op[] = {
     OSD_OP_SEC_LIST,            // BS_OP_LIST = 7
     OSD_OP_SEC_ROLLBACK,        // BS_OP_ROLLBACK = 8
     OSD_OP_TEST_SYNC_STAB_ALL,  // BS_OP_SYNC_STAB_ALL = 9
+    OSD_OP_SEC_DELETE_INODE,    // BS_OP_DELETE_INODE = 10
 };
 
 void osd_t::handle_primary_bs_subop(osd_op_t *subop)
@@ -252,6 +287,11 @@ void osd_t::handle_primary_bs_subop(osd_op_t *subop)
     blockstore_op_t *bs_op = subop->bs_op;
     int expected = bs_op->opcode == BS_OP_READ || bs_op->opcode == BS_OP_WRITE
         || bs_op->opcode == BS_OP_WRITE_STABLE ? bs_op->len : 0;
+    if (bs_op->opcode == BS_OP_DELETE_INODE && (bs_op->retval >= 0 || bs_op->retval == -EBUSY))
+    {
+        // Bulk delete returns the number of deleted objects or -EBUSY if there are unsynced writes
+        expected = bs_op->retval;
+    }
     if (bs_op->retval != expected && bs_op->opcode != BS_OP_READ)
     {
         // die
@@ -261,6 +301,7 @@ void osd_t::handle_primary_bs_subop(osd_op_t *subop)
         );
     }
     add_bs_subop_stats(subop);
+    append_pg_log(bs_op);
     subop->req.hdr.opcode = bs_op_to_osd_op[bs_op->opcode];
     subop->reply.hdr.retval = bs_op->retval;
     if (bs_op->opcode == BS_OP_READ || bs_op->opcode == BS_OP_WRITE || bs_op->opcode == BS_OP_WRITE_STABLE)
@@ -268,6 +309,14 @@ void osd_t::handle_primary_bs_subop(osd_op_t *subop)
         subop->req.sec_rw.len = bs_op->len;
         subop->reply.sec_rw.version = bs_op->version;
     }
+    else if (bs_op->opcode == BS_OP_DELETE_INODE)
+    {
+        if (bs_op->retval > 0)
+        {
+            free(bs_op->buf);
+        }
+        subop->reply.sec_del_inode.next_cursor = bs_op->list_cursor;
+    }
     delete bs_op;
     subop->bs_op = NULL;
     subop->peer_fd = -1;
@@ -306,6 +355,8 @@ void osd_t::handle_primary_subop(osd_op_t *subop, osd_op_t *cur_op)
         expected = subop->req.sec_rw.len;
     else if (opcode == OSD_OP_SEC_READ_BMP)
         expected = subop->req.sec_read_bmp.len / sizeof(obj_ver_id) * (8 + clean_entry_bitmap_size);
+    else if (opcode == OSD_OP_SEC_DELETE_INODE)
+        expected = retval >= 0 ? retval : 0;
     else
         expected = 0;
     osd_primary_op_data_t *op_data = cur_op->op_data;
@@ -317,7 +368,13 @@ void osd_t::handle_primary_subop(osd_op_t *subop, osd_op_t *cur_op)
             op_data->epipe++;
         }
         op_data->errors++;
-        if (subop->peer_fd >= 0)
+        if (opcode == OSD_OP_SEC_DELETE_INODE && (retval == -EBUSY || retval == -EINVAL))
+        {
+            // The peer has unsynced writes or doesn't support bulk deletes.
+            // It's not an error of the peer itself, the client should fall back to usual deletes
+            op_data->del_busy++;
+        }
+        else if (subop->peer_fd >= 0)
         {
             // Drop connection on any error
             msgr.stop_client(subop->peer_fd);
@@ -346,6 +403,16 @@ void osd_t::handle_primary_subop(osd_op_t *subop, osd_op_t *cur_op)
                 op_data->fact_ver = version;
             }
         }
+        else if (opcode == OSD_OP_SEC_DELETE_INODE)
+        {
+            int i = subop - op_data->subops;
+            op_data->del_cursors[i] = subop->reply.sec_del_inode.next_cursor;
+            op_data->del_batch_count += retval;
+            if (op_data->del_osds[i] == this->osd_num)
+            {
+                op_data->del_local_count += retval;
+            }
+        }
     }
     if ((op_data->errors + op_data->done) >= op_data->n_subops)
     {
@@ -368,6 +435,10 @@ void osd_t::handle_primary_subop(osd_op_t *subop, osd_op_t *cur_op)
         {
             continue_primary_del(cur_op);
         }
+        else if (cur_op->req.hdr.opcode == OSD_OP_DELETE_INODE)
+        {
+            continue_primary_del_inode(cur_op);
+        }
         else
         {
             throw std::runtime_error("BUG: unknown opcode");
@@ -457,6 +528,7 @@ void osd_t::submit_primary_del_batch(osd_op_t *cur_op, obj_ver_osd_t *chunks_to_
                 },
                 .oid = chunk.oid,
                 .version = chunk.version,
+                .priority = (uint32_t)get_op_priority(cur_op),
             });
             bs->enqueue_op(subops[i].bs_op);
         }
@@ -472,6 +544,7 @@ void osd_t::submit_primary_del_batch(osd_op_t *cur_op, obj_ver_osd_t *chunks_to_
                 },
                 .oid = chunk.oid,
                 .version = chunk.version,
+                .priority = (uint32_t)get_op_priority(cur_op),
             } };
             subops[i].callback = [cur_op, this](osd_op_t *subop)
             {
@@ -482,10 +555,12 @@ void osd_t::submit_primary_del_batch(osd_op_t *cur_op, obj_ver_osd_t *chunks_to_
     }
 }
 
-int osd_t::submit_primary_sync_subops(osd_op_t *cur_op)
+int osd_t::submit_primary_del_inode_subops(osd_op_t *cur_op, pg_t & pg)
 {
     osd_primary_op_data_t *op_data = cur_op->op_data;
-    int n_osds = op_data->dirty_osd_count;
+    int n_osds = op_data->del_osd_count;
+    uint64_t pg_stripe_size = st_cli.pool_config[pg.pool_id].pg_stripe_size;
+    pg_num_t pg_count = pg_counts[pg.pool_id];
     osd_op_t *subops = new osd_op_t[n_osds];
     op_data->done = op_data->errors = 0;
     op_data->n_subops = n_osds;
@@ -493,30 +568,48 @@ int osd_t::submit_primary_sync_subops(osd_op_t *cur_op)
     std::map<uint64_t, int>::iterator peer_it;
     for (int i = 0; i < n_osds; i++)
     {
-        osd_num_t sync_osd = op_data->dirty_osds[i];
-        if (sync_osd == this->osd_num)
+        osd_num_t del_osd = op_data->del_osds[i];
+        if (!op_data->del_cursors[i].inode)
+        {
+            // All objects are already deleted on this OSD
+            op_data->done++;
+        }
+        else if (del_osd == this->osd_num)
         {
             clock_gettime(CLOCK_REALTIME, &subops[i].tv_begin);
             subops[i].op_type = (uint64_t)cur_op;
             subops[i].bs_op = new blockstore_op_t({
-                .opcode = BS_OP_SYNC,
+                .opcode = BS_OP_DELETE_INODE,
                 .callback = [subop = &subops[i], this](blockstore_op_t *bs_subop)
                 {
                     handle_primary_bs_subop(subop);
                 },
+                .oid = {
+                    .inode = op_data->oid.inode,
+                    .stripe = pg_stripe_size,
+                },
+                .offset = pg.pg_num-1,
+                .len = pg_count,
+                .list_cursor = op_data->del_cursors[i],
+                .priority = BS_PRIO_BACKGROUND,
             });
             bs->enqueue_op(subops[i].bs_op);
         }
-        else if ((peer_it = msgr.osd_peer_fds.find(sync_osd)) != msgr.osd_peer_fds.end())
+        else if ((peer_it = msgr.osd_peer_fds.find(del_osd)) != msgr.osd_peer_fds.end())
         {
             subops[i].op_type = OSD_OP_OUT;
             subops[i].peer_fd = peer_it->second;
-            subops[i].req = (osd_any_op_t){ .sec_sync = {
+            subops[i].req = (osd_any_op_t){ .sec_del_inode = {
                 .header = {
                     .magic = SECONDARY_OSD_OP_MAGIC,
                     .id = msgr.next_subop_id++,
-                    .opcode = OSD_OP_SEC_SYNC,
+                    .opcode = OSD_OP_SEC_DELETE_INODE,
                 },
+                .inode = op_data->oid.inode,
+                .del_pg = pg.pg_num,
+                .pg_count = pg_count,
+                .pg_stripe_size = pg_stripe_size,
+                .cursor = op_data->del_cursors[i],
             } };
             subops[i].callback = [cur_op, this](osd_op_t *subop)
             {
@@ -526,10 +619,12 @@ int osd_t::submit_primary_sync_subops(osd_op_t *cur_op)
         }
         else
         {
-            op_data->done++;
+            // Peer is disconnected, the PG will be repeered
+            op_data->errors++;
+            op_data->epipe++;
         }
     }
-    if (op_data->done >= op_data->n_subops)
+    if (op_data->done + op_data->errors >= op_data->n_subops)
     {
         delete[] op_data->subops;
         op_data->subops = NULL;
@@ -538,52 +633,192 @@ int osd_t::submit_primary_sync_subops(osd_op_t *cur_op)
     return 1;
 }
 
-void osd_t::submit_primary_stab_subops(osd_op_t *cur_op)
+int osd_t::submit_primary_sync_subops(osd_op_t *cur_op)
 {
     osd_primary_op_data_t *op_data = cur_op->op_data;
-    int n_osds = op_data->unstable_write_osds->size();
+    int n_osds = op_data->dirty_osd_count;
     osd_op_t *subops = new osd_op_t[n_osds];
     op_data->done = op_data->errors = 0;
     op_data->n_subops = n_osds;
     op_data->subops = subops;
+    std::map<uint64_t, int>::iterator peer_it;
     for (int i = 0; i < n_osds; i++)
     {
-        auto & stab_osd = (*(op_data->unstable_write_osds))[i];
-        if (stab_osd.osd_num == this->osd_num)
+        osd_num_t sync_osd = op_data->dirty_osds[i];
+        if (sync_osd == this->osd_num)
         {
             clock_gettime(CLOCK_REALTIME, &subops[i].tv_begin);
             subops[i].op_type = (uint64_t)cur_op;
-            subops[i].bs_op = new blockstore_op_t((blockstore_op_t){
-                .opcode = BS_OP_STABLE,
+            subops[i].bs_op = new blockstore_op_t({
+                .opcode = BS_OP_SYNC,
                 .callback = [subop = &subops[i], this](blockstore_op_t *bs_subop)
                 {
                     handle_primary_bs_subop(subop);
                 },
-                .len = (uint32_t)stab_osd.len,
-                .buf = (void*)(op_data->unstable_writes + stab_osd.start),
             });
             bs->enqueue_op(subops[i].bs_op);
         }
-        else
+        else if ((peer_it = msgr.osd_peer_fds.find(sync_osd)) != msgr.osd_peer_fds.end())
         {
             subops[i].op_type = OSD_OP_OUT;
-            subops[i].peer_fd = msgr.osd_peer_fds.at(stab_osd.osd_num);
-            subops[i].req = (osd_any_op_t){ .sec_stab = {
+            subops[i].peer_fd = peer_it->second;
+            subops[i].req = (osd_any_op_t){ .sec_sync = {
                 .header = {
                     .magic = SECONDARY_OSD_OP_MAGIC,
                     .id = msgr.next_subop_id++,
-                    .opcode = OSD_OP_SEC_STABILIZE,
+                    .opcode = OSD_OP_SEC_SYNC,
                 },
-                .len = (uint64_t)(stab_osd.len * sizeof(obj_ver_id)),
             } };
-            subops[i].iov.push_back(op_data->unstable_writes + stab_osd.start, stab_osd.len * sizeof(obj_ver_id));
             subops[i].callback = [cur_op, this](osd_op_t *subop)
             {
                 handle_primary_subop(subop, cur_op);
             };
             msgr.outbox_push(&subops[i]);
         }
+        else
+        {
+            op_data->done++;
+        }
+    }
+    if (op_data->done >= op_data->n_subops)
+    {
+        delete[] op_data->subops;
+        op_data->subops = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// STABILIZE requests of all syncs and writes to the same OSD are merged while
+// a previous request to it is in flight, so there are less small messages and journal entries
+void osd_t::submit_primary_stab_subops(osd_op_t *cur_op)
+{
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    int n_osds = op_data->unstable_write_osds->size();
+    osd_op_t *subops = new osd_op_t[n_osds];
+    op_data->done = op_data->errors = 0;
+    op_data->n_subops = n_osds;
+    op_data->subops = subops;
+    uint32_t priority = get_op_priority(cur_op);
+    // Copy the list because cur_op may complete in the last submit_stab_batch()
+    std::vector<unstable_osd_num_t> stab_osds = *(op_data->unstable_write_osds);
+    obj_ver_id *unstable_writes = op_data->unstable_writes;
+    for (int i = 0; i < n_osds; i++)
+    {
+        auto & stab_osd = stab_osds[i];
+        auto & batch = stab_batches[stab_osd.osd_num];
+        batch.versions.insert(
+            batch.versions.end(), unstable_writes + stab_osd.start,
+            unstable_writes + stab_osd.start + stab_osd.len
+        );
+        batch.waiting.push_back((osd_stab_wait_t){ .subop = &subops[i], .cur_op = cur_op });
+        if (batch.priority > priority)
+            batch.priority = priority;
+        if (!batch.in_flight)
+            submit_stab_batch(stab_osd.osd_num);
+    }
+}
+
+void osd_t::submit_stab_batch(osd_num_t peer_osd)
+{
+    auto & batch = stab_batches[peer_osd];
+    // Stabilizing a version also stabilizes all previous versions, so only leave the newest one
+    radix_sort(batch.versions);
+    int count = 0;
+    for (int i = 0; i < batch.versions.size(); i++)
+    {
+        if (i == batch.versions.size()-1 || batch.versions[i].oid != batch.versions[i+1].oid)
+            batch.versions[count++] = batch.versions[i];
+    }
+    std::vector<osd_stab_wait_t> waiting;
+    std::swap(waiting, batch.waiting);
+    uint32_t priority = batch.priority;
+    osd_op_t *op = new osd_op_t;
+    op->buf = malloc_or_die(sizeof(obj_ver_id) * count);
+    memcpy(op->buf, batch.versions.data(), sizeof(obj_ver_id) * count);
+    batch.versions.clear();
+    batch.priority = OSD_OP_PRIO_BACKGROUND;
+    batch.in_flight = true;
+    stab_stat_count[0]++;
+    stab_stat_objects[0] += count;
+    if (peer_osd == this->osd_num)
+    {
+        clock_gettime(CLOCK_REALTIME, &op->tv_begin);
+        op->bs_op = new blockstore_op_t((blockstore_op_t){
+            .opcode = BS_OP_STABLE,
+            .callback = [this, op, peer_osd, waiting](blockstore_op_t *bs_op) mutable
+            {
+                if (bs_op->retval != 0)
+                {
+                    // die
+                    throw std::runtime_error(
+                        "local blockstore modification failed (opcode = "+std::to_string(bs_op->opcode)+
+                        " retval = "+std::to_string(bs_op->retval)+")"
+                    );
+                }
+                add_bs_subop_stats(op);
+                append_pg_log(bs_op);
+                delete bs_op;
+                op->bs_op = NULL;
+                delete op;
+                handle_stab_batch(peer_osd, waiting, 0);
+            },
+            .len = (uint32_t)count,
+            .buf = op->buf,
+            .priority = priority,
+        });
+        bs->enqueue_op(op->bs_op);
+        return;
+    }
+    auto peer_fd_it = msgr.osd_peer_fds.find(peer_osd);
+    if (peer_fd_it == msgr.osd_peer_fds.end())
+    {
+        delete op;
+        handle_stab_batch(peer_osd, waiting, -EPIPE);
+        return;
+    }
+    op->op_type = OSD_OP_OUT;
+    op->peer_fd = peer_fd_it->second;
+    op->req = (osd_any_op_t){ .sec_stab = {
+        .header = {
+            .magic = SECONDARY_OSD_OP_MAGIC,
+            .id = msgr.next_subop_id++,
+            .opcode = OSD_OP_SEC_STABILIZE,
+        },
+        .len = (uint64_t)(count * sizeof(obj_ver_id)),
+        .priority = priority,
+    } };
+    op->iov.push_back(op->buf, count * sizeof(obj_ver_id));
+    op->callback = [this, peer_osd, waiting](osd_op_t *op) mutable
+    {
+        int retval = op->reply.hdr.retval;
+        if (retval != 0 && op->peer_fd >= 0)
+        {
+            // Drop connection on any error
+            msgr.stop_client(op->peer_fd);
+        }
+        delete op;
+        handle_stab_batch(peer_osd, waiting, retval);
+    };
+    msgr.outbox_push(op);
+}
+
+void osd_t::handle_stab_batch(osd_num_t peer_osd, std::vector<osd_stab_wait_t> & waiting, int retval)
+{
+    for (auto & w: waiting)
+    {
+        // The connection is already dropped on error
+        w.subop->req.hdr.opcode = OSD_OP_SEC_STABILIZE;
+        w.subop->reply.hdr.retval = retval;
+        w.subop->peer_fd = -1;
+        handle_primary_subop(w.subop, w.cur_op);
     }
+    auto & batch = stab_batches[peer_osd];
+    batch.in_flight = false;
+    if (batch.waiting.size())
+        submit_stab_batch(peer_osd);
+    else
+        stab_batches.erase(peer_osd);
 }
 
 void osd_t::pg_cancel_write_queue(pg_t & pg, osd_op_t *first_op, object_id oid, int retval)
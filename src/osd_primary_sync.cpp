@@ -4,6 +4,9 @@
 #include "osd_primary.h"
 
 // Save and clear unstable_writes -> SYNC all -> STABLE all
+// Syncs run in parallel, each with its own snapshot of unstable_writes, but results are returned
+// in order because each sync also covers writes saved by all previous syncs still in progress.
+// A sync with nothing new to save just waits for previous ones
 void osd_t::continue_primary_sync(osd_op_t *cur_op)
 {
     if (!cur_op->op_data)
@@ -11,32 +14,17 @@ void osd_t::continue_primary_sync(osd_op_t *cur_op)
         cur_op->op_data = (osd_primary_op_data_t*)calloc_or_die(1, sizeof(osd_primary_op_data_t));
     }
     osd_primary_op_data_t *op_data = cur_op->op_data;
-    if (op_data->st == 1)      goto resume_1;
-    else if (op_data->st == 2) goto resume_2;
-    else if (op_data->st == 3) goto resume_3;
+    if (op_data->st == 3)      goto resume_3;
     else if (op_data->st == 4) goto resume_4;
     else if (op_data->st == 5) goto resume_5;
     else if (op_data->st == 6) goto resume_6;
     else if (op_data->st == 7) goto resume_7;
     else if (op_data->st == 8) goto resume_8;
     assert(op_data->st == 0);
-    if (syncs_in_progress.size() > 0)
-    {
-        // Wait for previous syncs, if any
-        // FIXME: We may try to execute the current one in parallel, like in Blockstore, but I'm not sure if it matters at all
-        syncs_in_progress.push_back(cur_op);
-        op_data->st = 1;
-resume_1:
-        return;
-    }
-    else
-    {
-        syncs_in_progress.push_back(cur_op);
-    }
-resume_2:
+    syncs_in_progress.push_back(cur_op);
     if (dirty_osds.size() == 0)
     {
-        // Nothing to sync
+        // Nothing new to sync
         goto finish;
     }
     // Save and clear unstable_writes
@@ -238,28 +226,41 @@ resume_8:
         op_data->unstable_writes = NULL;
         op_data->unstable_write_osds = NULL;
     }
-    if (op_data->errors > 0)
+finish:
+    op_data->st = 9;
+    if (syncs_in_progress.front() != cur_op)
     {
-        finish_op(cur_op, op_data->epipe > 0 ? -EPIPE : -EIO);
+        // Wait for previous syncs
+        return;
     }
-    else
+reply:
     {
-finish:
-        if (cur_op->peer_fd)
+        int retval = op_data->errors > 0 ? (op_data->epipe > 0 ? -EPIPE : -EIO) : op_data->prev_sync_error;
+        if (retval < 0)
+        {
+            // Writes saved by this sync are returned to unstable_writes, but syncs
+            // started before that don't cover them, so they fail too
+            for (auto other_op: syncs_in_progress)
+            {
+                if (!other_op->op_data->prev_sync_error)
+                    other_op->op_data->prev_sync_error = retval;
+            }
+        }
+        else if (cur_op->peer_fd)
         {
             auto it = msgr.clients.find(cur_op->peer_fd);
             if (it != msgr.clients.end())
                 it->second->dirty_pgs.clear();
         }
-        finish_op(cur_op, 0);
+        assert(syncs_in_progress.front() == cur_op);
+        syncs_in_progress.pop_front();
+        finish_op(cur_op, retval);
     }
-    assert(syncs_in_progress.front() == cur_op);
-    syncs_in_progress.pop_front();
-    if (syncs_in_progress.size() > 0)
+    if (syncs_in_progress.size() > 0 && syncs_in_progress.front()->op_data->st == 9)
     {
+        // Return results of already completed next syncs
         cur_op = syncs_in_progress.front();
         op_data = cur_op->op_data;
-        op_data->st++;
-        goto resume_2;
+        goto reply;
     }
 }
@@ -7,6 +7,17 @@
 bool osd_t::check_write_queue(osd_op_t *cur_op, pg_t & pg)
 {
     osd_primary_op_data_t *op_data = cur_op->op_data;
+    // Check if the whole inode is being deleted
+    auto del_it = pg.write_queue.find((object_id){
+        .inode = op_data->oid.inode,
+        .stripe = UINT64_MAX,
+    });
+    if (del_it != pg.write_queue.end())
+    {
+        // Postpone the request until the deletion completes
+        pg.write_queue.emplace(del_it->first, cur_op);
+        return false;
+    }
     // Check if actions are pending for this object
     auto act_it = pg.flush_actions.lower_bound((obj_piece_id_t){
         .oid = op_data->oid,
@@ -31,6 +42,63 @@ bool osd_t::check_write_queue(osd_op_t *cur_op, pg_t & pg)
     return true;
 }
 
+// Merge writes waiting in the queue just after cur_op into it while their ranges overlap or
+// adjoin the merged range. They are written with a single version and completed in finish_op()
+void osd_t::coalesce_writes(osd_op_t *cur_op, pg_t & pg)
+{
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    if (cur_op->req.rw.version || op_data->zero_write || op_data->coalesced_next)
+    {
+        return;
+    }
+    auto first_it = pg.write_queue.find(op_data->oid);
+    if (first_it == pg.write_queue.end() || first_it->second != cur_op)
+    {
+        return;
+    }
+    first_it++;
+    uint64_t start = cur_op->req.rw.offset, end = cur_op->req.rw.offset + cur_op->req.rw.len;
+    auto it = first_it;
+    while (it != pg.write_queue.end() && it->first == op_data->oid)
+    {
+        osd_op_t *next_op = it->second;
+        // Writes waiting for previous writes have st == 1, others wait for something else
+        if (next_op->req.hdr.opcode != OSD_OP_WRITE || next_op->op_data->st != 1 ||
+            next_op->req.rw.version || next_op->op_data->zero_write ||
+            next_op->req.rw.offset > end || next_op->req.rw.offset + next_op->req.rw.len < start)
+        {
+            break;
+        }
+        start = next_op->req.rw.offset < start ? next_op->req.rw.offset : start;
+        end = next_op->req.rw.offset + next_op->req.rw.len > end ? next_op->req.rw.offset + next_op->req.rw.len : end;
+        it++;
+    }
+    if (it == first_it)
+    {
+        return;
+    }
+    // Later writes overwrite earlier ones
+    void *buf = memalign_or_die(MEM_ALIGNMENT, end - start);
+    memcpy((uint8_t*)buf + (cur_op->req.rw.offset - start), cur_op->buf, cur_op->req.rw.len);
+    osd_op_t **tail = &op_data->coalesced_next;
+    while (first_it != it)
+    {
+        osd_op_t *next_op = first_it->second;
+        memcpy((uint8_t*)buf + (next_op->req.rw.offset - start), next_op->buf, next_op->req.rw.len);
+        *tail = next_op;
+        tail = &next_op->op_data->coalesced_next;
+        pg.write_queue.erase(first_it++);
+    }
+    free(cur_op->buf);
+    cur_op->buf = buf;
+    int stripe_count = (op_data->scheme == POOL_SCHEME_REPLICATED ? 1 : op_data->pg_size);
+    for (int role = 0; role < stripe_count; role++)
+    {
+        op_data->stripes[role].req_start = op_data->stripes[role].req_end = 0;
+    }
+    split_stripes(op_data->pg_data_size, bs_block_size, (uint32_t)(start - op_data->oid.stripe), end - start, op_data->stripes);
+}
+
 void osd_t::continue_primary_write(osd_op_t *cur_op)
 {
     if (!cur_op->op_data && !prepare_primary_rw(cur_op))
@@ -39,6 +107,12 @@ void osd_t::continue_primary_write(osd_op_t *cur_op)
     }
     osd_primary_op_data_t *op_data = cur_op->op_data;
     auto & pg = pgs.at({ .pool_id = INODE_POOL(op_data->oid.inode), .pg_num = op_data->pg_num });
+    if (op_data->st == 0 ? check_zero_write(cur_op, pg) : op_data->zero_del)
+    {
+        // Full-object zero write is executed as a delete
+        continue_primary_del(cur_op);
+        return;
+    }
     if (op_data->st == 1)      goto resume_1;
     else if (op_data->st == 2) goto resume_2;
     else if (op_data->st == 3) goto resume_3;
@@ -55,6 +129,7 @@ void osd_t::continue_primary_write(osd_op_t *cur_op)
         return;
     }
 resume_1:
+    coalesce_writes(cur_op, pg);
     // Determine blocks to read and write
     // Missing chunks are allowed to be overwritten even in incomplete objects
     // FIXME: Allow to do small writes to the old (degraded/misplaced) OSD set for lower performance impact
@@ -103,6 +178,13 @@ resume_3:
         cur_op->reply.rw.version = op_data->fact_ver;
         goto continue_others;
     }
+    if (op_data->zero_write && !op_data->fact_ver)
+    {
+        // Zeroes written into a non-existing object, nothing to do
+        cur_op->reply.hdr.retval = cur_op->req.rw.len;
+        cur_op->reply.rw.version = 0;
+        goto continue_others;
+    }
     if (op_data->scheme == POOL_SCHEME_REPLICATED)
     {
         // Set bitmap bits
@@ -286,6 +368,68 @@ continue_others:
     }
 }
 
+static bool is_zero_buffer(void *buf, uint64_t len)
+{
+    // Check the first 8 bytes, then compare the buffer with itself shifted by 8 bytes.
+    // memcmp() is vectorized in libc, so it's much faster than a naive loop
+    if (len < 8)
+    {
+        for (uint64_t i = 0; i < len; i++)
+            if (((uint8_t*)buf)[i])
+                return false;
+        return true;
+    }
+    return *(uint64_t*)buf == 0 && !memcmp(buf, (uint8_t*)buf + 8, len - 8);
+}
+
+// Check if the write only contains zeroes and can be optimized. Returns true if the write
+// should be executed as a delete. Only done in replicated pools for inodes without parents,
+// because deleting or skipping data in a layer makes parent data visible through it
+bool osd_t::check_zero_write(osd_op_t *cur_op, pg_t & pg)
+{
+    osd_primary_op_data_t *op_data = cur_op->op_data;
+    if (!op_data->zero_write)
+    {
+        if (!detect_zero_writes || op_data->scheme != POOL_SCHEME_REPLICATED ||
+            !cur_op->req.rw.len || !is_zero_buffer(cur_op->buf, cur_op->req.rw.len))
+        {
+            return false;
+        }
+        auto inode_it = st_cli.inode_config.find(cur_op->req.rw.inode);
+        if (inode_it != st_cli.inode_config.end() && inode_it->second.parent_id)
+        {
+            return false;
+        }
+        op_data->zero_write = true;
+    }
+    // Re-checked every time the operation is restarted from the beginning because
+    // delete is forbidden in degraded PGs. Zeroes are written as usual in that case
+    op_data->zero_del = cur_op->req.rw.len == bs_block_size &&
+        !(pg.state & (PG_DEGRADED | PG_LEFT_ON_DEAD));
+    return op_data->zero_del;
+}
+
+// Deletions are stable as soon as they are synced, so for a zero write converted
+// to a delete we only have to remember to sync OSDs when immediate_commit is off
+void osd_t::remember_zero_delete(osd_op_t *cur_op, pg_t & pg, pg_osd_set_t & loc_set)
+{
+    if (immediate_commit == IMMEDIATE_ALL)
+    {
+        return;
+    }
+    unstable_write_count++;
+    for (auto & chunk: loc_set)
+    {
+        this->dirty_osds.insert(chunk.osd_num);
+    }
+    auto cl_it = msgr.clients.find(cur_op->peer_fd);
+    if (cl_it != msgr.clients.end())
+    {
+        cl_it->second->dirty_pgs.insert({ .pool_id = pg.pool_id, .pg_num = pg.pg_num });
+    }
+    dirty_pgs.insert({ .pool_id = pg.pool_id, .pg_num = pg.pg_num });
+}
+
 bool osd_t::remember_unstable_write(osd_op_t *cur_op, pg_t & pg, pg_osd_set_t & loc_set, int base_state)
 {
     osd_primary_op_data_t *op_data = cur_op->op_data;
@@ -0,0 +1,71 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include "osd.h"
+
+static uint64_t qos_now_ns()
+{
+    timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec*1000000000 + tv.tv_nsec;
+}
+
+// Returns the time in microseconds to delay a primary read or write exceeding IOPS or MB/s limits
+// of the inode or its pool, or 0 if it may start now. Limits are token buckets in the GCRA form:
+// each bucket remembers the theoretical arrival time of the next operation, and an operation may
+// start at most qos_burst_us before it. Operations are only charged when they start.
+// The messenger calls it for client operations before giving them an execution slot,
+// internal recovery and rebalance operations don't go through it and bypass buckets
+uint64_t osd_t::qos_delay_op(osd_op_t *cur_op)
+{
+    if (cur_op->req.hdr.opcode != OSD_OP_READ && cur_op->req.hdr.opcode != OSD_OP_WRITE)
+    {
+        return 0;
+    }
+    inode_t inode = cur_op->req.rw.inode;
+    uint64_t iops[2] = { 0 }, mbs[2] = { 0 };
+    auto inode_it = st_cli.inode_config.find(inode);
+    if (inode_it != st_cli.inode_config.end())
+    {
+        iops[0] = inode_it->second.qos_iops;
+        mbs[0] = inode_it->second.qos_mbs;
+    }
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(inode));
+    if (pool_it != st_cli.pool_config.end())
+    {
+        iops[1] = pool_it->second.qos_iops;
+        mbs[1] = pool_it->second.qos_mbs;
+    }
+    if (!iops[0] && !mbs[0] && !iops[1] && !mbs[1])
+    {
+        return 0;
+    }
+    osd_qos_bucket_t *buckets[2] = {
+        iops[0] || mbs[0] ? &inode_qos[inode] : NULL,
+        iops[1] || mbs[1] ? &pool_qos[INODE_POOL(inode)] : NULL,
+    };
+    uint64_t now = qos_now_ns(), burst = qos_burst_us*1000;
+    uint64_t start = now;
+    for (int i = 0; i < 2; i++)
+    {
+        if (iops[i] && buckets[i]->iops_tat > start+burst)
+            start = buckets[i]->iops_tat-burst;
+        if (mbs[i] && buckets[i]->bytes_tat > start+burst)
+            start = buckets[i]->bytes_tat-burst;
+    }
+    if (start > now)
+    {
+        uint64_t wait_us = (start-now+999)/1000;
+        int inode_st_op = cur_op->req.hdr.opcode == OSD_OP_READ ? INODE_STATS_READ : INODE_STATS_WRITE;
+        inode_stats[inode].op_qos_usec[inode_st_op] += wait_us;
+        return wait_us;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        if (iops[i])
+            buckets[i]->iops_tat = std::max(buckets[i]->iops_tat, now) + 1000000000/iops[i];
+        if (mbs[i])
+            buckets[i]->bytes_tat = std::max(buckets[i]->bytes_tat, now) + (uint64_t)cur_op->req.rw.len*1000000000/(mbs[i]*1024*1024);
+    }
+    return 0;
+}
@@ -7,6 +7,13 @@
 
 void osd_t::secondary_op_callback(osd_op_t *op)
 {
+    if (op->req.hdr.opcode == OSD_OP_SEC_READ && op->req.sec_rw.pg_primary && op->bs_op->retval >= 0 &&
+        !bs->is_latest_stable(op->req.sec_rw.oid, op->bs_op->version))
+    {
+        // Direct read returned an unstable version or raced with a write. The primary may still
+        // hide such version or roll it back, so the client has to retry the read through it
+        op->bs_op->retval = -EAGAIN;
+    }
     if (op->req.hdr.opcode == OSD_OP_SEC_READ ||
         op->req.hdr.opcode == OSD_OP_SEC_WRITE ||
         op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE)
@@ -35,6 +42,20 @@ void osd_t::secondary_op_callback(osd_op_t *op)
             op->iov.push_back(op->buf, op->bs_op->retval * sizeof(obj_ver_id));
         }
         op->reply.sec_list.stable_count = op->bs_op->version;
+        op->reply.sec_list.next_cursor = op->bs_op->list_cursor;
+    }
+    else if (op->req.hdr.opcode == OSD_OP_SEC_DELETE_INODE)
+    {
+        op->reply.sec_del_inode.next_cursor = op->bs_op->list_cursor;
+    }
+    if (op->bs_op->retval >= 0)
+    {
+        append_pg_log(op->bs_op);
+    }
+    if (op->req.hdr.opcode == OSD_OP_SEC_DELETE_INODE && op->bs_op->retval > 0)
+    {
+        // deleted object list is allocated by blockstore, we don't need it
+        free(op->bs_op->buf);
     }
     int retval = op->bs_op->retval;
     delete op->bs_op;
@@ -42,6 +63,25 @@ void osd_t::secondary_op_callback(osd_op_t *op)
     finish_op(op, retval);
 }
 
+// Direct reads are only served if this OSD sees the same active PG state, with the same
+// primary, as the client, and is still the holder of the requested chunk in it
+bool osd_t::check_direct_read(osd_op_t *cur_op)
+{
+    object_id oid = cur_op->req.sec_rw.oid;
+    auto pool_it = st_cli.pool_config.find(INODE_POOL(oid.inode));
+    if (pool_it == st_cli.pool_config.end())
+    {
+        return false;
+    }
+    auto pg_it = pool_it->second.pg_config.find(map_to_pg(oid, pool_it->second.pg_stripe_size));
+    uint64_t role = oid.stripe & STRIPE_MASK;
+    return pg_it != pool_it->second.pg_config.end() &&
+        pg_it->second.cur_state == PG_ACTIVE &&
+        pg_it->second.cur_primary == cur_op->req.sec_rw.pg_primary &&
+        pg_it->second.state_revision == cur_op->req.sec_rw.pg_state_revision &&
+        role < pg_it->second.cur_set.size() && pg_it->second.cur_set[role] == this->osd_num;
+}
+
 void osd_t::exec_secondary(osd_op_t *cur_op)
 {
     if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ_BMP)
@@ -63,6 +103,28 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
         finish_op(cur_op, n * (8 + clean_entry_bitmap_size));
         return;
     }
+    if (cur_op->req.hdr.opcode == OSD_OP_SEC_GET_LOG)
+    {
+        osd_pg_log_entry_t *entries = NULL;
+        int count = read_pg_log(
+            cur_op->req.sec_get_log.pool_id, cur_op->req.sec_get_log.pg_num, cur_op->req.sec_get_log.pg_count,
+            cur_op->req.sec_get_log.log_id, cur_op->req.sec_get_log.log_pos, &entries
+        );
+        cur_op->reply.sec_get_log.log_pos = pg_log_pos;
+        if (count > 0)
+        {
+            cur_op->buf = entries;
+            cur_op->iov.push_back(cur_op->buf, count * sizeof(osd_pg_log_entry_t));
+        }
+        finish_op(cur_op, count);
+        return;
+    }
+    if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ && cur_op->req.sec_rw.pg_primary && !check_direct_read(cur_op))
+    {
+        // Client's view of the PG is stale, it will retry the read through the primary
+        finish_op(cur_op, -EPIPE);
+        return;
+    }
     cur_op->bs_op = new blockstore_op_t();
     cur_op->bs_op->callback = [this, cur_op](blockstore_op_t* bs_op) { secondary_op_callback(cur_op); };
     cur_op->bs_op->opcode = (cur_op->req.hdr.opcode == OSD_OP_SEC_READ ? BS_OP_READ
@@ -73,7 +135,8 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
         : (cur_op->req.hdr.opcode == OSD_OP_SEC_ROLLBACK ? BS_OP_ROLLBACK
         : (cur_op->req.hdr.opcode == OSD_OP_SEC_DELETE ? BS_OP_DELETE
         : (cur_op->req.hdr.opcode == OSD_OP_SEC_LIST ? BS_OP_LIST
-        : -1))))))));
+        : (cur_op->req.hdr.opcode == OSD_OP_SEC_DELETE_INODE ? BS_OP_DELETE_INODE
+        : -1)))))))));
     if (cur_op->req.hdr.opcode == OSD_OP_SEC_READ ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE ||
         cur_op->req.hdr.opcode == OSD_OP_SEC_WRITE_STABLE)
@@ -94,6 +157,7 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
         cur_op->bs_op->len = cur_op->req.sec_rw.len;
         cur_op->bs_op->buf = cur_op->buf;
         cur_op->bs_op->bitmap = cur_op->bitmap;
+        cur_op->bs_op->priority = cur_op->req.sec_rw.priority;
 #ifdef OSD_STUB
         cur_op->bs_op->retval = cur_op->bs_op->len;
 #endif
@@ -102,6 +166,7 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
     {
         cur_op->bs_op->oid = cur_op->req.sec_del.oid;
         cur_op->bs_op->version = cur_op->req.sec_del.version;
+        cur_op->bs_op->priority = cur_op->req.sec_del.priority;
 #ifdef OSD_STUB
         cur_op->bs_op->retval = 0;
 #endif
@@ -111,6 +176,7 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
     {
         cur_op->bs_op->len = cur_op->req.sec_stab.len/sizeof(obj_ver_id);
         cur_op->bs_op->buf = cur_op->buf;
+        cur_op->bs_op->priority = cur_op->req.sec_stab.priority;
 #ifdef OSD_STUB
         cur_op->bs_op->retval = 0;
 #endif
@@ -130,9 +196,40 @@ void osd_t::exec_secondary(osd_op_t *cur_op)
         cur_op->bs_op->offset = cur_op->req.sec_list.list_pg - 1;
         cur_op->bs_op->oid.inode = cur_op->req.sec_list.min_inode;
         cur_op->bs_op->version = cur_op->req.sec_list.max_inode;
+        cur_op->bs_op->list_cursor = cur_op->req.sec_list.cursor;
+        cur_op->bs_op->list_stable_limit = cur_op->req.sec_list.stable_limit;
+        cur_op->bs_op->priority = BS_PRIO_BACKGROUND;
+        // Changes after this position aren't guaranteed to be included in the listing
+        cur_op->reply.sec_list.log_id = peering_log_size ? pg_log_id : 0;
+        cur_op->reply.sec_list.log_pos = pg_log_pos;
 #ifdef OSD_STUB
         cur_op->bs_op->retval = 0;
         cur_op->bs_op->buf = NULL;
+        cur_op->bs_op->list_cursor = { 0 };
+#endif
+    }
+    else if (cur_op->req.hdr.opcode == OSD_OP_SEC_DELETE_INODE)
+    {
+        if (!cur_op->req.sec_del_inode.del_pg || cur_op->req.sec_del_inode.pg_count < cur_op->req.sec_del_inode.del_pg)
+        {
+            // requested pg number is greater than total pg count
+            printf(
+                "Invalid DELETE_INODE request: pg count %u < pg number %u\n",
+                cur_op->req.sec_del_inode.pg_count, cur_op->req.sec_del_inode.del_pg
+            );
+            cur_op->bs_op->retval = -EINVAL;
+            secondary_op_callback(cur_op);
+            return;
+        }
+        cur_op->bs_op->oid.inode = cur_op->req.sec_del_inode.inode;
+        cur_op->bs_op->oid.stripe = cur_op->req.sec_del_inode.pg_stripe_size;
+        cur_op->bs_op->len = cur_op->req.sec_del_inode.pg_count;
+        cur_op->bs_op->offset = cur_op->req.sec_del_inode.del_pg - 1;
+        cur_op->bs_op->list_cursor = cur_op->req.sec_del_inode.cursor;
+        cur_op->bs_op->priority = BS_PRIO_BACKGROUND;
+#ifdef OSD_STUB
+        cur_op->bs_op->retval = 0;
+        cur_op->bs_op->list_cursor = { 0 };
 #endif
     }
 #ifdef OSD_STUB
@@ -179,6 +276,12 @@ void osd_t::exec_show_config(osd_op_t *cur_op)
         }
     }
 #endif
+    if (req_json["connect_shm"].bool_value() && msgr.accept_shm(cur_op->peer_fd))
+    {
+        // Peer is on the same host, offer it a shared memory connection
+        wire_config["shm_socket"] = msgr.get_shm_socket();
+        wire_config["shm_token"] = msgr.clients.at(cur_op->peer_fd)->shm_conn->token;
+    }
     if (cur_op->buf)
         free(cur_op->buf);
     std::string cfg_str = json11::Json(wire_config).dump();
@@ -181,7 +181,7 @@ bool check_reply(int r, osd_any_op_t & op, osd_any_reply_t & reply, int expected
 
 uint64_t test_read(int connect_fd, uint64_t inode, uint64_t stripe, uint64_t version, uint64_t offset, uint64_t len)
 {
-    osd_any_op_t op;
+    osd_any_op_t op = { 0 };
     osd_any_reply_t reply;
     op.hdr.magic = SECONDARY_OSD_OP_MAGIC;
     op.hdr.id = 1;
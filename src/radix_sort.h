@@ -0,0 +1,92 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#include "malloc_or_die.h"
+
+// Smaller lists are sorted by std::sort()
+#define RADIX_SORT_MIN 1024
+
+// LSD radix sort for keys consisting only of uint64_t fields compared in their order,
+// like object_id (inode, stripe) and obj_ver_id (inode, stripe, version).
+// Bytes which are equal in all keys (usually most of them: high bytes of inode numbers,
+// stripes and versions) are found in the first pass and skipped, histograms of the rest
+// are collected in the second pass, and then each of them is sorted with one scatter pass
+template<class T> void radix_sort(T *list, size_t count)
+{
+    static_assert(sizeof(T) % sizeof(uint64_t) == 0, "radix_sort() key must consist of uint64_t fields");
+    const int words = sizeof(T) / sizeof(uint64_t);
+    if (count < RADIX_SORT_MIN)
+    {
+        std::sort(list, list+count);
+        return;
+    }
+    uint64_t first[words], diff[words] = { 0 };
+    memcpy(first, &list[0], sizeof(T));
+    for (size_t i = 1; i < count; i++)
+    {
+        uint64_t key[words];
+        memcpy(key, &list[i], sizeof(T));
+        for (int w = 0; w < words; w++)
+            diff[w] |= key[w] ^ first[w];
+    }
+    // Sorted digits, least significant first
+    int digits[words*8], digit_count = 0;
+    for (int w = words-1; w >= 0; w--)
+    {
+        for (int b = 0; b < 8; b++)
+        {
+            if ((diff[w] >> b*8) & 0xff)
+                digits[digit_count++] = w*8+b;
+        }
+    }
+    if (!digit_count)
+    {
+        return;
+    }
+    std::vector<size_t> counts(digit_count*256);
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t key[words];
+        memcpy(key, &list[i], sizeof(T));
+        for (int d = 0; d < digit_count; d++)
+            counts[d*256 + ((key[digits[d]/8] >> (digits[d]%8)*8) & 0xff)]++;
+    }
+    T *tmp = (T*)malloc_or_die(sizeof(T) * count);
+    T *src = list, *dst = tmp;
+    for (int d = 0; d < digit_count; d++)
+    {
+        size_t *c = &counts[d*256];
+        size_t pos = 0;
+        for (int v = 0; v < 256; v++)
+        {
+            size_t n = c[v];
+            c[v] = pos;
+            pos += n;
+        }
+        const int offset = (digits[d]/8)*sizeof(uint64_t), shift = (digits[d]%8)*8;
+        for (size_t i = 0; i < count; i++)
+        {
+            uint64_t key;
+            memcpy(&key, (uint8_t*)&src[i] + offset, sizeof(uint64_t));
+            dst[c[(key >> shift) & 0xff]++] = src[i];
+        }
+        std::swap(src, dst);
+    }
+    if (src != list)
+    {
+        memcpy(list, src, sizeof(T) * count);
+    }
+    free(tmp);
+}
+
+template<class T> void radix_sort(std::vector<T> & list)
+{
+    radix_sort(list.data(), list.size());
+}
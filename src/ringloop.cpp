@@ -2,6 +2,9 @@
 // License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
 
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
 
 #include <stdexcept>
 
@@ -14,7 +17,7 @@ ring_loop_t::ring_loop_t(int qd)
     {
         throw std::runtime_error(std::string("io_uring_queue_init: ") + strerror(-ret));
     }
-    free_ring_data_ptr = *ring.cq.kring_entries;
+    free_ring_data_ptr = ring_data_count = *ring.cq.kring_entries;
     ring_datas = (struct ring_data_t*)calloc(free_ring_data_ptr, sizeof(ring_data_t));
     free_ring_data = (int*)malloc(sizeof(int) * free_ring_data_ptr);
     if (!ring_datas || !free_ring_data)
@@ -64,6 +67,22 @@ void ring_loop_t::loop()
     while (!io_uring_peek_cqe(&ring, &cqe))
     {
         struct ring_data_t *d = (struct ring_data_t*)cqe->user_data;
+        // ring_data may also be owned by the operation's submitter, see get_sqe_for()
+        bool own_data = d >= ring_datas && d < ring_datas+ring_data_count;
+#ifdef IORING_CQE_F_MORE
+        if ((cqe->flags & IORING_CQE_F_MORE) && d->callback)
+        {
+            // Multishot operation continues, so keep its ring_data and callback.
+            // Call a copy of the callback because it may free ring_data
+            struct ring_data_t dl;
+            dl.iov = d->iov;
+            dl.res = cqe->res;
+            dl.cqe_flags = cqe->flags;
+            auto cb = d->callback;
+            cb(&dl);
+        }
+        else
+#endif
         if (d->callback)
         {
             // First free ring_data item, then call the callback
@@ -72,14 +91,17 @@ void ring_loop_t::loop()
             struct ring_data_t dl;
             dl.iov = d->iov;
             dl.res = cqe->res;
+            dl.cqe_flags = cqe->flags;
             dl.callback.swap(d->callback);
-            free_ring_data[free_ring_data_ptr++] = d - ring_datas;
+            if (own_data)
+                free_ring_data[free_ring_data_ptr++] = d - ring_datas;
             dl.callback(&dl);
         }
         else
         {
             printf("Warning: empty callback in SQE\n");
-            free_ring_data[free_ring_data_ptr++] = d - ring_datas;
+            if (own_data)
+                free_ring_data[free_ring_data_ptr++] = d - ring_datas;
         }
         io_uring_cqe_seen(&ring, cqe);
     }
@@ -108,7 +130,36 @@ void ring_loop_t::restore(unsigned sqe_tail)
     assert(ring.sq.sqe_tail >= sqe_tail);
     for (unsigned i = sqe_tail; i < ring.sq.sqe_tail; i++)
     {
-        free_ring_data[free_ring_data_ptr++] = ((ring_data_t*)ring.sq.sqes[i & *ring.sq.kring_mask].user_data) - ring_datas;
+        ring_data_t *d = (ring_data_t*)ring.sq.sqes[i & *ring.sq.kring_mask].user_data;
+        if (d >= ring_datas && d < ring_datas+ring_data_count)
+            free_ring_data[free_ring_data_ptr++] = d - ring_datas;
     }
     ring.sq.sqe_tail = sqe_tail;
 }
+
+int ring_loop_t::register_buf_ring(void *buf_ring, unsigned entries)
+{
+#ifdef IORING_RECV_MULTISHOT
+    // Registered directly because liburing only has io_uring_register_buf_ring() since 2.2
+    struct io_uring_buf_reg reg = { 0 };
+    reg.ring_addr = (uint64_t)buf_ring;
+    reg.ring_entries = entries;
+    reg.bgid = next_buf_group;
+    if (syscall(__NR_io_uring_register, ring.ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        return -errno;
+    }
+    return next_buf_group++;
+#else
+    return -ENOSYS;
+#endif
+}
+
+void ring_loop_t::unregister_buf_ring(int buf_group)
+{
+#ifdef IORING_RECV_MULTISHOT
+    struct io_uring_buf_reg reg = { 0 };
+    reg.bgid = buf_group;
+    syscall(__NR_io_uring_register, ring.ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+#endif
+}
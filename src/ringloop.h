@@ -25,7 +25,6 @@ static inline void my_uring_prep_rw(int op, struct io_uring_sqe *sqe, int fd, co
     sqe->addr = (unsigned long) addr;
     sqe->len = len;
     sqe->rw_flags = 0;
-    sqe->__pad2[0] = sqe->__pad2[1] = sqe->__pad2[2] = 0;
 }
 
 static inline void my_uring_prep_readv(struct io_uring_sqe *sqe, int fd, const struct iovec *iovecs, unsigned nr_vecs, off_t offset)
@@ -56,6 +55,12 @@ static inline void my_uring_prep_recvmsg(struct io_uring_sqe *sqe, int fd, struc
     sqe->msg_flags = flags;
 }
 
+static inline void my_uring_prep_recv(struct io_uring_sqe *sqe, int fd, void *buf, unsigned len, unsigned flags)
+{
+    my_uring_prep_rw(IORING_OP_RECV, sqe, fd, buf, len, 0);
+    sqe->msg_flags = flags;
+}
+
 static inline void my_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, unsigned flags)
 {
     my_uring_prep_rw(IORING_OP_SENDMSG, sqe, fd, msg, 1, 0);
@@ -79,6 +84,11 @@ static inline void my_uring_prep_fsync(struct io_uring_sqe *sqe, int fd, unsigne
     sqe->fsync_flags = fsync_flags;
 }
 
+static inline void my_uring_prep_fallocate(struct io_uring_sqe *sqe, int fd, int mode, off_t offset, off_t len)
+{
+    my_uring_prep_rw(IORING_OP_FALLOCATE, sqe, fd, (const void*)(unsigned long)len, mode, offset);
+}
+
 static inline void my_uring_prep_nop(struct io_uring_sqe *sqe)
 {
     my_uring_prep_rw(IORING_OP_NOP, sqe, 0, NULL, 0, 0);
@@ -112,6 +122,7 @@ struct ring_data_t
 {
     struct iovec iov; // for single-entry read/write operations
     int res;
+    unsigned cqe_flags; // IORING_CQE_F_MORE for multishot operations, buffer ID for provided buffers
     std::function<void(ring_data_t*)> callback;
 };
 
@@ -127,7 +138,8 @@ class ring_loop_t
     struct ring_data_t *ring_datas;
     int *free_ring_data;
     int wait_sqe_id;
-    unsigned free_ring_data_ptr;
+    unsigned free_ring_data_ptr, ring_data_count;
+    int next_buf_group = 0;
     bool loop_again;
     struct io_uring ring;
 public:
@@ -148,6 +160,20 @@ public:
         }
         return sqe;
     }
+    // Get an SQE for an operation with its own ring_data, like a multishot operation
+    // owned by a connection, which shouldn't occupy a ring_data slot while it runs
+    inline struct io_uring_sqe* get_sqe_for(struct ring_data_t *data)
+    {
+        if (free_ring_data_ptr == 0)
+            return NULL;
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+        if (sqe)
+        {
+            *sqe = { 0 };
+            io_uring_sqe_set_data(sqe, data);
+        }
+        return sqe;
+    }
     inline int wait_sqe(std::function<void()> cb)
     {
         get_sqe_queue.push_back({ wait_sqe_id, cb });
@@ -184,6 +210,10 @@ public:
     void loop();
     void wakeup();
 
+    // Register a ring of provided buffers for IOSQE_BUFFER_SELECT, returns buffer group ID or -errno
+    int register_buf_ring(void *buf_ring, unsigned entries);
+    void unregister_buf_ring(int buf_group);
+
     unsigned save();
     void restore(unsigned sqe_tail);
 };
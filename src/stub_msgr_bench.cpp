@@ -0,0 +1,279 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 or GNU GPL-2.0+ (see README.md for details)
+
+/**
+ * Messenger throughput benchmark: a client thread sends pipelined SEC_WRITE
+ * or SEC_READ operations over a loopback TCP connection to osd_messenger_t
+ * running in the same process. Writes are tested with buffered and with direct
+ * (use_direct_recv) receive, both synchronous and through io_uring, and with io_uring
+ * multishot receive (use_multishot_recv). Reads are tested with regular and with
+ * zero-copy (tcp_zerocopy_threshold) send of replies.
+ *
+ * USAGE: stub_msgr_bench [BLOCK_SIZE [IODEPTH [SECONDS [write|read]]]]
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <map>
+#include <thread>
+#include <stdexcept>
+
+#include "rw_blocking.h"
+#include "epoll_manager.h"
+#include "messenger.h"
+
+struct bench_result_t
+{
+    uint64_t ops = 0;
+    double seconds = 0;
+    uint64_t zerocopy_bytes = 0, zerocopy_copied = 0;
+};
+
+static int listen_loopback(int *port)
+{
+    sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0)
+    {
+        throw std::runtime_error(std::string("listen: ") + strerror(errno));
+    }
+    socklen_t addr_size = sizeof(addr);
+    getsockname(listen_fd, (sockaddr*)&addr, &addr_size);
+    *port = ntohs(addr.sin_port);
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL, 0) | O_NONBLOCK);
+    return listen_fd;
+}
+
+static void run_client(int port, unsigned bs, int iodepth, int seconds, bool read, bench_result_t *res)
+{
+    sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        perror("connect");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+    void *buf = memalign_or_die(MEM_ALIGNMENT, bs);
+    memset(buf, 0xaa, bs);
+    osd_any_op_t op = { 0 };
+    osd_any_reply_t reply;
+    op.hdr.magic = SECONDARY_OSD_OP_MAGIC;
+    op.hdr.opcode = read ? OSD_OP_SEC_READ : OSD_OP_SEC_WRITE;
+    op.sec_rw.oid.inode = 3;
+    op.sec_rw.len = bs;
+    timespec tv_begin, tv_end;
+    clock_gettime(CLOCK_MONOTONIC, &tv_begin);
+    uint64_t sent = 0, done = 0;
+    bool stop = false;
+    while (!stop || done < sent)
+    {
+        while (!stop && sent - done < iodepth)
+        {
+            op.hdr.id = ++sent;
+            op.sec_rw.oid.stripe = (sent << 17) % (1 << 29);
+            // *_blocking() functions modify iovecs
+            iovec iov[2] = { { op.buf, OSD_PACKET_SIZE }, { buf, bs } };
+            if (writev_blocking(fd, iov, read ? 1 : 2) != OSD_PACKET_SIZE + (read ? 0 : bs))
+            {
+                printf("write failed\n");
+                exit(1);
+            }
+        }
+        iovec reply_iov[2] = { { reply.buf, OSD_PACKET_SIZE }, { buf, bs } };
+        if (readv_blocking(fd, reply_iov, read ? 2 : 1) != OSD_PACKET_SIZE + (read ? bs : 0) ||
+            reply.hdr.magic != SECONDARY_OSD_REPLY_MAGIC || reply.hdr.retval != bs)
+        {
+            printf("bad reply\n");
+            exit(1);
+        }
+        done++;
+        if (!(done % 1024))
+        {
+            clock_gettime(CLOCK_MONOTONIC, &tv_end);
+            stop = stop || tv_end.tv_sec - tv_begin.tv_sec >= seconds;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tv_end);
+    res->ops = done;
+    res->seconds = (tv_end.tv_sec - tv_begin.tv_sec) + (tv_end.tv_nsec - tv_begin.tv_nsec)/1000000000.0;
+    free(buf);
+    close(fd);
+}
+
+static bench_result_t run_bench(json11::Json config, unsigned bs, int iodepth, int seconds, bool read, bool uring)
+{
+    int epoll_fd = -1;
+    std::map<int, std::function<void(int, int)>> handlers;
+    ring_loop_t *ringloop = NULL;
+    epoll_manager_t *epmgr = NULL;
+    timerfd_manager_t *tfd = NULL;
+    if (uring)
+    {
+        ringloop = new ring_loop_t(512);
+        epmgr = new epoll_manager_t(ringloop);
+        tfd = epmgr->tfd;
+    }
+    else
+    {
+        epoll_fd = epoll_create(1);
+        tfd = new timerfd_manager_t([&](int fd, bool wr, std::function<void(int, int)> handler)
+        {
+            if (!handler)
+            {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+                handlers.erase(fd);
+                return;
+            }
+            epoll_event ev;
+            ev.data.fd = fd;
+            ev.events = (wr ? EPOLLOUT : 0) | EPOLLIN | EPOLLRDHUP | EPOLLET;
+            if (epoll_ctl(epoll_fd, handlers.find(fd) != handlers.end() ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+                throw std::runtime_error(std::string("epoll_ctl: ") + strerror(errno));
+            handlers[fd] = handler;
+        });
+    }
+    osd_messenger_t *msgr = new osd_messenger_t();
+    msgr->osd_num = 1;
+    msgr->tfd = tfd;
+    msgr->ringloop = ringloop;
+    msgr->repeer_pgs = [](osd_num_t) {};
+    msgr->exec_op = [msgr](osd_op_t *op)
+    {
+        op->reply.hdr.magic = SECONDARY_OSD_REPLY_MAGIC;
+        op->reply.hdr.id = op->req.hdr.id;
+        op->reply.hdr.opcode = op->req.hdr.opcode;
+        op->reply.hdr.retval = op->req.sec_rw.len;
+        if (op->req.hdr.opcode == OSD_OP_SEC_READ)
+        {
+            op->buf = memalign_or_die(MEM_ALIGNMENT, op->req.sec_rw.len);
+            op->iov.push_back(op->buf, op->req.sec_rw.len);
+            op->reply.sec_rw.attr_len = 0;
+        }
+        msgr->outbox_push(op);
+    };
+    msgr->parse_config(config);
+    ring_consumer_t looper;
+    if (uring)
+    {
+        msgr->init();
+        looper.loop = [msgr, ringloop]()
+        {
+            msgr->read_requests();
+            msgr->send_replies();
+            ringloop->submit();
+        };
+        ringloop->register_consumer(&looper);
+    }
+    int port = 0;
+    int listen_fd = listen_loopback(&port);
+    if (!msgr->accept_multishot(listen_fd))
+    {
+        tfd->set_fd_handler(listen_fd, false, [msgr](int fd, int events)
+        {
+            msgr->accept_connections(fd);
+        });
+    }
+    bench_result_t res;
+    std::thread client(run_client, port, bs, iodepth, seconds, read, &res);
+    bool connected = false;
+    while (true)
+    {
+        if (uring)
+        {
+            ringloop->loop();
+            ringloop->wait();
+        }
+        else
+        {
+            epoll_event events[16];
+            int nfds = epoll_wait(epoll_fd, events, 16, 100);
+            for (int i = 0; i < nfds; i++)
+            {
+                auto h_it = handlers.find(events[i].data.fd);
+                if (h_it != handlers.end())
+                {
+                    auto cb = h_it->second;
+                    cb(events[i].data.fd, events[i].events);
+                }
+            }
+        }
+        if (msgr->clients.size())
+            connected = true;
+        else if (connected)
+            break;
+    }
+    client.join();
+    res.zerocopy_bytes = msgr->stats.zerocopy_send_bytes;
+    res.zerocopy_copied = msgr->stats.zerocopy_copied_sends;
+    tfd->set_fd_handler(listen_fd, false, NULL);
+    close(listen_fd);
+    delete msgr;
+    if (uring)
+    {
+        ringloop->unregister_consumer(&looper);
+        ringloop->loop();
+        delete epmgr;
+        delete ringloop;
+    }
+    else
+    {
+        delete tfd;
+        close(epoll_fd);
+    }
+    return res;
+}
+
+int main(int narg, char *args[])
+{
+    unsigned bs = narg > 1 ? atoi(args[1]) : 4096;
+    int iodepth = narg > 2 ? atoi(args[2]) : 32;
+    int seconds = narg > 3 ? atoi(args[3]) : 5;
+    bool read = narg > 4 && !strcmp(args[4], "read");
+    if (!bs || iodepth <= 0 || seconds <= 0 || narg > 4 && !read && strcmp(args[4], "write") != 0)
+    {
+        printf("USAGE: %s [BLOCK_SIZE [IODEPTH [SECONDS [write|read]]]]\n", args[0]);
+        return 1;
+    }
+    const char *names[] = { "buffered receive", "direct receive", "io_uring buffered receive", "io_uring direct receive", "multishot receive" };
+    for (int variant = 0; variant <= (read ? 1 : 4); variant++)
+    {
+        json11::Json::object config;
+        if (read)
+            config["tcp_zerocopy_threshold"] = variant ? 65536 : 0;
+        else
+        {
+            config["use_direct_recv"] = variant % 2 ? true : false;
+            config["use_multishot_recv"] = variant == 4;
+        }
+        bench_result_t res = run_bench(config, bs, iodepth, seconds, read, !read && variant >= 2);
+        printf(
+            "%s: %u byte %s, iodepth %d: %.0f iops, %.1f MB/s\n",
+            read ? (variant ? "zero-copy send" : "regular send") : names[variant],
+            bs, read ? "reads" : "writes", iodepth, res.ops/res.seconds, res.ops*bs/res.seconds/1024/1024
+        );
+        if (res.zerocopy_bytes)
+        {
+            printf("  %lu bytes sent with MSG_ZEROCOPY, %lu send(s) copied by the kernel\n", res.zerocopy_bytes, res.zerocopy_copied);
+        }
+    }
+    return 0;
+}
@@ -14,6 +14,7 @@ void send_read(cluster_client_t *cli, uint64_t inode, std::function<void(int, ui
     op->inode = inode;
     op->offset = 0;
     op->len = 4096;
+    op->flags = OSD_OP_NEED_VERSION;
     op->iov.push_back(malloc_or_die(op->len), op->len);
     op->callback = [cb](cluster_op_t *op)
     {
@@ -399,9 +399,292 @@ void test2()
     printf("[ok] copy_write test\n");
 }
 
+void pretend_connected_extra(cluster_client_t *cli, osd_num_t osd_num, int peer_fd)
+{
+    printf("OSD %lu additional connection %d\n", osd_num, peer_fd);
+    cli->msgr.osd_peer_extra_fds[osd_num].push_back(peer_fd);
+    cli->msgr.clients[peer_fd] = new osd_client_t();
+    cli->msgr.clients[peer_fd]->osd_num = osd_num;
+    cli->msgr.clients[peer_fd]->peer_extra = true;
+    cli->msgr.clients[peer_fd]->peer_state = PEER_CONNECTED;
+}
+
+void test3()
+{
+    json11::Json config;
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    object_id oid = { .inode = 0x1000000000001, .stripe = 0 };
+
+    // Without additional connections, the main one is always selected
+    assert(cli->msgr.select_peer_fd(1, oid) == -1);
+    pretend_connected(cli, 1);
+    int main_fd = cli->msgr.osd_peer_fds.at(1);
+    assert(cli->msgr.select_peer_fd(1, oid) == main_fd);
+    // The connection with the least outstanding bytes is selected
+    pretend_connected_extra(cli, 1, main_fd+1);
+    pretend_connected_extra(cli, 1, main_fd+2);
+    cli->msgr.clients[main_fd]->outstanding_bytes = 8192;
+    cli->msgr.clients[main_fd+1]->outstanding_bytes = 4096;
+    cli->msgr.clients[main_fd+2]->outstanding_bytes = 0;
+    for (uint64_t stripe = 0; stripe < 16*0x20000; stripe += 0x20000)
+    {
+        oid.stripe = stripe;
+        assert(cli->msgr.select_peer_fd(1, oid) == main_fd+2);
+    }
+    cli->msgr.clients[main_fd+2]->outstanding_bytes = 65536;
+    assert(cli->msgr.select_peer_fd(1, oid) == main_fd+1);
+    // Additional connections are stopped together with the main one
+    pretend_disconnected(cli, 1);
+    check_disconnected(cli, 1);
+    assert(cli->msgr.osd_peer_extra_fds.find(1) == cli->msgr.osd_peer_extra_fds.end());
+    assert(cli->msgr.clients.size() == 0);
+    // Stopping an additional connection also stops the main one
+    pretend_connected(cli, 1);
+    main_fd = cli->msgr.osd_peer_fds.at(1);
+    pretend_connected_extra(cli, 1, main_fd+1);
+    pretend_connected_extra(cli, 1, main_fd+2);
+    cli->msgr.stop_client(main_fd+2);
+    check_disconnected(cli, 1);
+    assert(cli->msgr.clients.size() == 0);
+
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] peer connection selection test\n");
+}
+
+class drr_test_messenger_t: public osd_messenger_t
+{
+public:
+    using osd_messenger_t::primary_queue_depth;
+    using osd_messenger_t::set_immediate;
+    using osd_messenger_t::exec_inflight;
+    using osd_messenger_t::enqueue_client_op;
+    using osd_messenger_t::exec_client_ops;
+    using osd_messenger_t::finish_client_op;
+};
+
+void test4()
+{
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    drr_test_messenger_t *msgr = new drr_test_messenger_t();
+    msgr->tfd = tfd;
+    msgr->ringloop = NULL;
+    msgr->primary_queue_depth = 4;
+    std::vector<osd_op_t*> started;
+    msgr->exec_op = [&](osd_op_t *op) { started.push_back(op); };
+    // Inode 1 exceeds its QoS limit, inode 2 doesn't have one
+    msgr->qos_delay = [](osd_op_t *op) -> uint64_t { return op->req.rw.inode == 1 ? 1000000 : 0; };
+    const int throttled_fd = 10, free_fd = 11;
+    for (int fd: { throttled_fd, free_fd })
+    {
+        msgr->clients[fd] = new osd_client_t();
+        msgr->clients[fd]->peer_fd = fd;
+        msgr->clients[fd]->peer_state = PEER_CONNECTED;
+    }
+    // The throttled client queues its operations first and more of them than primary_queue_depth
+    for (int fd: { throttled_fd, free_fd })
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            osd_op_t *op = new osd_op_t();
+            op->op_type = OSD_OP_IN;
+            op->peer_fd = fd;
+            op->req.hdr.opcode = OSD_OP_WRITE;
+            op->req.hdr.id = i;
+            op->req.rw.inode = fd == throttled_fd ? 1 : 2;
+            op->req.rw.len = 4096;
+            msgr->enqueue_client_op(msgr->clients[fd], op);
+        }
+    }
+    auto run_immediate = [&]()
+    {
+        std::vector<std::function<void()>> to_run;
+        to_run.swap(msgr->set_immediate);
+        for (auto & cb: to_run)
+            cb();
+    };
+    run_immediate();
+    // Delayed operations don't take execution slots, so the other client gets all of them
+    assert(started.size() == 4);
+    for (auto op: started)
+        assert(op->peer_fd == free_fd);
+    assert(msgr->exec_inflight == 4);
+    assert(msgr->clients[throttled_fd]->exec_ops == 0);
+    assert(msgr->clients[throttled_fd]->exec_qos_timer_id >= 0);
+    // ...and all its operations complete while the throttled client still waits
+    for (int n = 0; n < 2; n++)
+    {
+        std::vector<osd_op_t*> done;
+        done.swap(started);
+        for (auto op: done)
+        {
+            msgr->finish_client_op(msgr->clients[op->peer_fd]);
+            delete op;
+        }
+        msgr->exec_client_ops();
+        assert(started.size() == (n == 0 ? 4 : 0));
+        for (auto op: started)
+            assert(op->peer_fd == free_fd);
+    }
+    assert(msgr->exec_inflight == 0);
+    assert(msgr->clients[free_fd]->exec_queue.size() == 0);
+    assert(msgr->clients[throttled_fd]->exec_queue.size() == 8);
+    // Stopping the throttled client cancels its QoS timer and frees its queued operations
+    for (int fd: { throttled_fd, free_fd })
+    {
+        msgr->clients[fd]->received_ops.clear();
+        msgr->stop_client(fd, true, true);
+    }
+    assert(msgr->clients.size() == 0);
+    delete msgr;
+    delete tfd;
+    printf("[ok] QoS-limited client doesn't block other clients\n");
+}
+
+void configure_ec_pool(cluster_client_t *cli)
+{
+    cli->st_cli.on_load_pgs_hook(true);
+    cli->st_cli.parse_state((etcd_kv_t){
+        .key = "/config/pools",
+        .value = json11::Json::object {
+            { "1", json11::Json::object {
+                { "name", "ecpool" },
+                { "scheme", "xor" },
+                { "pg_size", 3 },
+                { "parity_chunks", 1 },
+                { "pg_minsize", 2 },
+                { "pg_count", 1 },
+                { "failure_domain", "osd" },
+            } }
+        },
+    });
+    cli->st_cli.parse_state((etcd_kv_t){
+        .key = "/config/pgs",
+        .value = json11::Json::object {
+            { "items", json11::Json::object {
+                { "1", json11::Json::object {
+                    { "1", json11::Json::object {
+                        { "osd_set", json11::Json::array { 1, 2, 3 } },
+                        { "primary", 1 },
+                    } }
+                } }
+            } }
+        },
+    });
+    cli->st_cli.parse_state((etcd_kv_t){
+        .key = "/pg/state/1/1",
+        .value = json11::Json::object {
+            { "peers", json11::Json::array { 1, 2, 3 } },
+            { "cur_set", json11::Json::array { 1, 2, 3 } },
+            { "primary", 1 },
+            { "state", json11::Json::array { "active" } },
+        },
+        .mod_revision = 10,
+    });
+    std::map<std::string, etcd_kv_t> changes;
+    cli->st_cli.on_change_hook(changes);
+}
+
+int *test_read(cluster_client_t *cli, uint64_t offset, uint64_t len)
+{
+    printf("Post read %lx+%lx\n", offset, len);
+    int *r = new int;
+    *r = -1;
+    cluster_op_t *op = new cluster_op_t();
+    op->opcode = OSD_OP_READ;
+    op->inode = 0x1000000000001;
+    op->offset = offset;
+    op->len = len;
+    op->iov.push_back(malloc_or_die(len), len);
+    op->callback = [r](cluster_op_t *op)
+    {
+        *r = op->retval == op->len ? 1 : 0;
+        free(op->iov.buf[0].iov_base);
+        printf("Done read %lx+%lx r=%d\n", op->offset, op->len, op->retval);
+        delete op;
+    };
+    cli->execute(op);
+    return r;
+}
+
+osd_op_t *find_direct_read(cluster_client_t *cli, osd_num_t osd_num)
+{
+    int peer_fd = cli->msgr.osd_peer_fds.at(osd_num);
+    for (auto & op_pair: cli->msgr.clients[peer_fd]->sent_ops)
+    {
+        if (op_pair.second->req.hdr.opcode == OSD_OP_SEC_READ)
+            return op_pair.second;
+    }
+    return NULL;
+}
+
+void pretend_direct_read_completed(cluster_client_t *cli, osd_op_t *op, int64_t retval, uint64_t version)
+{
+    assert(op);
+    printf("Pretend completed direct read %lx:%lx+%x r=%ld v%lu\n", op->req.sec_rw.oid.inode,
+        op->req.sec_rw.oid.stripe, op->req.sec_rw.len, retval, version);
+    cli->msgr.clients[op->peer_fd]->sent_ops.erase(op->req.hdr.id);
+    op->reply.hdr.magic = SECONDARY_OSD_REPLY_MAGIC;
+    op->reply.hdr.id = op->req.hdr.id;
+    op->reply.hdr.opcode = op->req.hdr.opcode;
+    op->reply.hdr.retval = retval < 0 ? retval : op->req.sec_rw.len;
+    op->reply.sec_rw.version = version;
+    std::function<void(osd_op_t*)>(op->callback)(op);
+}
+
+void test5()
+{
+    json11::Json config;
+    timerfd_manager_t *tfd = new timerfd_manager_t([](int fd, bool wr, std::function<void(int, int)> callback){});
+    cluster_client_t *cli = new cluster_client_t(NULL, tfd, config);
+    json11::Json::object global_config = { { "direct_ec_reads", true } };
+    cli->st_cli.on_load_config_hook(global_config);
+    configure_ec_pool(cli);
+    pretend_connected(cli, 1);
+    pretend_connected(cli, 2);
+    pretend_connected(cli, 3);
+    const uint64_t chunk = cli->get_bs_block_size();
+    // 1) Both chunks are stable and have the same version: the read is served directly
+    int *r = test_read(cli, 0, 2*chunk);
+    check_op_count(cli, 1, 1);
+    check_op_count(cli, 2, 1);
+    check_op_count(cli, 3, 0);
+    pretend_direct_read_completed(cli, find_direct_read(cli, 1), 0, 5);
+    pretend_direct_read_completed(cli, find_direct_read(cli, 2), 0, 5);
+    check_completed(r);
+    // 2) The second chunk has a write in progress and the OSD refuses the read: retry through the primary
+    r = test_read(cli, 0, 2*chunk);
+    pretend_direct_read_completed(cli, find_direct_read(cli, 1), 0, 5);
+    assert(*r == -1);
+    pretend_direct_read_completed(cli, find_direct_read(cli, 2), -EAGAIN, 0);
+    assert(*r == -1);
+    check_op_count(cli, 1, 1);
+    check_op_count(cli, 2, 0);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 2*chunk), 0);
+    check_completed(r);
+    // 3) A write completed between reads of two chunks, so they have different versions:
+    //    the read is torn and is also retried through the primary
+    r = test_read(cli, 0, 2*chunk);
+    pretend_direct_read_completed(cli, find_direct_read(cli, 2), 0, 6);
+    pretend_direct_read_completed(cli, find_direct_read(cli, 1), 0, 5);
+    assert(*r == -1);
+    check_op_count(cli, 1, 1);
+    pretend_op_completed(cli, find_op(cli, 1, OSD_OP_READ, 0, 2*chunk), 0);
+    check_completed(r);
+    // Free client
+    delete cli;
+    delete tfd;
+    printf("[ok] direct read racing a write is retried through the primary\n");
+}
+
 int main(int narg, char *args[])
 {
     test1();
     test2();
+    test3();
+    test4();
+    test5();
     return 0;
 }
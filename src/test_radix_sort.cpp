@@ -0,0 +1,95 @@
+// Copyright (c) Vitaliy Filippov, 2019+
+// License: VNPL-1.1 (see README.md for details)
+
+#include <stdio.h>
+#include <time.h>
+#include "object_id.h"
+#include "radix_sort.h"
+
+static double elapsed_ms(timespec & tv_begin)
+{
+    timespec tv_end;
+    clock_gettime(CLOCK_REALTIME, &tv_end);
+    return (tv_end.tv_sec - tv_begin.tv_sec)*1000.0 + (tv_end.tv_nsec - tv_begin.tv_nsec)/1000000.0;
+}
+
+// Shuffled object list like the one of a sharded blockstore: a few inodes,
+// sequential stripes and small versions
+static void fill_list(std::vector<obj_ver_id> & list, size_t count, uint64_t seed)
+{
+    list.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        list[i] = {
+            .oid = {
+                .inode = (1ul << 48) | (i % 7 + 1),
+                .stripe = (i / 7) << 17,
+            },
+            .version = (i * 0x9E3779B97F4A7C15) % 5 + 1,
+        };
+    }
+    for (size_t i = count; i > 1; i--)
+    {
+        seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+        std::swap(list[i-1], list[(seed >> 33) % i]);
+    }
+}
+
+static void check_sort(size_t count, uint64_t seed)
+{
+    std::vector<obj_ver_id> a, b;
+    fill_list(a, count, seed);
+    b = a;
+    std::sort(a.begin(), a.end());
+    radix_sort(b);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (a[i] < b[i] || b[i] < a[i])
+        {
+            printf("radix_sort() result differs from std::sort() at %lu of %lu\n", i, count);
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    check_sort(0, 1);
+    check_sort(100, 2);
+    check_sort(RADIX_SORT_MIN, 3);
+    check_sort(100000, 4);
+    // Random full-width keys don't have equal bytes to skip
+    std::vector<object_id> oids(100000), oids2;
+    uint64_t seed = 5;
+    for (auto & oid: oids)
+    {
+        seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+        oid.inode = seed;
+        seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+        oid.stripe = seed;
+    }
+    oids2 = oids;
+    std::sort(oids.begin(), oids.end());
+    radix_sort(oids2);
+    for (size_t i = 0; i < oids.size(); i++)
+    {
+        if (oids[i] != oids2[i])
+        {
+            printf("radix_sort() result differs from std::sort() for random object_ids at %lu\n", i);
+            exit(1);
+        }
+    }
+    // Benchmark
+    size_t count = argc > 1 ? atoll(argv[1]) : 8*1024*1024;
+    std::vector<obj_ver_id> list;
+    timespec tv_begin;
+    fill_list(list, count, 6);
+    clock_gettime(CLOCK_REALTIME, &tv_begin);
+    std::sort(list.begin(), list.end());
+    printf("std::sort: %lu entries in %.3f ms\n", count, elapsed_ms(tv_begin));
+    fill_list(list, count, 6);
+    clock_gettime(CLOCK_REALTIME, &tv_begin);
+    radix_sort(list);
+    printf("radix_sort: %lu entries in %.3f ms\n", count, elapsed_ms(tv_begin));
+    return 0;
+}